@@ -0,0 +1,256 @@
+/**
+ * @brief  per thread pool of receive buffers in size classes
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * A fetcher takes a buffer as the body starts to arrive, of the size the
+ * header announced or, if it announced none, of the longest body seen
+ * lately. A body longer than that moves once to a buffer at least twice
+ * the size. Sizes come in classes four to an octave, as in srv_pool.h, so
+ * a buffer wastes at most a fifth of itself. A buffer given back is kept on
+ * a short free list of its class for the next transfer, so a fetcher that
+ * drops what it received needs no allocation at all. One that keeps it
+ * hands it over with bp_give() instead of copying it out: from then on it
+ * is the caller's, to free().
+ *
+ * A pool belongs to one thread and takes no locks. bp_stats_add() sums
+ * the counts of several pools, and bp_report() prints the allocator calls
+ * and the bytes copied per strip.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lab_png.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define BP_MIN     4096   /* smallest buffer */
+#define BP_CLASSES 48     /* 4 per octave, BP_MIN up to 4096 times that */
+#define BP_KEEP    2      /* free buffers kept per class */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+struct bp_stats {
+    U64 mallocs;            /* buffers allocated */
+    U64 frees;              /* buffers released to the allocator */
+    U64 reuses;             /* buffers taken off a free list instead */
+    U64 grows;              /* bodies that outgrew their buffer */
+    U64 handoffs;           /* buffers handed over with their contents */
+    U64 bytes_recv;         /* copied in from the transfers */
+    U64 bytes_moved;        /* copied again when a buffer grew */
+};
+
+typedef struct buf_pool {
+    void *free[BP_CLASSES][BP_KEEP];
+    int n_free[BP_CLASSES];
+    size_t hint;            /* longest body of late, decaying; 0 at first */
+    struct bp_stats st;
+} *buf_pool_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+void bp_init(struct buf_pool *bp);
+void *bp_get(struct buf_pool *bp, size_t need, size_t *cap);
+void bp_put(struct buf_pool *bp, void *buf, size_t cap);
+int bp_fit(struct buf_pool *bp, char **buf, size_t *cap, size_t used, size_t need);
+size_t bp_expect(struct buf_pool *bp, long announced);
+void bp_seen(struct buf_pool *bp, size_t len);
+void bp_give(struct buf_pool *bp);
+void bp_stats_add(struct bp_stats *dst, const struct bp_stats *src);
+void bp_report(const struct bp_stats *st, U64 strips, FILE *fp);
+void bp_cleanup(struct buf_pool *bp);
+
+/**
+ * @brief set up an empty pool
+ */
+void bp_init(struct buf_pool *bp)
+{
+    memset(bp, 0, sizeof(*bp));
+}
+
+/**
+ * @brief the smallest class that holds n bytes
+ * @return its index, BP_CLASSES or more if n is beyond the biggest class
+ */
+static int bp_class(size_t n)
+{
+    U64 m = (n > BP_MIN ? n : BP_MIN) - 1;
+    int msb = 63 - __builtin_clzll(m);
+
+    return 4 * msb + ((m >> (msb - 2)) & 3) - (4 * 11 + 3);  /* BP_MIN is class 0 */
+}
+
+/**
+ * @brief bytes in a buffer of class c
+ */
+static size_t bp_size(int c)
+{
+    c += 4 * 11 + 3;
+    return (size_t)(5 + c % 4) << (c / 4 - 2);
+}
+
+/**
+ * @brief a buffer of at least need bytes, from a free list if one is there
+ * @param size_t *cap output parameter, the bytes it really has
+ * @return the buffer; NULL if out of memory
+ */
+void *bp_get(struct buf_pool *bp, size_t need, size_t *cap)
+{
+    int c = bp_class(need);
+    void *buf;
+
+    if (c < BP_CLASSES && bp->n_free[c] > 0) {
+        bp->st.reuses++;
+        *cap = bp_size(c);
+        return bp->free[c][--bp->n_free[c]];
+    }
+    *cap = c < BP_CLASSES ? bp_size(c) : need;  /* too big to pool, as is */
+    buf = malloc(*cap);
+    if (buf != NULL) {
+        bp->st.mallocs++;
+    }
+    return buf;
+}
+
+/**
+ * @brief give a buffer from bp_get() back; its contents are not kept
+ * @param size_t cap what bp_get() said it has
+ */
+void bp_put(struct buf_pool *bp, void *buf, size_t cap)
+{
+    int c = bp_class(cap);
+
+    if (buf == NULL) {
+        return;
+    }
+    if (c < BP_CLASSES && bp_size(c) == cap && bp->n_free[c] < BP_KEEP) {
+        bp->free[c][bp->n_free[c]++] = buf;
+        return;
+    }
+    free(buf);
+    bp->st.frees++;
+}
+
+/**
+ * @brief make sure *buf holds need bytes, the first used of which are kept.
+ *        A NULL *buf gets a buffer of need bytes; a full one moves to one at
+ *        least twice as big, so a long body of unknown length moves only a
+ *        few times.
+ * @param char **buf in and output parameter, the buffer or NULL
+ * @param size_t *cap in and output parameter, its size
+ * @return 0 on success; -1 if out of memory, *buf is unchanged then
+ */
+int bp_fit(struct buf_pool *bp, char **buf, size_t *cap, size_t used, size_t need)
+{
+    size_t want = need;
+    size_t got;
+    char *q;
+
+    if (need <= *cap && *buf != NULL) {
+        return 0;
+    }
+    if (*buf != NULL && want < 2 * *cap) {
+        want = 2 * *cap;
+    }
+    q = bp_get(bp, want, &got);
+    if (q == NULL) {
+        return -1;
+    }
+    if (*buf != NULL) {
+        memcpy(q, *buf, used);
+        bp->st.grows++;
+        bp->st.bytes_moved += used;
+        bp_put(bp, *buf, *cap);
+    }
+    *buf = q;
+    *cap = got;
+    return 0;
+}
+
+/**
+ * @brief bytes to take for a body when it starts to arrive
+ * @param long announced its Content-Length; <0 if the header had none
+ * @return the length and a byte for a terminating 0, or if unknown the
+ *         longest body of late
+ */
+size_t bp_expect(struct buf_pool *bp, long announced)
+{
+    return announced >= 0 ? (size_t)announced + 1 : bp->hint;
+}
+
+/**
+ * @brief note the length of a body received, or announced, so a body of
+ *        unknown length gets a buffer that probably fits; a long one is
+ *        forgotten over the next few
+ */
+void bp_seen(struct buf_pool *bp, size_t len)
+{
+    bp->hint -= bp->hint / 8;
+    if (len > bp->hint) {
+        bp->hint = len;
+    }
+}
+
+/**
+ * @brief count a buffer from bp_get() handed over with its contents: it
+ *        is no longer the pool's, free() releases it
+ */
+void bp_give(struct buf_pool *bp)
+{
+    bp->st.handoffs++;
+}
+
+/**
+ * @brief add the counts of src to dst; any number of threads may add to the
+ *        same dst at once
+ */
+void bp_stats_add(struct bp_stats *dst, const struct bp_stats *src)
+{
+    __atomic_fetch_add(&dst->mallocs, src->mallocs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->frees, src->frees, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->reuses, src->reuses, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->grows, src->grows, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->handoffs, src->handoffs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->bytes_recv, src->bytes_recv, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->bytes_moved, src->bytes_moved, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief print the allocator calls and the bytes copied, in all and per
+ *        strip kept
+ * @param U64 strips strips the buffers brought in
+ */
+void bp_report(const struct bp_stats *st, U64 strips, FILE *fp)
+{
+    double n = strips ? strips : 1;
+
+    fprintf(fp, "bufs: %lu mallocs, %lu frees, %lu reused from a free list, %lu grown, "
+            "%lu handed over uncopied\n", st->mallocs, st->frees, st->reuses,
+            st->grows, st->handoffs);
+    fprintf(fp, "bufs: per strip %.2f allocator calls, %.0f bytes copied in, "
+            "%.0f moved on growth\n", (st->mallocs + st->frees) / n,
+            st->bytes_recv / n, st->bytes_moved / n);
+}
+
+/**
+ * @brief release the buffers on the free lists; the counts stay
+ */
+void bp_cleanup(struct buf_pool *bp)
+{
+    for (int c = 0; c < BP_CLASSES; c++) {
+        while (bp->n_free[c] > 0) {
+            free(bp->free[c][--bp->n_free[c]]);
+            bp->st.frees++;
+        }
+    }
+}
@@ -0,0 +1,288 @@
+/********************************************************************
+ * @file: crc.h
+ * @brief: PNG crc calculation
+ * Reference: https://www.w3.org/TR/PNG-CRCAppendix.html
+ *
+ * update_crc() keeps the interface of the reference code above but picks
+ * the fastest kernel the CPU has when the program starts:
+ *  - crc32_pclmul():  folds 64 bytes per step with carry-less multiply,
+ *    see "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ *    Instruction", V. Gopal, E. Ozturk, et al., Intel, 2009
+ *  - crc32_slice8():  slicing-by-8, eight table lookups per 8 bytes
+ *  - crc32_bytewise(): the reference one-table-lookup-per-byte loop
+ * All kernels work on the running (pre-inverted) crc, like update_crc().
+ */
+#pragma once
+
+#include <string.h>
+#include "lab_png.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define CRC_HAVE_PCLMUL 1
+#else
+#  define CRC_HAVE_PCLMUL 0
+#endif
+
+#define CRC_POLY 0xedb88320L  /* reflected CRC-32 polynomial */
+
+/* Tables of CRCs of all 8-bit messages. crc_table[0] is the table of the
+   reference code, crc_table[k] advances a byte that is k bytes further away
+   from the end of an 8 byte block. Filled once before main() runs, so no
+   caller ever sees a half built table. */
+U32 crc_table[8][256];
+
+/* x^(2^n) mod p(x), used by crc_combine() */
+U32 crc_x2n_table[32];
+
+typedef U32 (*crc_kernel_t)(U32 c, const U8 *buf, U64 len);
+
+U32 crc32_bytewise(U32 c, const U8 *buf, U64 len);
+U32 crc32_slice8(U32 c, const U8 *buf, U64 len);
+U32 crc32_pclmul(U32 c, const U8 *buf, U64 len);
+U32 crc_multmodp(U32 a, U32 b);
+
+/* the kernel update_crc() runs, chosen by make_crc_table() */
+crc_kernel_t crc_kernel = crc32_slice8;
+
+/* Make the tables for a fast CRC and pick the kernel for this CPU */
+__attribute__((constructor)) void make_crc_table(void)
+{
+    U32 c;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        c = (U32) n;
+        for (k = 0; k < 8; k++) {
+            if (c & 1)
+                c = CRC_POLY ^ (c >> 1);
+            else
+                c = c >> 1;
+        }
+        crc_table[0][n] = c;
+    }
+    for (n = 0; n < 256; n++) {
+        c = crc_table[0][n];
+        for (k = 1; k < 8; k++) {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[k][n] = c;
+        }
+    }
+
+    c = (U32)1 << 30; /* x^1 */
+    crc_x2n_table[0] = c;
+    for (n = 1; n < 32; n++) {
+        crc_x2n_table[n] = c = crc_multmodp(c, c);
+    }
+
+#if CRC_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        crc_kernel = crc32_pclmul;
+    }
+#endif
+}
+
+/* Update a running CRC with the bytes buf[0..len-1], one byte at a time */
+U32 crc32_bytewise(U32 c, const U8 *buf, U64 len)
+{
+    U64 n;
+
+    for (n = 0; n < len; n++) {
+        c = crc_table[0][(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    }
+    return c;
+}
+
+/* Update a running CRC with the bytes buf[0..len-1], 8 bytes at a time */
+U32 crc32_slice8(U32 c, const U8 *buf, U64 len)
+{
+    U32 lo, hi;
+
+    /* byte at a time until buf is 4 byte aligned */
+    while (len > 0 && ((unsigned long)buf & 3) != 0) {
+        c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= c;
+        c = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+            crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+            crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+
+    return crc32_bytewise(c, buf, len);
+}
+
+#if CRC_HAVE_PCLMUL
+/* Fold len bytes of buf into the running crc c. len must be at least 64
+   and a multiple of 16. The constants are the bit-reflected k1..k5 and
+   Barrett reduction values for the CRC-32 polynomial from the paper. */
+__attribute__((target("pclmul,sse4.1")))
+static U32 crc32_pclmul_fold(U32 c, const U8 *buf, U64 len)
+{
+    static const U64 __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    static const U64 __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    static const U64 __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    static const U64 __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold 4 x 128 bits in parallel while 64 bytes are left */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the 4 lanes into one */
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* fold the remaining 16 byte blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits down to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction down to 32 bits */
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (U32)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+/* Update a running CRC with the bytes buf[0..len-1], folding 64 bytes per
+   step with PCLMULQDQ. Only valid on CPUs where make_crc_table() picked it;
+   short buffers and the tail go through slicing-by-8. */
+U32 crc32_pclmul(U32 c, const U8 *buf, U64 len)
+{
+#if CRC_HAVE_PCLMUL
+    if (len >= 64) {
+        U64 n = len & ~(U64)15;
+        c = crc32_pclmul_fold(c, buf, n);
+        buf += n;
+        len -= n;
+    }
+#endif
+    return crc32_slice8(c, buf, len);
+}
+
+/* Update a running CRC with the bytes buf[0..len-1]--the CRC
+   should be initialized to all 1's, and the transmitted value
+   is the 1's complement of the final running CRC (see the
+   crc() routine below)). */
+
+unsigned long update_crc(unsigned long crc, unsigned char *buf, U64 len)
+{
+    return crc_kernel((U32)crc, buf, len);
+}
+
+/* Return the CRC of the bytes buf[0..len-1]. */
+unsigned long crc(unsigned char *buf, U64 len)
+{
+    return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
+}
+
+/* Return a(x) * b(x) modulo p(x), bit reflected like the crc itself */
+U32 crc_multmodp(U32 a, U32 b)
+{
+    U32 m = (U32)1 << 31;
+    U32 p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC_POLY : b >> 1;
+    }
+    return p;
+}
+
+/**
+ * @brief combine the CRCs of two adjacent pieces of data, e.g. pieces whose
+ *        CRCs were computed on different threads
+ * @param U32 crc1 crc() of the first piece
+ * @param U32 crc2 crc() of the second piece
+ * @param U64 len2 length of the second piece in bytes
+ * @return crc() of the first piece followed by the second
+ */
+U32 crc_combine(U32 crc1, U32 crc2, U64 len2)
+{
+    U32 p = (U32)1 << 31; /* x^0 */
+    unsigned k = 3;       /* len2 bytes = len2 * 2^3 bits */
+
+    while (len2) {
+        if (len2 & 1) {
+            p = crc_multmodp(crc_x2n_table[k & 31], p);
+        }
+        len2 >>= 1;
+        k++;
+    }
+    return crc_multmodp(p, crc1) ^ crc2;
+}
@@ -0,0 +1,205 @@
+/**
+ * @brief  one libcurl transport shared by all the fetcher threads
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * curl_global_init() is not thread-safe, so it runs once here instead of in
+ * every thread. The threads' easy handles share one CURLSH holding the DNS
+ * cache, the TLS session cache and the connection pool, each behind its own
+ * mutex. A name is resolved once, a TLS session is resumed instead of being
+ * negotiated again, and a thread can pick up a connection another thread
+ * left open. Each thread keeps its easy handle for all of its requests, with
+ * TCP keep-alive on and Nagle off.
+ *
+ * cs_account() after every transfer adds up how many connections had to be
+ * opened and how long the connects and TLS handshakes took, which
+ * cs_report() prints, so the saving is visible.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <stdio.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include "lab_png.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define CS_USER_AGENT "libcurl-agent/1.0" /* some servers require one */
+#define CS_KEEPIDLE   30                  /* seconds idle before probing */
+#define CS_KEEPINTVL  10                  /* seconds between probes */
+#define CS_MAXCONNS   64                  /* idle connections the pool keeps */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+typedef struct curl_share {
+    CURLSH *sh;
+    pthread_mutex_t lock[CURL_LOCK_DATA_LAST];
+    pthread_mutex_t stats_mutex;
+    /* totals over every transfer, see cs_account() */
+    U64 requests;
+    U64 connects;           /* connections opened, the rest were reused */
+    U64 handshakes;         /* TLS handshakes among them */
+    double t_connect;       /* seconds spent connecting, DNS included */
+    double t_tls;           /* seconds spent in TLS handshakes */
+    double t_total;         /* seconds of whole transfers */
+    double t_connect_max;
+} *curl_share_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int cs_init(struct curl_share *s);
+CURL *cs_easy(struct curl_share *s, const char *url);
+void cs_account(struct curl_share *s, CURL *h);
+void cs_report(struct curl_share *s, FILE *fp);
+void cs_cleanup(struct curl_share *s);
+
+static void cs_lock(CURL *h, curl_lock_data data, curl_lock_access access, void *userp)
+{
+    struct curl_share *s = userp;
+
+    (void) h;
+    (void) access;
+    pthread_mutex_lock(s->lock + data);
+}
+
+static void cs_unlock(CURL *h, curl_lock_data data, void *userp)
+{
+    struct curl_share *s = userp;
+
+    (void) h;
+    pthread_mutex_unlock(s->lock + data);
+}
+
+/**
+ * @brief initialize libcurl and the share; call once, before any thread
+ *        starts fetching
+ * @return 0 on success; -1 otherwise
+ */
+int cs_init(struct curl_share *s)
+{
+    CURLSHcode ret = CURLSHE_OK;
+
+    memset(s, 0, sizeof(*s));
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        fprintf(stderr, "curl_global_init failed\n");
+        return -1;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_init(s->lock + i, NULL);
+    }
+    pthread_mutex_init(&s->stats_mutex, NULL);
+
+    s->sh = curl_share_init();
+    if (s->sh == NULL) {
+        fprintf(stderr, "curl_share_init: returned NULL\n");
+        cs_cleanup(s);
+        return -1;
+    }
+    curl_share_setopt(s->sh, CURLSHOPT_LOCKFUNC, cs_lock);
+    curl_share_setopt(s->sh, CURLSHOPT_UNLOCKFUNC, cs_unlock);
+    curl_share_setopt(s->sh, CURLSHOPT_USERDATA, s);
+    ret |= curl_share_setopt(s->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    ret |= curl_share_setopt(s->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    ret |= curl_share_setopt(s->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    if (ret != CURLSHE_OK) {  /* an old libcurl; whatever it shares still helps */
+        fprintf(stderr, "curl_share_setopt: %s\n", curl_share_strerror(ret));
+    }
+    return 0;
+}
+
+/**
+ * @brief an easy handle on the share, tuned for many small requests to the
+ *        same few servers; keep it for the thread's lifetime
+ * @param const char *url URL to fetch, may be changed with CURLOPT_URL
+ * @return the handle, release with curl_easy_cleanup(); NULL on failure
+ */
+CURL *cs_easy(struct curl_share *s, const char *url)
+{
+    CURL *h = curl_easy_init();
+
+    if (h == NULL) {
+        fprintf(stderr, "curl_easy_init: returned NULL\n");
+        return NULL;
+    }
+    curl_easy_setopt(h, CURLOPT_SHARE, s->sh);
+    curl_easy_setopt(h, CURLOPT_URL, url);
+    curl_easy_setopt(h, CURLOPT_USERAGENT, CS_USER_AGENT);
+    curl_easy_setopt(h, CURLOPT_NOSIGNAL, 1L);      /* no SIGALRM in threads */
+    curl_easy_setopt(h, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(h, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(h, CURLOPT_TCP_KEEPIDLE, (long)CS_KEEPIDLE);
+    curl_easy_setopt(h, CURLOPT_TCP_KEEPINTVL, (long)CS_KEEPINTVL);
+    /* the pool's cap comes from the handles; the default 5 is fewer than
+     * there are threads, so connections would be closed as soon as parked */
+    curl_easy_setopt(h, CURLOPT_MAXCONNECTS, (long)CS_MAXCONNS);
+    return h;
+}
+
+/**
+ * @brief add the timings of the transfer h just finished to the totals
+ */
+void cs_account(struct curl_share *s, CURL *h)
+{
+    long connects = 0;
+    double t_connect = 0, t_app = 0, t_total = 0;
+
+    curl_easy_getinfo(h, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(h, CURLINFO_CONNECT_TIME, &t_connect);
+    curl_easy_getinfo(h, CURLINFO_APPCONNECT_TIME, &t_app);
+    curl_easy_getinfo(h, CURLINFO_TOTAL_TIME, &t_total);
+
+    pthread_mutex_lock(&s->stats_mutex);
+    s->requests++;
+    s->t_total += t_total;
+    if (connects > 0) {  /* on a reused connection both times are 0 */
+        s->connects += connects;
+        s->t_connect += t_connect;
+        s->t_connect_max = t_connect > s->t_connect_max ? t_connect : s->t_connect_max;
+        if (t_app > 0) {
+            s->handshakes++;
+            s->t_tls += t_app - t_connect;
+        }
+    }
+    pthread_mutex_unlock(&s->stats_mutex);
+}
+
+/**
+ * @brief print the totals: how many requests needed a connection of their
+ *        own, and what connecting and TLS cost per request
+ */
+void cs_report(struct curl_share *s, FILE *fp)
+{
+    U64 n = s->requests ? s->requests : 1;
+
+    fprintf(fp, "curl: %lu requests, %lu connections opened (%lu reused), "
+            "%lu TLS handshakes\n", s->requests, s->connects,
+            s->requests > s->connects ? s->requests - s->connects : 0, s->handshakes);
+    fprintf(fp, "curl: per request %.3f ms connecting, %.3f ms in TLS, %.3f ms total; "
+            "slowest connect %.3f ms\n", 1e3 * s->t_connect / n, 1e3 * s->t_tls / n,
+            1e3 * s->t_total / n, 1e3 * s->t_connect_max);
+}
+
+/**
+ * @brief release the share and libcurl; every easy handle on the share must
+ *        be cleaned up first
+ */
+void cs_cleanup(struct curl_share *s)
+{
+    if (s->sh != NULL) {
+        curl_share_cleanup(s->sh);
+        s->sh = NULL;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(s->lock + i);
+    }
+    pthread_mutex_destroy(&s->stats_mutex);
+    curl_global_cleanup();
+}
@@ -0,0 +1,194 @@
+/**
+ * @brief  lock-free registry of the fragments of an image being fetched
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Any number of fetcher threads may receive the same fragment. The first to
+ * set its bit with an atomic fetch-or owns it and publishes the buffer with
+ * a release store; everyone else drops their copy. Readers see a published
+ * buffer through an acquire load, so its bytes are there too. Whoever waits
+ * for some number of fragments, or the whole image, sleeps on a latch that
+ * a publish only locks while someone is sleeping on it. The bitmap has a
+ * word per 64 fragments, so there is no limit on the number of fragments.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "lab_png.h"
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+typedef struct frag_reg {
+    int n;                  /* fragments in the image */
+    U64 *bits;              /* claimed fragments, a bit each */
+    const U8 **buf;         /* published fragments, NULL until then */
+    U64 *len;
+    int done;               /* fragments published so far */
+    int sleepers;           /* threads in frag_wait_for() */
+    pthread_mutex_t mutex;  /* for the latch only */
+    pthread_cond_t published;
+} *frag_reg_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int frag_init(struct frag_reg *r, int n);
+void frag_cleanup(struct frag_reg *r);
+int frag_has(struct frag_reg *r, int seq);
+int frag_claim(struct frag_reg *r, int seq);
+void frag_release(struct frag_reg *r, int seq);
+void frag_publish(struct frag_reg *r, int seq, const U8 *buf, U64 len);
+const U8 *frag_get(struct frag_reg *r, int seq, U64 *len);
+int frag_complete(struct frag_reg *r);
+void frag_wait_for(struct frag_reg *r, int k);
+void frag_wait(struct frag_reg *r);
+
+/**
+ * @brief set up an empty registry for n fragments
+ * @return 0 on success; -1 if out of memory
+ */
+int frag_init(struct frag_reg *r, int n)
+{
+    r->n = n;
+    r->done = 0;
+    r->sleepers = 0;
+    r->bits = calloc((n + 63) / 64, sizeof(U64));
+    r->buf = calloc(n, sizeof(U8 *));
+    r->len = calloc(n, sizeof(U64));
+    if (r->bits == NULL || r->buf == NULL || r->len == NULL) {
+        perror("calloc");
+        frag_cleanup(r);
+        return -1;
+    }
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->published, NULL);
+    return 0;
+}
+
+/**
+ * @brief release the registry; the published buffers belong to the caller
+ */
+void frag_cleanup(struct frag_reg *r)
+{
+    if (r->bits != NULL && r->buf != NULL && r->len != NULL) {
+        pthread_mutex_destroy(&r->mutex);
+        pthread_cond_destroy(&r->published);
+    }
+    free(r->bits);
+    free(r->buf);
+    free(r->len);
+    r->bits = NULL;
+    r->buf = NULL;
+    r->len = NULL;
+}
+
+/**
+ * @brief whether fragment seq is claimed already, so a fetcher can skip it
+ * @return 1 if claimed, 0 if not or seq is out of range
+ */
+int frag_has(struct frag_reg *r, int seq)
+{
+    if (seq < 0 || seq >= r->n) {
+        return 0;
+    }
+    return (__atomic_load_n(r->bits + seq / 64, __ATOMIC_RELAXED) >> (seq % 64)) & 1;
+}
+
+/**
+ * @brief try to become the owner of fragment seq
+ * @return 1 if the caller owns it now and must frag_publish() or
+ *         frag_release() it; 0 if someone else got there first or seq is
+ *         out of range
+ */
+int frag_claim(struct frag_reg *r, int seq)
+{
+    U64 bit;
+
+    if (seq < 0 || seq >= r->n) {
+        return 0;
+    }
+    bit = (U64)1 << (seq % 64);
+    return (__atomic_fetch_or(r->bits + seq / 64, bit, __ATOMIC_ACQ_REL) & bit) == 0;
+}
+
+/**
+ * @brief give up a claimed fragment that will not be published after all,
+ *        e.g. its transfer failed halfway, so another fetcher can take it
+ */
+void frag_release(struct frag_reg *r, int seq)
+{
+    U64 bit = (U64)1 << (seq % 64);
+
+    __atomic_fetch_and(r->bits + seq / 64, ~bit, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief hand a claimed fragment over to the readers
+ * @param const U8 *buf its bytes; they must not change from now on
+ */
+void frag_publish(struct frag_reg *r, int seq, const U8 *buf, U64 len)
+{
+    r->len[seq] = len;
+    __atomic_store_n(r->buf + seq, buf, __ATOMIC_RELEASE);
+
+    /* both sides use seq_cst: either a sleeper sees the new count or we
+       see the sleeper */
+    __atomic_add_fetch(&r->done, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&r->mutex);
+        pthread_cond_broadcast(&r->published);
+        pthread_mutex_unlock(&r->mutex);
+    }
+}
+
+/**
+ * @brief a published fragment
+ * @return its bytes; NULL if not published yet
+ */
+const U8 *frag_get(struct frag_reg *r, int seq, U64 *len)
+{
+    const U8 *buf = __atomic_load_n(r->buf + seq, __ATOMIC_ACQUIRE);
+
+    if (buf != NULL && len != NULL) {
+        *len = r->len[seq];
+    }
+    return buf;
+}
+
+/**
+ * @brief whether every fragment is published; cheap enough to poll
+ */
+int frag_complete(struct frag_reg *r)
+{
+    return __atomic_load_n(&r->done, __ATOMIC_ACQUIRE) == r->n;
+}
+
+/**
+ * @brief sleep until at least k fragments are published
+ */
+void frag_wait_for(struct frag_reg *r, int k)
+{
+    pthread_mutex_lock(&r->mutex);
+    __atomic_add_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&r->done, __ATOMIC_SEQ_CST) < k) {
+        pthread_cond_wait(&r->published, &r->mutex);
+    }
+    __atomic_sub_fetch(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/**
+ * @brief sleep until every fragment is published
+ */
+void frag_wait(struct frag_reg *r)
+{
+    frag_wait_for(r, r->n);
+}
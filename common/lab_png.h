@@ -0,0 +1,363 @@
+/**
+ * @brief  micros, structures and a chunk reader for PNG files held in memory
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <stdio.h>   /* for printf().  man 3 printf */
+#include <stdlib.h>  /* for malloc().  man 3 malloc */
+#include <string.h>  /* for memcmp().  man memcmp   */
+#include <arpa/inet.h>
+#include "zlib.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+
+#define PNG_SIG_SIZE    8 /* number of bytes of png image signature data */
+#define CHUNK_LEN_SIZE  4 /* chunk length field size in bytes */
+#define CHUNK_TYPE_SIZE 4 /* chunk type field size in bytes */
+#define CHUNK_CRC_SIZE  4 /* chunk CRC field size in bytes */
+#define DATA_IHDR_SIZE 13 /* IHDR chunk data field size */
+
+/* bytes a chunk takes up in the file on top of its data field */
+#define CHUNK_OVERHEAD (CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + CHUNK_CRC_SIZE)
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+typedef unsigned char U8;
+typedef unsigned short U16;
+typedef unsigned int  U32;
+typedef unsigned long int U64;
+
+typedef struct chunk {
+    U32 length;  /* length of data in the chunk, host byte order */
+    U8  type[4]; /* chunk type */
+    U8  *p_data; /* pointer to location where the actual data are */
+    U32 crc;     /* CRC field  */
+} *chunk_p;
+
+/* note that there are 13 Bytes valid data, compiler will padd 3 bytes to make
+   the structure 16 Bytes due to alignment. So do not use the size of this
+   structure as the actual data size, use 13 Bytes (i.e DATA_IHDR_SIZE macro).
+ */
+typedef struct data_IHDR {// IHDR chunk data
+    U32 width;        /* width in pixels, big endian   */
+    U32 height;       /* height in pixels, big endian  */
+    U8  bit_depth;    /* num of bits per sample or per palette index.
+                         valid values are: 1, 2, 4, 8, 16 */
+    U8  color_type;   /* =0: Grayscale; =2: Truecolor; =3 Indexed-color
+                         =4: Greyscale with alpha; =6: Truecolor with alpha */
+    U8  compression;  /* only method 0 is defined for now */
+    U8  filter;       /* only method 0 is defined for now */
+    U8  interlace;    /* =0: no interlace; =1: Adam7 interlace */
+} *data_IHDR_p;
+
+/* A PNG file parsed in place. The chunks are views into the buffer the file
+   was parsed from (p_data points into it, nothing is copied), so the buffer
+   must outlive the struct. Every IDAT is kept in file order; ancillary
+   chunks are walked over and dropped. */
+typedef struct simple_PNG {
+    struct chunk IHDR;
+    struct chunk *p_IDAT;  /* n_IDAT views, in file order */
+    U32 n_IDAT;
+    struct chunk IEND;
+} *simple_PNG_p;
+
+/* Walks the chunks of a PNG file held in memory, one chunk per call */
+typedef struct png_iter {
+    const U8 *buf;  /* start of the file, i.e. the signature */
+    U64 len;        /* length of buf in bytes */
+    U64 pos;        /* offset of the next chunk's length field */
+    int done;       /* set once IEND has been handed out */
+} *png_iter_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int png_iter_init(struct png_iter *it, const U8 *buf, U64 len);
+int png_iter_next(struct png_iter *it, struct chunk *out);
+int png_parse(struct simple_PNG *out, const U8 *buf, U64 len);
+void png_free(struct simple_PNG *png);
+int parse_IHDR(struct data_IHDR *out, const U8 *data);
+U64 png_row_bytes(struct data_IHDR *ihdr);
+U64 png_raw_size(struct data_IHDR *ihdr);
+int idat_next(struct png_iter *it, z_stream *strm);
+int png_inf_idat(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *buf, U64 len);
+
+/**
+ * @brief check the signature and get ready to walk the chunks of buf
+ * @param struct png_iter *it iterator to initialize
+ * @param const U8 *buf the whole png file in memory, e.g. an mmap'd file
+ * @param U64 len length of buf in bytes
+ * @return 0 on success; -1 if buf does not start with a png signature
+ */
+int png_iter_init(struct png_iter *it, const U8 *buf, U64 len)
+{
+    static const U8 png_tag[PNG_SIG_SIZE] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+    it->buf = buf;
+    it->len = len;
+    it->pos = PNG_SIG_SIZE;
+    it->done = 0;
+
+    if (buf == NULL || len < PNG_SIG_SIZE || memcmp(buf, png_tag, PNG_SIG_SIZE) != 0) {
+        it->done = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief hand out the next chunk of the file as a view into the buffer
+ * @param struct png_iter *it iterator set up by png_iter_init()
+ * @param struct chunk *out chunk view; length and crc are in host byte
+ *        order and p_data points into the buffer, nothing is copied
+ * @return 1 when a chunk was returned; 0 after IEND or at the end of the
+ *         buffer; -1 if the chunk at the current position is truncated
+ */
+int png_iter_next(struct png_iter *it, struct chunk *out)
+{
+    const U8 *p = it->buf + it->pos;
+    U64 left = it->len - it->pos;
+    U32 length;
+    U32 crc_val;
+
+    if (it->done || left == 0) {
+        return 0;
+    }
+    if (left < CHUNK_OVERHEAD) {
+        it->done = 1;
+        return -1;
+    }
+
+    memcpy(&length, p, CHUNK_LEN_SIZE);
+    length = ntohl(length);
+    if (length > left - CHUNK_OVERHEAD) {
+        it->done = 1;
+        return -1;
+    }
+    memcpy(&crc_val, p + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE + length, CHUNK_CRC_SIZE);
+
+    out->length = length;
+    memcpy(out->type, p + CHUNK_LEN_SIZE, CHUNK_TYPE_SIZE);
+    out->p_data = (U8 *)p + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE;
+    out->crc = ntohl(crc_val);
+
+    it->pos += CHUNK_OVERHEAD + length;
+    if (memcmp(out->type, "IEND", CHUNK_TYPE_SIZE) == 0) {
+        it->done = 1;
+    }
+    return 1;
+}
+
+/**
+ * @brief walk every chunk of buf and collect IHDR, all IDATs and IEND
+ * @param struct simple_PNG *out parsed file, release with png_free()
+ * @param const U8 *buf the whole png file in memory
+ * @param U64 len length of buf in bytes
+ * @return 0 on success; -1 if buf is not a well formed png
+ */
+int png_parse(struct simple_PNG *out, const U8 *buf, U64 len)
+{
+    struct png_iter it;
+    struct chunk c;
+    U32 cap = 0;
+    int ret;
+    int seen_IEND = 0;
+
+    memset(out, 0, sizeof(*out));
+    if (png_iter_init(&it, buf, len) != 0) {
+        return -1;
+    }
+
+    while ((ret = png_iter_next(&it, &c)) == 1) {
+        if (memcmp(c.type, "IHDR", CHUNK_TYPE_SIZE) == 0) {
+            out->IHDR = c;
+        } else if (memcmp(c.type, "IDAT", CHUNK_TYPE_SIZE) == 0) {
+            if (out->n_IDAT == cap) {
+                U32 new_cap = cap ? cap * 2 : 4;
+                struct chunk *q = realloc(out->p_IDAT, new_cap * sizeof(struct chunk));
+                if (q == NULL) {
+                    perror("realloc");
+                    png_free(out);
+                    return -1;
+                }
+                out->p_IDAT = q;
+                cap = new_cap;
+            }
+            out->p_IDAT[out->n_IDAT++] = c;
+        } else if (memcmp(c.type, "IEND", CHUNK_TYPE_SIZE) == 0) {
+            out->IEND = c;
+            seen_IEND = 1;
+        }
+    }
+
+    if (ret < 0 || !seen_IEND || out->IHDR.length != DATA_IHDR_SIZE || out->n_IDAT == 0) {
+        png_free(out);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief release what png_parse() allocated; the file buffer is untouched
+ */
+void png_free(struct simple_PNG *png)
+{
+    free(png->p_IDAT);
+    png->p_IDAT = NULL;
+    png->n_IDAT = 0;
+}
+
+/**
+ * @brief decode the 13 byte IHDR data field
+ * @param struct data_IHDR *out IHDR fields in host byte order
+ * @param const U8 *data IHDR data field, e.g. the p_data of an IHDR view
+ * @return 0 on success
+ */
+int parse_IHDR(struct data_IHDR *out, const U8 *data)
+{
+    U32 tmp;
+
+    memcpy(&tmp, data, 4);
+    out->width = ntohl(tmp);
+    memcpy(&tmp, data + 4, 4);
+    out->height = ntohl(tmp);
+    out->bit_depth   = data[8];
+    out->color_type  = data[9];
+    out->compression = data[10];
+    out->filter      = data[11];
+    out->interlace   = data[12];
+    return 0;
+}
+
+/**
+ * @brief number of bytes in one scanline, not counting the filter type byte
+ */
+U64 png_row_bytes(struct data_IHDR *ihdr)
+{
+    U64 samples;
+
+    switch (ihdr->color_type) {
+    case 0:  samples = 1; break; /* grayscale            */
+    case 2:  samples = 3; break; /* truecolor            */
+    case 3:  samples = 1; break; /* indexed-color        */
+    case 4:  samples = 2; break; /* grayscale with alpha */
+    case 6:  samples = 4; break; /* truecolor with alpha */
+    default: return 0;
+    }
+    return ((U64)ihdr->width * samples * ihdr->bit_depth + 7) / 8;
+}
+
+/**
+ * @brief size of the inflated IDAT stream, i.e. height * (1 + bytes per
+ *        scanline) for a non-interlaced image, and that summed over the
+ *        seven reduced images of an Adam7 interlaced one
+ */
+U64 png_raw_size(struct data_IHDR *ihdr)
+{
+    static const U8 start_x[7] = { 0, 4, 0, 2, 0, 1, 0 };
+    static const U8 start_y[7] = { 0, 0, 4, 0, 2, 0, 1 };
+    static const U8 step_x[7]  = { 8, 8, 4, 4, 2, 2, 1 };
+    static const U8 step_y[7]  = { 8, 8, 8, 4, 4, 2, 2 };
+    struct data_IHDR pass = *ihdr;
+    U64 total = 0;
+
+    if (ihdr->interlace != 1) {
+        return (U64)ihdr->height * (1 + png_row_bytes(ihdr));
+    }
+    for (int i = 0; i < 7; i++) {
+        if (ihdr->width <= start_x[i] || ihdr->height <= start_y[i]) {
+            continue; /* empty pass, it has no scanlines at all */
+        }
+        pass.width  = (ihdr->width  - start_x[i] + step_x[i] - 1) / step_x[i];
+        pass.height = (ihdr->height - start_y[i] + step_y[i] - 1) / step_y[i];
+        total += (U64)pass.height * (1 + png_row_bytes(&pass));
+    }
+    return total;
+}
+
+/**
+ * @brief point strm at the payload of the next IDAT chunk, skipping over any
+ *        other chunk in between, so that inflate() sees all IDATs of the
+ *        file as one continuous zlib stream
+ * @param struct png_iter *it iterator over the png file
+ * @param z_stream *strm inflate stream; next_in/avail_in are overwritten
+ * @return 1 when strm was fed; 0 when there is no IDAT left; -1 on a
+ *         malformed file
+ */
+int idat_next(struct png_iter *it, z_stream *strm)
+{
+    struct chunk c;
+    int ret;
+
+    while ((ret = png_iter_next(it, &c)) == 1) {
+        if (memcmp(c.type, "IDAT", CHUNK_TYPE_SIZE) == 0 && c.length > 0) {
+            strm->next_in = c.p_data;
+            strm->avail_in = c.length;
+            return 1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief inflate the IDAT stream of a png file held in memory, however many
+ *        IDAT chunks it is split into, straight into dest
+ * @param U8 *dest output buffer for the filtered scanlines
+ * @param U64 dest_cap capacity of dest in bytes
+ * @param U64 *dest_len output parameter, number of bytes written to dest
+ * @param const U8 *buf the whole png file in memory
+ * @param U64 len length of buf in bytes
+ * @return Z_OK on success; Z_BUF_ERROR if dest is too small; otherwise
+ *         Z_DATA_ERROR or another zlib error code
+ */
+int png_inf_idat(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *buf, U64 len)
+{
+    struct png_iter it;
+    z_stream strm;
+    int ret;
+
+    *dest_len = 0;
+    if (png_iter_init(&it, buf, len) != 0) {
+        return Z_DATA_ERROR;
+    }
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit(&strm);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm.next_out = dest;
+
+    do {
+        /* avail_out is a uInt, hand dest out in pieces it can hold */
+        strm.avail_out = (dest_cap - *dest_len) > 0x40000000 ?
+                         0x40000000 : (uInt)(dest_cap - *dest_len);
+        if (strm.avail_in == 0 && idat_next(&it, &strm) != 1) {
+            /* IDATs ran out before the stream ended */
+            ret = (strm.avail_out == 0) ? Z_BUF_ERROR : Z_DATA_ERROR;
+            break;
+        }
+        ret = inflate(&strm, Z_NO_FLUSH);
+        *dest_len = strm.next_out - dest;
+        if (ret == Z_NEED_DICT) {
+            ret = Z_DATA_ERROR;
+        }
+    } while (ret == Z_OK || (ret == Z_BUF_ERROR && strm.avail_in == 0));
+
+    (void) inflateEnd(&strm);
+    return (ret == Z_STREAM_END) ? Z_OK : ret;
+}
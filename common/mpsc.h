@@ -0,0 +1,83 @@
+/**
+ * @brief  lock-free multi-producer single-consumer queue
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Dmitry Vyukov's intrusive MPSC queue. Producers never wait on each other:
+ * a push is one atomic exchange and one store. Embed a struct mpsc_node as
+ * the first member of whatever is being queued.
+ */
+#pragma once
+
+#include <stddef.h>
+
+typedef struct mpsc_node {
+    struct mpsc_node *next;
+} *mpsc_node_p;
+
+typedef struct mpsc {
+    struct mpsc_node *tail;  /* last node pushed, shared by the producers */
+    struct mpsc_node *head;  /* next node to pop, owned by the consumer */
+    struct mpsc_node stub;   /* keeps the list non-empty */
+} *mpsc_p;
+
+void mpsc_init(struct mpsc *q);
+void mpsc_push(struct mpsc *q, struct mpsc_node *n);
+struct mpsc_node *mpsc_pop(struct mpsc *q);
+
+void mpsc_init(struct mpsc *q)
+{
+    q->stub.next = NULL;
+    q->tail = &q->stub;
+    q->head = &q->stub;
+}
+
+/**
+ * @brief append n to the queue; safe to call from any number of threads
+ */
+void mpsc_push(struct mpsc *q, struct mpsc_node *n)
+{
+    struct mpsc_node *prev;
+
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->tail, n, __ATOMIC_ACQ_REL);
+    /* between the exchange and this store the list is briefly cut at prev,
+       mpsc_pop() sees that as empty and the consumer just tries again */
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief take the oldest node off the queue; only one thread may pop
+ * @return the node; NULL if the queue is empty or a push is half done
+ */
+struct mpsc_node *mpsc_pop(struct mpsc *q)
+{
+    struct mpsc_node *head = q->head;
+    struct mpsc_node *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (head == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->head = next;
+        head = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        q->head = next;
+        return head;
+    }
+    if (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    /* head is the only node left; put the stub behind it so it can go */
+    mpsc_push(q, &q->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        q->head = next;
+        return head;
+    }
+    return NULL;
+}
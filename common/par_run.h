@@ -0,0 +1,103 @@
+/**
+ * @brief  run n independent jobs on a handful of pthreads
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef void (*par_job_fn)(void *ctx, int job);
+
+struct par_run_args {     /* thread input parameters struct */
+    par_job_fn fn;
+    void *ctx;
+    int n_jobs;
+    int *next;            /* next job nobody has claimed yet, shared */
+};
+
+int par_threads(int want);
+int par_run(int n_jobs, int n_threads, par_job_fn fn, void *ctx);
+
+/**
+ * @brief number of threads to use
+ * @param int want thread count asked for by the user, <= 0 for the default
+ * @return want if positive; otherwise the number of online CPUs
+ */
+int par_threads(int want)
+{
+    long n;
+
+    if (want > 0) {
+        return want;
+    }
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static void *par_worker(void *arg)
+{
+    struct par_run_args *p = arg;
+    int job;
+
+    while ((job = __atomic_fetch_add(p->next, 1, __ATOMIC_RELAXED)) < p->n_jobs) {
+        p->fn(p->ctx, job);
+    }
+    return NULL;
+}
+
+/**
+ * @brief call fn(ctx, job) once for every job in 0..n_jobs-1. Threads claim
+ *        the next job from a shared counter, so slow jobs do not hold up
+ *        the rest. Returns once every job has finished.
+ * @param int n_jobs number of jobs
+ * @param int n_threads threads to run them on, see par_threads()
+ * @param par_job_fn fn the job body, must be safe to run concurrently
+ * @param void *ctx passed through to fn
+ * @return 0 on success; non-zero if out of memory
+ */
+int par_run(int n_jobs, int n_threads, par_job_fn fn, void *ctx)
+{
+    struct par_run_args args;
+    pthread_t *p_tids;
+    int next = 0;
+    int started = 0;
+
+    args.fn = fn;
+    args.ctx = ctx;
+    args.n_jobs = n_jobs;
+    args.next = &next;
+
+    if (n_threads > n_jobs) {
+        n_threads = n_jobs;
+    }
+    if (n_threads <= 1) { /* not worth a thread */
+        par_worker(&args);
+        return 0;
+    }
+
+    p_tids = malloc(sizeof(pthread_t) * n_threads);
+    if (p_tids == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_create(p_tids + i, NULL, par_worker, &args) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        par_worker(&args); /* run them here rather than not at all */
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(p_tids[i], NULL);
+    }
+    free(p_tids);
+    return 0;
+}
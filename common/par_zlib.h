@@ -0,0 +1,321 @@
+/**
+ * @brief  parallel inflate of png strips and pigz style parallel deflate
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include "lab_png.h"
+#include "crc.h"
+#include "par_run.h"
+#include "png_filter.h"
+#include "zcodec.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define PAR_BLOCK (128*1024) /* uncompressed bytes per independent deflate block */
+#define PAR_DICT  32768      /* deflate window, primed from the previous block  */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+/* One input strip of a paste and where its scanlines go in the output */
+typedef struct strip {
+    const U8 *png;          /* the whole png file in memory */
+    U64 png_len;            /* length of png in bytes */
+    struct data_IHDR ihdr;  /* the strip's IHDR, host byte order */
+    U64 offset;             /* offset of its first scanline in the output */
+    U64 raw_len;            /* number of bytes it inflates to */
+    const U8 *raw;          /* its scanlines if already known, e.g. from
+                               strip_cache.h, copied instead of inflated;
+                               NULL otherwise */
+    int in_place;           /* 1 if its scanlines are at their offset in the
+                               output already, e.g. inflated on receipt */
+    int ret;                /* zlib return code of its inflate */
+} *strip_p;
+
+struct par_inf_ctx {
+    U8 *dest;
+    struct strip *s;
+};
+
+struct par_def_ctx {
+    U8 *src;                /* whole uncompressed input */
+    U64 src_len;
+    int level;
+    int n_blocks;
+    U8 **out;               /* per block raw deflate output */
+    U64 *out_len;
+    U32 *adler;             /* per block adler32 of the input */
+    U32 *crc;               /* per block crc() of the output */
+    int *ret;               /* per block zlib return code */
+};
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int strips_layout(struct strip *s, int n, U64 *total);
+int par_inf_strips(U8 *dest, struct strip *s, int n, int n_threads);
+U64 par_def_bound(U64 src_len);
+int par_def(U8 *dest, U64 dest_cap, U64 *dest_len, U32 *dest_crc, U8 *src, U64 src_len,
+            int level, int n_threads);
+
+/**
+ * @brief read the IHDR of every strip and lay the strips out top to bottom
+ * @param struct strip *s n strips with png and png_len filled in
+ * @param int n number of strips
+ * @param U64 *total output parameter, size of all inflated strips together
+ * @return 0 on success; -1 if a strip does not start with a valid IHDR
+ */
+int strips_layout(struct strip *s, int n, U64 *total)
+{
+    struct png_iter it;
+    struct chunk c;
+    U64 offset = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (png_iter_init(&it, s[i].png, s[i].png_len) != 0 ||
+            png_iter_next(&it, &c) != 1 ||
+            memcmp(c.type, "IHDR", CHUNK_TYPE_SIZE) != 0 ||
+            c.length != DATA_IHDR_SIZE) {
+            fprintf(stderr, "strip %d: no IHDR\n", i);
+            return -1;
+        }
+        parse_IHDR(&s[i].ihdr, c.p_data);
+        s[i].raw_len = png_raw_size(&s[i].ihdr);
+        s[i].offset = offset;
+        s[i].in_place = 0;
+        s[i].ret = Z_OK;
+        offset += s[i].raw_len;
+    }
+    *total = offset;
+    return 0;
+}
+
+static void par_inf_job(void *ctx, int i)
+{
+    struct par_inf_ctx *p = ctx;
+    struct strip *s = p->s + i;
+    U64 got = 0;
+
+    if (s->in_place) {
+        s->ret = Z_OK;
+    } else if (s->raw != NULL) {
+        memcpy(p->dest + s->offset, s->raw, s->raw_len);
+        s->ret = Z_OK;
+    } else {
+        s->ret = zc_inf_idat(p->dest + s->offset, s->raw_len, &got, s->png, s->png_len);
+        if (s->ret == Z_OK && got != s->raw_len) {
+            s->ret = Z_DATA_ERROR; /* IDAT does not match the IHDR */
+        }
+    }
+    /* the strip's first row goes under another strip's last one now */
+    if (s->ret == Z_OK && s->ihdr.height > 0 && s->ihdr.interlace == 0 &&
+        png_detach_row(p->dest + s->offset, png_row_bytes(&s->ihdr), png_bpp(&s->ihdr)) != 0) {
+        s->ret = Z_DATA_ERROR;
+    }
+}
+
+/**
+ * @brief inflate every strip on a worker thread straight into its slot of
+ *        dest, as laid out by strips_layout(). Each strip's first row is
+ *        rewritten with png_detach_row(), so the strips decode stacked.
+ * @param U8 *dest output buffer of at least the total strips_layout() gave
+ * @param struct strip *s n strips laid out by strips_layout()
+ * @param int n number of strips
+ * @param int n_threads number of threads, see par_threads()
+ * @return Z_OK on success; otherwise the error of the first failed strip,
+ *         s[i].ret tells which one
+ */
+int par_inf_strips(U8 *dest, struct strip *s, int n, int n_threads)
+{
+    struct par_inf_ctx ctx = { dest, s };
+
+    if (par_run(n, n_threads, par_inf_job, &ctx) != 0) {
+        return Z_MEM_ERROR;
+    }
+    for (int i = 0; i < n; i++) {
+        if (s[i].ret != Z_OK) {
+            return s[i].ret;
+        }
+    }
+    return Z_OK;
+}
+
+/**
+ * @brief upper bound of the par_def() output for src_len input bytes
+ */
+U64 par_def_bound(U64 src_len)
+{
+    U64 n_blocks = src_len / PAR_BLOCK + 1;
+
+    /* every block may end in a 5 byte empty stored block from the flush */
+    return n_blocks * (compressBound(PAR_BLOCK) + 16) + 6;
+}
+
+static void par_def_job(void *ctx, int i)
+{
+    struct par_def_ctx *p = ctx;
+    U64 start = (U64)i * PAR_BLOCK;
+    U64 len = p->src_len - start < PAR_BLOCK ? p->src_len - start : PAR_BLOCK;
+    int last = (i == p->n_blocks - 1);
+    z_stream strm;
+    U64 cap;
+    int ret;
+
+    p->adler[i] = adler32(1L, p->src + start, len);
+
+    strm.zalloc = Z_NULL;
+    strm.zfree  = Z_NULL;
+    strm.opaque = Z_NULL;
+    /* raw deflate, the zlib header and trailer are added by par_def() */
+    ret = deflateInit2(&strm, p->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        p->ret[i] = ret;
+        return;
+    }
+    if (start > 0) { /* prime with the tail of the previous block */
+        U64 dict = start < PAR_DICT ? start : PAR_DICT;
+        deflateSetDictionary(&strm, p->src + start - dict, dict);
+    }
+
+    cap = deflateBound(&strm, len) + 16;
+    p->out[i] = malloc(cap);
+    if (p->out[i] == NULL) {
+        (void) deflateEnd(&strm);
+        p->ret[i] = Z_MEM_ERROR;
+        return;
+    }
+
+    strm.next_in = p->src + start;
+    strm.avail_in = len;
+    strm.next_out = p->out[i];
+    strm.avail_out = cap;
+    /* every block but the last ends on a byte boundary, so they can be
+       stitched together as they are */
+    ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (strm.avail_in != 0 || ret != (last ? Z_STREAM_END : Z_OK)) {
+        ret = Z_BUF_ERROR;
+    } else {
+        ret = Z_OK;
+    }
+    p->out_len[i] = cap - strm.avail_out;
+    p->crc[i] = crc(p->out[i], p->out_len[i]); /* while it is still in cache */
+    p->ret[i] = ret;
+    (void) deflateEnd(&strm);
+}
+
+/**
+ * @brief deflate src into one zlib stream, compressing PAR_BLOCK sized
+ *        blocks independently on n_threads threads. Each block is primed
+ *        with the last 32K of the block before it, so the ratio stays
+ *        close to a single deflate, and the adler32 of the whole input is
+ *        put together from the per block ones with adler32_combine().
+ *        On one thread src goes to zc_def() in one piece instead, so a
+ *        whole buffer backend such as libdeflate gets to do it. The crc()
+ *        of the output, which the IDAT chunk around it needs, is put
+ *        together the same way from per block CRCs.
+ * @param U8 *dest output buffer
+ * @param U64 dest_cap capacity of dest, par_def_bound(src_len) is enough
+ * @param U64 *dest_len output parameter, length of the zlib stream
+ * @param U32 *dest_crc output parameter, crc() of the zlib stream; may be NULL
+ * @param U8 *src uncompressed input
+ * @param U64 src_len length of src
+ * @param int level compression level, as for deflateInit()
+ * @param int n_threads number of threads, see par_threads()
+ * @return Z_OK on success; otherwise a zlib error code
+ */
+int par_def(U8 *dest, U64 dest_cap, U64 *dest_len, U32 *dest_crc, U8 *src, U64 src_len,
+            int level, int n_threads)
+{
+    struct par_def_ctx ctx;
+    int n_blocks = src_len / PAR_BLOCK + (src_len % PAR_BLOCK != 0 || src_len == 0);
+    U8 *p_dest = dest;
+    U32 adler = 1L;
+    U32 c = 0;              /* crc() of the output so far */
+    U32 header;
+    int ret = Z_OK;
+
+    if (n_threads <= 1 && dest_cap >= zc_bound(src_len)) {
+        ret = zc_def(dest, dest_cap, dest_len, src, src_len, level);
+        if (ret == Z_OK && dest_crc != NULL) {
+            *dest_crc = crc(dest, *dest_len);
+        }
+        return ret;
+    }
+
+    ctx.src = src;
+    ctx.src_len = src_len;
+    ctx.level = level;
+    ctx.n_blocks = n_blocks;
+    ctx.out = calloc(n_blocks, sizeof(U8 *));
+    ctx.out_len = calloc(n_blocks, sizeof(U64));
+    ctx.adler = calloc(n_blocks, sizeof(U32));
+    ctx.crc = calloc(n_blocks, sizeof(U32));
+    ctx.ret = calloc(n_blocks, sizeof(int));
+    if (ctx.out == NULL || ctx.out_len == NULL || ctx.adler == NULL || ctx.crc == NULL ||
+        ctx.ret == NULL || par_run(n_blocks, n_threads, par_def_job, &ctx) != 0) {
+        ret = Z_MEM_ERROR;
+    }
+
+    /* zlib header: 32K window deflate, level hint as deflate() writes it */
+    header = (Z_DEFLATED + ((MAX_WBITS - 8) << 4)) << 8;
+    if (level == Z_DEFAULT_COMPRESSION || level == 6) {
+        header |= 2 << 6;
+    } else if (level >= 2 && level < 6) {
+        header |= 1 << 6;
+    } else if (level > 6) {
+        header |= 3 << 6;
+    }
+    header += 31 - (header % 31);
+    if (ret == Z_OK && dest_cap >= 2) {
+        *p_dest++ = header >> 8;
+        *p_dest++ = header & 0xff;
+        c = crc(dest, 2);
+    } else if (ret == Z_OK) {
+        ret = Z_BUF_ERROR;
+    }
+
+    for (int i = 0; i < n_blocks && ret == Z_OK; i++) {
+        if (ctx.ret[i] != Z_OK) {
+            ret = ctx.ret[i];
+        } else if ((U64)(p_dest - dest) + ctx.out_len[i] + 4 > dest_cap) {
+            ret = Z_BUF_ERROR;
+        } else {
+            U64 start = (U64)i * PAR_BLOCK;
+            U64 len = src_len - start < PAR_BLOCK ? src_len - start : PAR_BLOCK;
+
+            memcpy(p_dest, ctx.out[i], ctx.out_len[i]);
+            p_dest += ctx.out_len[i];
+            c = crc_combine(c, ctx.crc[i], ctx.out_len[i]);
+            adler = (i == 0) ? ctx.adler[0] : adler32_combine(adler, ctx.adler[i], len);
+        }
+    }
+
+    if (ret == Z_OK) { /* adler32 trailer, big endian */
+        U32 tmp = htonl(adler);
+        memcpy(p_dest, &tmp, 4);
+        c = crc_combine(c, crc(p_dest, 4), 4);
+        p_dest += 4;
+        *dest_len = p_dest - dest;
+        if (dest_crc != NULL) {
+            *dest_crc = c;
+        }
+    }
+
+    for (int i = 0; ctx.out != NULL && i < n_blocks; i++) {
+        free(ctx.out[i]);
+    }
+    free(ctx.out);
+    free(ctx.out_len);
+    free(ctx.adler);
+    free(ctx.crc);
+    free(ctx.ret);
+    return ret;
+}
@@ -0,0 +1,483 @@
+/**
+ * @brief  paste strips of any bit depth and color type into one image
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Strips that agree on width, bit depth and color type are pasted as they
+ * are. Otherwise every strip is brought to a common target format on the
+ * fly: the widest width, 16 bits if any strip has 16 bit samples and 8
+ * otherwise, truecolor if any strip has color and alpha if any strip has
+ * alpha or a palette with transparency. The target is never indexed, so
+ * palettes are expanded, and no strip ever loses precision.
+ *
+ * The pixel kernels are generated by macros, one per (source format,
+ * target format) pair, so a row is converted by a single loop with the
+ * sample unpacking, scaling and packing all fixed at compile time. A strip
+ * already in the target format is inflated straight into place.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include "par_zlib.h"
+#include "png_filter.h"
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+/* convert width pixels at in to the kernel's target format at out. plte is
+   the 256 entry RGBA palette, 16 bits a sample, for indexed sources */
+typedef void (*px_kernel_t)(U8 *out, const U8 *in, U32 width, const U16 *plte);
+
+/* the target format chosen so far, one strip or tile at a time */
+struct px_pick {
+    struct data_IHDR first;
+    U32 width;            /* widest seen */
+    int n;                /* number seen */
+    int same;             /* all rows so far match the first's format */
+    int color;
+    int alpha;
+    int deep;             /* some have 16 bit samples */
+    int interlaced;
+};
+
+struct px_paste_ctx {
+    U8 *dest;
+    struct strip *s;
+    const struct data_IHDR *to;
+};
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+/* sample i of a packed row, as stored */
+#define PX_GET1(p, i)  (((p)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+#define PX_GET2(p, i)  (((p)[(i) >> 2] >> (6 - 2 * ((i) & 3))) & 3)
+#define PX_GET4(p, i)  (((p)[(i) >> 1] >> (4 - 4 * ((i) & 1))) & 15)
+#define PX_GET8(p, i)  ((U32)(p)[i])
+#define PX_GET16(p, i) (((U32)(p)[2 * (i)] << 8) | (p)[2 * (i) + 1])
+
+/* what a sample of each depth is multiplied by to span 0..65535 */
+#define PX_SCALE1  65535
+#define PX_SCALE2  21845
+#define PX_SCALE4  4369
+#define PX_SCALE8  257
+#define PX_SCALE16 1
+
+#define PX_S(D, p, i) (PX_GET##D(p, i) * PX_SCALE##D)
+
+/* load pixel x of a source row into r, g, b and a, 16 bits each */
+#define PX_READ_G(D, p, x)    r = g = b = PX_S(D, p, x); a = 65535;
+#define PX_READ_RGB(D, p, x)  r = PX_S(D, p, 3 * (x)); g = PX_S(D, p, 3 * (x) + 1); \
+                              b = PX_S(D, p, 3 * (x) + 2); a = 65535;
+#define PX_READ_P(D, p, x)    { const U16 *e = plte + 4 * PX_GET##D(p, x); \
+                                r = e[0]; g = e[1]; b = e[2]; a = e[3]; }
+#define PX_READ_GA(D, p, x)   r = g = b = PX_S(D, p, 2 * (x)); a = PX_S(D, p, 2 * (x) + 1);
+#define PX_READ_RGBA(D, p, x) r = PX_S(D, p, 4 * (x)); g = PX_S(D, p, 4 * (x) + 1); \
+                              b = PX_S(D, p, 4 * (x) + 2); a = PX_S(D, p, 4 * (x) + 3);
+
+/* store r, g, b and a as pixel x of a target row. A gray target only ever
+   gets gray sources, see px_target(), so red is as good as any channel */
+#define PX_PUT8(p, i, v)  ((p)[i] = (v) >> 8)
+#define PX_PUT16(p, i, v) ((p)[2 * (i)] = (v) >> 8, (p)[2 * (i) + 1] = (v) & 0xff)
+#define PX_WRITE_G(D, p, x)    PX_PUT##D(p, x, r);
+#define PX_WRITE_RGB(D, p, x)  PX_PUT##D(p, 3 * (x), r); PX_PUT##D(p, 3 * (x) + 1, g); \
+                               PX_PUT##D(p, 3 * (x) + 2, b);
+#define PX_WRITE_GA(D, p, x)   PX_PUT##D(p, 2 * (x), r); PX_PUT##D(p, 2 * (x) + 1, a);
+#define PX_WRITE_RGBA(D, p, x) PX_PUT##D(p, 4 * (x), r); PX_PUT##D(p, 4 * (x) + 1, g); \
+                               PX_PUT##D(p, 4 * (x) + 2, b); PX_PUT##D(p, 4 * (x) + 3, a);
+
+/* every valid source format, see the IHDR table of the PNG spec */
+#define PX_SRC_FORMATS(X, DCT, DD) \
+    X(G, 1, DCT, DD)    X(G, 2, DCT, DD)   X(G, 4, DCT, DD) X(G, 8, DCT, DD) X(G, 16, DCT, DD) \
+    X(RGB, 8, DCT, DD)  X(RGB, 16, DCT, DD) \
+    X(P, 1, DCT, DD)    X(P, 2, DCT, DD)   X(P, 4, DCT, DD) X(P, 8, DCT, DD) \
+    X(GA, 8, DCT, DD)   X(GA, 16, DCT, DD) \
+    X(RGBA, 8, DCT, DD) X(RGBA, 16, DCT, DD)
+#define PX_N_SRC 15
+
+/* every target format, in color type then depth order, see px_dst_index() */
+#define PX_DST_FORMATS(X) \
+    X(G, 8)  X(G, 16)  X(RGB, 8)  X(RGB, 16) \
+    X(GA, 8) X(GA, 16) X(RGBA, 8) X(RGBA, 16)
+
+#define PX_KERNEL(SCT, SD, DCT, DD) \
+static void px_##SCT##SD##_to_##DCT##DD(U8 *out, const U8 *in, U32 width, const U16 *plte) \
+{ \
+    U32 r, g, b, a; \
+    (void) plte; \
+    for (U32 x = 0; x < width; x++) { \
+        PX_READ_##SCT(SD, in, x) \
+        PX_WRITE_##DCT(DD, out, x) \
+    } \
+    (void) g; (void) b; (void) a; \
+}
+#define PX_KERNELS_TO(DCT, DD) PX_SRC_FORMATS(PX_KERNEL, DCT, DD)
+#define PX_ENTRY(SCT, SD, DCT, DD) px_##SCT##SD##_to_##DCT##DD,
+#define PX_TABLE_ROW(DCT, DD) { PX_SRC_FORMATS(PX_ENTRY, DCT, DD) },
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int px_palette(U16 *plte, const U8 *png, U64 len);
+void px_pick_init(struct px_pick *p);
+int px_pick_add(struct px_pick *p, const struct data_IHDR *h, int trns);
+int px_pick_done(struct px_pick *p, struct data_IHDR *out);
+int px_target(struct data_IHDR *out, struct strip *s, int n);
+px_kernel_t px_kernel(const struct data_IHDR *from, const struct data_IHDR *to);
+int px_convert_rows(U8 *dest, const struct data_IHDR *to, U8 *raw,
+                    struct data_IHDR *from, const U16 *plte);
+int px_paste_strips(U8 *dest, const struct data_IHDR *to, struct strip *s, int n, int n_threads);
+
+/******************************************************************************
+ * KERNELS
+ *****************************************************************************/
+PX_DST_FORMATS(PX_KERNELS_TO)
+
+static const px_kernel_t px_kernels[][PX_N_SRC] = {
+    PX_DST_FORMATS(PX_TABLE_ROW)
+};
+
+/**
+ * @brief position of a source format in PX_SRC_FORMATS
+ * @return the index; -1 if the PNG spec does not allow the combination
+ */
+static int px_src_index(int color_type, int depth)
+{
+    switch (color_type) {
+    case 0:
+        return depth == 1 ? 0 : depth == 2 ? 1 : depth == 4 ? 2 : depth == 8 ? 3 :
+               depth == 16 ? 4 : -1;
+    case 2:
+        return depth == 8 ? 5 : depth == 16 ? 6 : -1;
+    case 3:
+        return depth == 1 ? 7 : depth == 2 ? 8 : depth == 4 ? 9 : depth == 8 ? 10 : -1;
+    case 4:
+        return depth == 8 ? 11 : depth == 16 ? 12 : -1;
+    case 6:
+        return depth == 8 ? 13 : depth == 16 ? 14 : -1;
+    }
+    return -1;
+}
+
+/**
+ * @brief position of a target format in PX_DST_FORMATS
+ * @return the index; -1 if it cannot be a target
+ */
+static int px_dst_index(int color_type, int depth)
+{
+    if ((color_type & ~6) != 0 || (depth != 8 && depth != 16)) {
+        return -1;
+    }
+    return color_type + (depth == 16);
+}
+
+/******************************************************************************
+ * FUNCTIONS
+ *****************************************************************************/
+/**
+ * @brief build the RGBA palette of an indexed png from its PLTE and tRNS
+ * @param U16 *plte 256 * 4 samples of output; entries the file does not
+ *        define are opaque black
+ * @param const U8 *png the whole png file in memory
+ * @param U64 len length of png
+ * @return 1 if the palette has transparent entries; 0 if not; -1 if the
+ *         file has no PLTE
+ */
+int px_palette(U16 *plte, const U8 *png, U64 len)
+{
+    struct png_iter it;
+    struct chunk c;
+    int have_plte = 0;
+    int trns = 0;
+
+    for (int i = 0; i < 256; i++) {
+        plte[4 * i] = plte[4 * i + 1] = plte[4 * i + 2] = 0;
+        plte[4 * i + 3] = 65535;
+    }
+    if (png_iter_init(&it, png, len) != 0) {
+        return -1;
+    }
+    while (png_iter_next(&it, &c) == 1) {
+        if (memcmp(c.type, "PLTE", CHUNK_TYPE_SIZE) == 0) {
+            for (U32 i = 0; i < 256 && 3 * i + 2 < c.length; i++) {
+                plte[4 * i]     = c.p_data[3 * i] * 257;
+                plte[4 * i + 1] = c.p_data[3 * i + 1] * 257;
+                plte[4 * i + 2] = c.p_data[3 * i + 2] * 257;
+            }
+            have_plte = 1;
+        } else if (memcmp(c.type, "tRNS", CHUNK_TYPE_SIZE) == 0) {
+            for (U32 i = 0; i < 256 && i < c.length; i++) {
+                plte[4 * i + 3] = c.p_data[i] * 257;
+                trns |= (c.p_data[i] != 255);
+            }
+        } else if (memcmp(c.type, "IDAT", CHUNK_TYPE_SIZE) == 0) {
+            break;    /* PLTE and tRNS must come before the first IDAT */
+        }
+    }
+    return have_plte ? trns : -1;
+}
+
+static int px_same_rows(const struct data_IHDR *a, const struct data_IHDR *b)
+{
+    return a->width == b->width && a->bit_depth == b->bit_depth &&
+           a->color_type == b->color_type;
+}
+
+/**
+ * @brief start picking a target format, see px_pick_add()
+ */
+void px_pick_init(struct px_pick *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->same = 1;
+}
+
+/**
+ * @brief take one more strip into account for the target format
+ * @param struct px_pick *p set up by px_pick_init()
+ * @param const struct data_IHDR *h the strip's IHDR
+ * @param int trns 1 if it is indexed and its palette has transparency, see
+ *        px_palette(); 0 otherwise
+ * @return 0 on success; -1 if its bit depth is not valid for its color type
+ */
+int px_pick_add(struct px_pick *p, const struct data_IHDR *h, int trns)
+{
+    if (px_src_index(h->color_type, h->bit_depth) < 0) {
+        return -1;
+    }
+    if (p->n++ == 0) {
+        p->first = *h;
+    }
+    p->same &= px_same_rows(h, &p->first);
+    p->color |= (h->color_type & 2) != 0;
+    p->alpha |= (h->color_type & 4) != 0 || trns;
+    p->deep |= (h->bit_depth == 16);
+    p->interlaced |= (h->interlace != 0);
+    p->width = h->width > p->width ? h->width : p->width;
+    return 0;
+}
+
+/**
+ * @brief the target format for every strip px_pick_add() has seen
+ * @param struct px_pick *p at least one strip added
+ * @param struct data_IHDR *out the target; width is the widest strip's and
+ *        height is left 0 for the caller
+ * @return 0 if every strip is already in it, 1 if not
+ */
+int px_pick_done(struct px_pick *p, struct data_IHDR *out)
+{
+    *out = p->first;
+    out->width = p->width;
+    out->height = 0;
+    /* the output carries no PLTE, so even matching indexed strips expand */
+    if (p->same && p->first.color_type != 3) {
+        return 0;
+    }
+    out->bit_depth = p->deep ? 16 : 8;
+    out->color_type = (p->color ? 2 : 0) | (p->alpha ? 4 : 0);
+    out->compression = 0;
+    out->filter = 0;
+    out->interlace = 0;
+    return 1;
+}
+
+/**
+ * @brief pick the format the strips are pasted in
+ * @param struct data_IHDR *out the target IHDR, with the total height
+ * @param struct strip *s n strips with their IHDRs, see strips_layout()
+ * @param int n number of strips
+ * @return 0 if every strip can be pasted as it is; 1 if some have to go
+ *         through px_paste_strips(); -1 if a strip's format is invalid,
+ *         or it is interlaced and would need converting
+ */
+int px_target(struct data_IHDR *out, struct strip *s, int n)
+{
+    struct px_pick p;
+    U32 height = 0;
+    U16 plte[256 * 4];
+    int ret;
+
+    px_pick_init(&p);
+    for (int i = 0; i < n; i++) {
+        struct data_IHDR *h = &s[i].ihdr;
+        int trns = 0;
+
+        if (h->color_type == 3) {
+            trns = px_palette(plte, s[i].png, s[i].png_len);
+            if (trns < 0) {
+                fprintf(stderr, "strip %d: indexed but no PLTE\n", i);
+                return -1;
+            }
+        }
+        if (px_pick_add(&p, h, trns) != 0) {
+            fprintf(stderr, "strip %d: bit depth %d is not valid for color type %d\n",
+                    i, h->bit_depth, h->color_type);
+            return -1;
+        }
+        height += h->height;
+    }
+    ret = px_pick_done(&p, out);
+    out->height = height;
+    if (ret == 1 && p.interlaced) {
+        fprintf(stderr, "interlaced strips cannot be converted\n");
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief the kernel that converts rows of format from to format to
+ * @return the kernel; NULL if the two formats are the same, i.e. a row is
+ *         copied as it is, or to cannot be a target
+ */
+px_kernel_t px_kernel(const struct data_IHDR *from, const struct data_IHDR *to)
+{
+    int d = px_dst_index(to->color_type, to->bit_depth);
+    int j = px_src_index(from->color_type, from->bit_depth);
+
+    if ((from->bit_depth == to->bit_depth && from->color_type == to->color_type) ||
+        d < 0 || j < 0) {
+        return NULL;
+    }
+    return px_kernels[d][j];
+}
+
+/**
+ * @brief convert the inflated scanlines of one strip to the target format
+ * @param U8 *dest from->height scanlines of the target format, written
+ *        with filter type None and padded with zeros to the target width
+ * @param const struct data_IHDR *to target format
+ * @param U8 *raw inflated scanlines of the strip; unfiltered in place
+ * @param struct data_IHDR *from the strip's IHDR, not interlaced
+ * @param const U16 *plte the strip's palette, see px_palette(); only read
+ *        for indexed strips
+ * @return 0 on success; -1 on an invalid filter type or format
+ */
+int px_convert_rows(U8 *dest, const struct data_IHDR *to, U8 *raw,
+                    struct data_IHDR *from, const U16 *plte)
+{
+    struct data_IHDR used = *to;   /* the part of a target row we fill */
+    U64 in_bytes = png_row_bytes(from);
+    U64 out_bytes;
+    U64 fill;
+    px_kernel_t k = NULL;
+
+    used.width = from->width;
+    fill = png_row_bytes(&used);
+    used.width = to->width;
+    out_bytes = png_row_bytes(&used);
+
+    k = px_kernel(from, to);
+    if (k == NULL && !(from->bit_depth == to->bit_depth && from->color_type == to->color_type)) {
+        return -1;
+    }
+    if (png_unfilter_rows(raw, from->height, in_bytes, png_bpp(from), NULL) != 0) {
+        return -1;
+    }
+
+    for (U32 y = 0; y < from->height; y++) {
+        U8 *out = dest + y * (1 + out_bytes);
+        const U8 *in = raw + y * (1 + in_bytes) + 1;
+
+        out[0] = PNG_FILTER_NONE;
+        if (k != NULL) {
+            k(out + 1, in, from->width, plte);
+        } else {  /* same format, only narrower */
+            memcpy(out + 1, in, in_bytes);
+        }
+        memset(out + 1 + fill, 0, out_bytes - fill);
+    }
+    return 0;
+}
+
+static void px_paste_job(void *ctx, int i)
+{
+    struct px_paste_ctx *p = ctx;
+    struct strip *s = p->s + i;
+    U64 out_len = (U64)s->ihdr.height * (1 + png_row_bytes((struct data_IHDR *)p->to));
+    U16 plte[256 * 4];
+    U8 *raw;
+    U64 got = 0;
+
+    if (px_same_rows(&s->ihdr, p->to) && s->raw != NULL) {
+        memcpy(p->dest + s->offset, s->raw, s->raw_len);
+        s->ret = Z_OK;
+        return;
+    } else if (px_same_rows(&s->ihdr, p->to)) { /* inflate it straight into place */
+        s->ret = zc_inf_idat(p->dest + s->offset, s->raw_len, &got, s->png, s->png_len);
+        if (s->ret == Z_OK && got != s->raw_len) {
+            s->ret = Z_DATA_ERROR;
+        }
+        return;
+    }
+
+    raw = malloc(s->raw_len ? s->raw_len : 1);
+    if (raw == NULL) {
+        s->ret = Z_MEM_ERROR;
+        return;
+    }
+    if (s->raw != NULL) {   /* unfiltered in place, so it needs a copy */
+        memcpy(raw, s->raw, s->raw_len);
+        s->ret = Z_OK;
+    } else {
+        s->ret = zc_inf_idat(raw, s->raw_len, &got, s->png, s->png_len);
+        if (s->ret == Z_OK && got != s->raw_len) {
+            s->ret = Z_DATA_ERROR;
+        }
+    }
+    if (s->ret == Z_OK && s->ihdr.color_type == 3 &&
+        px_palette(plte, s->png, s->png_len) < 0) {
+        s->ret = Z_DATA_ERROR;
+    }
+    if (s->ret == Z_OK &&
+        px_convert_rows(p->dest + s->offset, p->to, raw, &s->ihdr, plte) != 0) {
+        s->ret = Z_DATA_ERROR;
+    }
+    free(raw);
+    if (s->ret == Z_OK) {  /* from now on it is a strip of the target format */
+        U32 height = s->ihdr.height;
+
+        s->ihdr = *p->to;
+        s->ihdr.height = height;
+        s->raw_len = out_len;
+        s->raw = NULL;
+    }
+}
+
+/**
+ * @brief inflate every strip on a worker thread and convert it into its
+ *        slot of dest. Afterwards every strip is described in the target
+ *        format, so refiltering and the like need not care.
+ * @param U8 *dest output buffer of png_raw_size(to) bytes
+ * @param const struct data_IHDR *to target format, see px_target()
+ * @param struct strip *s n strips laid out by strips_layout(); their
+ *        offsets are moved to the target layout
+ * @param int n number of strips
+ * @param int n_threads number of threads, see par_threads()
+ * @return Z_OK on success; otherwise the error of the first failed strip,
+ *         s[i].ret tells which one
+ */
+int px_paste_strips(U8 *dest, const struct data_IHDR *to, struct strip *s, int n, int n_threads)
+{
+    struct px_paste_ctx ctx = { dest, s, to };
+    U64 out_row = 1 + png_row_bytes((struct data_IHDR *)to);
+    U64 offset = 0;
+
+    for (int i = 0; i < n; i++) {
+        s[i].offset = offset;
+        offset += (U64)s[i].ihdr.height * out_row;
+    }
+    if (par_run(n, n_threads, px_paste_job, &ctx) != 0) {
+        return Z_MEM_ERROR;
+    }
+    for (int i = 0; i < n; i++) {
+        if (s[i].ret != Z_OK) {
+            return s[i].ret;
+        }
+    }
+    return Z_OK;
+}
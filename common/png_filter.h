@@ -0,0 +1,615 @@
+/**
+ * @brief  PNG scanline filters: None, Sub, Up, Average and Paeth, both ways
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Reference: https://www.w3.org/TR/PNG/#9Filters
+ *
+ * Filtering (pixels to filtered bytes) has no dependency along the row, so
+ * every filter type runs 32 bytes at a time with AVX2, or 16 with SSE2, for
+ * any pixel size. Unfiltering Sub, Average and Paeth depends on the pixel
+ * just decoded; for 4 byte pixels (8-bit RGBA, the layout of the lab images)
+ * those run one whole pixel per SSE2 step, as libpng does. Up goes 16 or 32
+ * bytes at a time both ways. The SIMD level is picked when the program
+ * starts and can be lowered through png_filter_simd, e.g. to benchmark.
+ *
+ * png_refilter_rows() chooses each row's filter with the heuristic from the
+ * PNG spec: the filter whose output has the smallest sum of absolute values,
+ * taking the bytes as signed.
+ *
+ * The first scanline of a png is filtered against a row of zeros. Stacked
+ * under another strip it would be decoded against that strip's last row
+ * instead, so png_detach_row() rewrites it into a filter that does not look
+ * at the row above.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include "lab_png.h"
+
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#  define FILTER_HAVE_SIMD 1
+#else
+#  define FILTER_HAVE_SIMD 0
+#endif
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define PNG_FILTER_NONE     0
+#define PNG_FILTER_SUB      1
+#define PNG_FILTER_UP       2
+#define PNG_FILTER_AVG      3
+#define PNG_FILTER_PAETH    4
+#define PNG_FILTER_ADAPTIVE (-1) /* pick the best filter row by row */
+
+#define FILTER_SCALAR 0
+#define FILTER_SSE2   1
+#define FILTER_AVX2   2
+
+/******************************************************************************
+ * GLOBALS
+ *****************************************************************************/
+/* highest SIMD level the kernels may use, set by png_filter_init() */
+int png_filter_simd = FILTER_SCALAR;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int png_bpp(struct data_IHDR *ihdr);
+void png_filter_row(int type, U8 *out, const U8 *row, const U8 *prev, U64 len, int bpp);
+int png_unfilter_row(int type, U8 *row, const U8 *prev, U64 len, int bpp);
+int png_filter_best(U8 *out, const U8 *row, const U8 *prev, U64 len, int bpp, U8 *tmp);
+int png_unfilter_rows(U8 *raw, U64 rows, U64 row_bytes, int bpp, const U8 *prev);
+int png_refilter_rows(U8 *raw, U64 rows, U64 row_bytes, int bpp, const U8 *prev, int type);
+int png_detach_row(U8 *row, U64 row_bytes, int bpp);
+
+__attribute__((constructor)) void png_filter_init(void)
+{
+#if FILTER_HAVE_SIMD
+    __builtin_cpu_init();
+    png_filter_simd = __builtin_cpu_supports("avx2") ? FILTER_AVX2 : FILTER_SSE2;
+#endif
+}
+
+/**
+ * @brief bytes per complete pixel, rounded up to 1, i.e. the distance the
+ *        Sub, Average and Paeth filters look back
+ */
+int png_bpp(struct data_IHDR *ihdr)
+{
+    struct data_IHDR one = *ihdr;
+    U64 n;
+
+    one.width = 1;
+    n = png_row_bytes(&one);
+    return (ihdr->bit_depth < 8 || n == 0) ? 1 : (int)n;
+}
+
+static inline U8 paeth(U8 a, U8 b, U8 c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return (pb <= pc) ? b : c;
+}
+
+/* filter bytes [from, len) of row the plain way; prev is never NULL here */
+static void filter_scalar(int type, U8 *out, const U8 *row, const U8 *prev,
+                          U64 from, U64 len, int bpp)
+{
+    U64 i = from;
+
+    switch (type) {
+    case PNG_FILTER_SUB:
+        for (; i < len; i++) {
+            out[i] = row[i] - (i >= (U64)bpp ? row[i - bpp] : 0);
+        }
+        break;
+    case PNG_FILTER_UP:
+        for (; i < len; i++) {
+            out[i] = row[i] - prev[i];
+        }
+        break;
+    case PNG_FILTER_AVG:
+        for (; i < len; i++) {
+            out[i] = row[i] - (((i >= (U64)bpp ? row[i - bpp] : 0) + prev[i]) >> 1);
+        }
+        break;
+    case PNG_FILTER_PAETH:
+        for (; i < len; i++) {
+            out[i] = row[i] - (i >= (U64)bpp ? paeth(row[i - bpp], prev[i], prev[i - bpp])
+                                             : prev[i]);
+        }
+        break;
+    default:
+        memcpy(out + i, row + i, len - i);
+    }
+}
+
+#if FILTER_HAVE_SIMD
+/* Paeth predictor of 8 pixels' worth of 16-bit lanes, as in libpng:
+   pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|, ties go to a, then b */
+static inline __m128i paeth_epi16(__m128i a, __m128i b, __m128i c)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i p = _mm_sub_epi16(b, c);
+    __m128i q = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(p, q);
+    __m128i pa = _mm_max_epi16(p, _mm_sub_epi16(zero, p));
+    __m128i pb = _mm_max_epi16(q, _mm_sub_epi16(zero, q));
+    __m128i min;
+    __m128i use_a, use_b;
+
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+    min = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    use_a = _mm_cmpeq_epi16(pa, min);
+    use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(pb, min));
+    return _mm_or_si128(_mm_and_si128(use_a, a),
+           _mm_or_si128(_mm_and_si128(use_b, b),
+                        _mm_andnot_si128(_mm_or_si128(use_a, use_b), c)));
+}
+
+/* floor((a + b) / 2) per byte; _mm_avg_epu8 rounds up */
+static inline __m128i avg_floor_epu8(__m128i a, __m128i b)
+{
+    __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+/* filter bytes [bpp, len) 16 at a time, returns where it stopped */
+static U64 filter_sse2(int type, U8 *out, const U8 *row, const U8 *prev, U64 len, int bpp)
+{
+    __m128i zero = _mm_setzero_si128();
+    U64 i = bpp;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i a = _mm_loadu_si128((const __m128i *)(row + i - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+        __m128i c, lo, hi;
+
+        switch (type) {
+        case PNG_FILTER_SUB:
+            x = _mm_sub_epi8(x, a);
+            break;
+        case PNG_FILTER_UP:
+            x = _mm_sub_epi8(x, b);
+            break;
+        case PNG_FILTER_AVG:
+            x = _mm_sub_epi8(x, avg_floor_epu8(a, b));
+            break;
+        case PNG_FILTER_PAETH:
+            c = _mm_loadu_si128((const __m128i *)(prev + i - bpp));
+            lo = paeth_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                             _mm_unpacklo_epi8(c, zero));
+            hi = paeth_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                             _mm_unpackhi_epi8(c, zero));
+            x = _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+            break;
+        }
+        _mm_storeu_si128((__m128i *)(out + i), x);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i paeth_epi16_avx2(__m256i a, __m256i b, __m256i c)
+{
+    __m256i p = _mm256_sub_epi16(b, c);
+    __m256i q = _mm256_sub_epi16(a, c);
+    __m256i pa = _mm256_abs_epi16(p);
+    __m256i pb = _mm256_abs_epi16(q);
+    __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(p, q));
+    __m256i min = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+    __m256i use_a = _mm256_cmpeq_epi16(pa, min);
+    __m256i use_b = _mm256_cmpeq_epi16(pb, min);
+
+    return _mm256_blendv_epi8(_mm256_blendv_epi8(c, b, use_b), a, use_a);
+}
+
+/* filter bytes [bpp, len) 32 at a time, returns where it stopped. The
+   unpack and pack instructions work within 128-bit lanes, so the bytes come
+   back out of the Paeth predictor in their original order. */
+__attribute__((target("avx2")))
+static U64 filter_avx2(int type, U8 *out, const U8 *row, const U8 *prev, U64 len, int bpp)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi8(1);
+    U64 i = bpp;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(row + i));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(row + i - bpp));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+        __m256i c, lo, hi;
+
+        switch (type) {
+        case PNG_FILTER_SUB:
+            x = _mm256_sub_epi8(x, a);
+            break;
+        case PNG_FILTER_UP:
+            x = _mm256_sub_epi8(x, b);
+            break;
+        case PNG_FILTER_AVG:
+            x = _mm256_sub_epi8(x, _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+                                   _mm256_and_si256(_mm256_xor_si256(a, b), one)));
+            break;
+        case PNG_FILTER_PAETH:
+            c = _mm256_loadu_si256((const __m256i *)(prev + i - bpp));
+            lo = paeth_epi16_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero),
+                                  _mm256_unpacklo_epi8(c, zero));
+            hi = paeth_epi16_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero),
+                                  _mm256_unpackhi_epi8(c, zero));
+            x = _mm256_sub_epi8(x, _mm256_packus_epi16(lo, hi));
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), x);
+    }
+    return i;
+}
+
+/* add prev to row 32 or 16 bytes at a time, returns where it stopped */
+__attribute__((target("avx2")))
+static U64 unfilter_up_avx2(U8 *row, const U8 *prev, U64 len)
+{
+    U64 i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(row + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+        _mm256_storeu_si256((__m256i *)(row + i), _mm256_add_epi8(x, b));
+    }
+    return i;
+}
+
+static U64 unfilter_up_sse2(U8 *row, const U8 *prev, U64 len)
+{
+    U64 i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+        _mm_storeu_si128((__m128i *)(row + i), _mm_add_epi8(x, b));
+    }
+    return i;
+}
+
+static inline __m128i load4(const U8 *p)
+{
+    int v;
+
+    memcpy(&v, p, 4);
+    return _mm_cvtsi32_si128(v);
+}
+
+static inline void store4(U8 *p, __m128i x)
+{
+    int v = _mm_cvtsi128_si32(x);
+
+    memcpy(p, &v, 4);
+}
+
+/* unfilter a row of 4 byte pixels one pixel per step; len % 4 == 0 */
+static void unfilter4_sse2(int type, U8 *row, const U8 *prev, U64 len)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;   /* pixel to the left, decoded */
+    __m128i c = zero;   /* pixel up and to the left   */
+    __m128i x, b;
+
+    for (U64 i = 0; i < len; i += 4) {
+        x = load4(row + i);
+        switch (type) {
+        case PNG_FILTER_SUB:
+            a = _mm_add_epi8(x, a);
+            break;
+        case PNG_FILTER_AVG:
+            b = load4(prev + i);
+            a = _mm_add_epi8(x, avg_floor_epu8(a, b));
+            break;
+        case PNG_FILTER_PAETH:
+            b = _mm_unpacklo_epi8(load4(prev + i), zero);
+            a = _mm_unpacklo_epi8(a, zero);
+            x = _mm_add_epi8(x, _mm_packus_epi16(paeth_epi16(a, b, c), zero));
+            c = b;
+            a = x;
+            break;
+        }
+        store4(row + i, a);
+    }
+}
+#endif /* FILTER_HAVE_SIMD */
+
+/**
+ * @brief filter one scanline
+ * @param int type PNG_FILTER_NONE .. PNG_FILTER_PAETH
+ * @param U8 *out filtered bytes, len of them; must not overlap row
+ * @param const U8 *row the scanline's pixel bytes, without a filter byte
+ * @param const U8 *prev the scanline above, unfiltered; NULL for the first
+ * @param U64 len bytes per scanline
+ * @param int bpp bytes per pixel, see png_bpp()
+ */
+void png_filter_row(int type, U8 *out, const U8 *row, const U8 *prev, U64 len, int bpp)
+{
+    U64 i = 0;
+
+    if (prev == NULL) { /* the row above is all zero */
+        if (type == PNG_FILTER_AVG) {
+            for (; i < len; i++) {
+                out[i] = row[i] - ((i >= (U64)bpp ? row[i - bpp] : 0) >> 1);
+            }
+            return;
+        }
+        type = (type == PNG_FILTER_PAETH) ? PNG_FILTER_SUB :
+               (type == PNG_FILTER_UP) ? PNG_FILTER_NONE : type;
+        prev = row;     /* never read by Sub or None */
+    }
+    if (type == PNG_FILTER_NONE) {
+        memcpy(out, row, len);
+        return;
+    }
+
+    filter_scalar(type, out, row, prev, 0, len < (U64)bpp ? len : (U64)bpp, bpp);
+    if (len > (U64)bpp) {
+        i = bpp;
+#if FILTER_HAVE_SIMD
+        if (png_filter_simd >= FILTER_AVX2) {
+            i = filter_avx2(type, out, row, prev, len, bpp);
+        }
+        if (png_filter_simd >= FILTER_SSE2) {
+            U64 j = filter_sse2(type, out + i - bpp, row + i - bpp, prev + i - bpp,
+                                len - i + bpp, bpp);
+            i += j - bpp;
+        }
+#endif
+        filter_scalar(type, out, row, prev, i, len, bpp);
+    }
+}
+
+/**
+ * @brief unfilter one scanline in place
+ * @param int type the scanline's filter type byte
+ * @param U8 *row the filtered bytes, without the filter byte
+ * @param const U8 *prev the scanline above, already unfiltered; NULL for
+ *        the first scanline
+ * @param U64 len bytes per scanline
+ * @param int bpp bytes per pixel, see png_bpp()
+ * @return 0 on success; -1 if type is not a valid filter type
+ */
+int png_unfilter_row(int type, U8 *row, const U8 *prev, U64 len, int bpp)
+{
+    U64 i = 0;
+
+    if (type < PNG_FILTER_NONE || type > PNG_FILTER_PAETH) {
+        return -1;
+    }
+    if (prev == NULL) { /* the row above is all zero */
+        if (type == PNG_FILTER_AVG) {
+            for (i = bpp; i < len; i++) {
+                row[i] += row[i - bpp] >> 1;
+            }
+            return 0;
+        }
+        type = (type == PNG_FILTER_PAETH) ? PNG_FILTER_SUB :
+               (type == PNG_FILTER_UP) ? PNG_FILTER_NONE : type;
+    }
+
+    switch (type) {
+    case PNG_FILTER_NONE:
+        return 0;
+    case PNG_FILTER_UP:
+#if FILTER_HAVE_SIMD
+        if (png_filter_simd >= FILTER_AVX2) {
+            i = unfilter_up_avx2(row, prev, len);
+        }
+        if (png_filter_simd >= FILTER_SSE2) {
+            i += unfilter_up_sse2(row + i, prev + i, len - i);
+        }
+#endif
+        for (; i < len; i++) {
+            row[i] += prev[i];
+        }
+        return 0;
+    }
+
+#if FILTER_HAVE_SIMD
+    if (bpp == 4 && len % 4 == 0 && png_filter_simd >= FILTER_SSE2 &&
+        (prev != NULL || type == PNG_FILTER_SUB)) {
+        unfilter4_sse2(type, row, prev, len);
+        return 0;
+    }
+#endif
+
+    switch (type) {
+    case PNG_FILTER_SUB:
+        for (i = bpp; i < len; i++) {
+            row[i] += row[i - bpp];
+        }
+        break;
+    case PNG_FILTER_AVG:
+        for (i = 0; i < (U64)bpp && i < len; i++) {
+            row[i] += prev[i] >> 1;
+        }
+        for (; i < len; i++) {
+            row[i] += (row[i - bpp] + prev[i]) >> 1;
+        }
+        break;
+    case PNG_FILTER_PAETH:
+        for (i = 0; i < (U64)bpp && i < len; i++) {
+            row[i] += prev[i];
+        }
+        for (; i < len; i++) {
+            row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+        }
+        break;
+    }
+    return 0;
+}
+
+/* sum of |x| over the bytes taken as signed, the spec's heuristic cost */
+static U64 filter_cost(const U8 *p, U64 len)
+{
+    U64 sum = 0;
+    U64 i = 0;
+
+#if FILTER_HAVE_SIMD
+    if (png_filter_simd >= FILTER_SSE2) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+            /* |x| for a signed byte is min(x, -x) taken as unsigned */
+            x = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(x, zero));
+        }
+        sum = _mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+    }
+#endif
+    for (; i < len; i++) {
+        sum += p[i] < 128 ? p[i] : 256 - p[i];
+    }
+    return sum;
+}
+
+/**
+ * @brief filter one scanline with whichever filter gives the smallest sum
+ *        of absolute values
+ * @param U8 *out filtered bytes, len of them
+ * @param const U8 *row the scanline's pixel bytes
+ * @param const U8 *prev the scanline above, unfiltered; NULL for the first
+ * @param U64 len bytes per scanline
+ * @param int bpp bytes per pixel
+ * @param U8 *tmp scratch space of len bytes
+ * @return the filter type chosen
+ */
+int png_filter_best(U8 *out, const U8 *row, const U8 *prev, U64 len, int bpp, U8 *tmp)
+{
+    U8 *best = out;
+    U8 *cand = tmp;
+    U64 best_cost = filter_cost(row, len);
+    int best_type = PNG_FILTER_NONE;
+
+    memcpy(best, row, len);
+    for (int type = PNG_FILTER_SUB; type <= PNG_FILTER_PAETH && best_cost > 0; type++) {
+        U64 cost;
+
+        png_filter_row(type, cand, row, prev, len, bpp);
+        cost = filter_cost(cand, len);
+        if (cost < best_cost) {
+            U8 *swap = best;
+            best = cand;
+            cand = swap;
+            best_cost = cost;
+            best_type = type;
+        }
+    }
+    if (best != out) {
+        memcpy(out, best, len);
+    }
+    return best_type;
+}
+
+/**
+ * @brief unfilter whole scanlines in place
+ * @param U8 *raw rows scanlines, each a filter type byte and row_bytes of
+ *        data, e.g. an inflated IDAT stream; the type bytes are set to 0
+ * @param U64 rows number of scanlines
+ * @param U64 row_bytes bytes per scanline without the type byte
+ * @param int bpp bytes per pixel
+ * @param const U8 *prev unfiltered scanline above the first one; NULL if
+ *        the first one is the top of the image
+ * @return 0 on success; -1 on an invalid filter type
+ */
+int png_unfilter_rows(U8 *raw, U64 rows, U64 row_bytes, int bpp, const U8 *prev)
+{
+    for (U64 y = 0; y < rows; y++) {
+        U8 *row = raw + y * (1 + row_bytes);
+
+        if (png_unfilter_row(row[0], row + 1, prev, row_bytes, bpp) != 0) {
+            return -1;
+        }
+        row[0] = PNG_FILTER_NONE;
+        prev = row + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief filter unfiltered scanlines in place. Goes bottom up, so every row
+ *        is filtered against the row above while that is still unfiltered.
+ * @param U8 *raw rows scanlines as png_unfilter_rows() leaves them
+ * @param U64 rows number of scanlines
+ * @param U64 row_bytes bytes per scanline without the type byte
+ * @param int bpp bytes per pixel
+ * @param const U8 *prev unfiltered scanline above the first one; NULL if
+ *        the first one is the top of the image
+ * @param int type filter for every row, or PNG_FILTER_ADAPTIVE
+ * @return 0 on success; -1 if out of memory
+ */
+int png_refilter_rows(U8 *raw, U64 rows, U64 row_bytes, int bpp, const U8 *prev, int type)
+{
+    U8 *out = malloc(2 * row_bytes + 1);
+
+    if (out == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (U64 y = rows; y-- > 0; ) {
+        U8 *row = raw + y * (1 + row_bytes);
+        const U8 *above = (y > 0) ? row - row_bytes : prev;
+
+        if (type == PNG_FILTER_ADAPTIVE) {
+            row[0] = png_filter_best(out, row + 1, above, row_bytes, bpp, out + row_bytes);
+        } else {
+            png_filter_row(type, out, row + 1, above, row_bytes, bpp);
+            row[0] = type;
+        }
+        memcpy(row + 1, out, row_bytes);
+    }
+    free(out);
+    return 0;
+}
+
+/**
+ * @brief rewrite the first scanline of a png so that it decodes the same
+ *        whatever row ends up above it. Against the zero row it was
+ *        filtered with, Up is None and Paeth is Sub; Average is unfiltered
+ *        and goes out as None.
+ * @param U8 *row the scanline, filter type byte first
+ * @param U64 row_bytes bytes per scanline without the type byte
+ * @param int bpp bytes per pixel
+ * @return 0 on success; -1 on an invalid filter type
+ */
+int png_detach_row(U8 *row, U64 row_bytes, int bpp)
+{
+    switch (row[0]) {
+    case PNG_FILTER_NONE:
+    case PNG_FILTER_SUB:
+        return 0;
+    case PNG_FILTER_UP:
+        row[0] = PNG_FILTER_NONE;
+        return 0;
+    case PNG_FILTER_PAETH:
+        row[0] = PNG_FILTER_SUB;
+        return 0;
+    case PNG_FILTER_AVG:
+        png_unfilter_row(PNG_FILTER_AVG, row + 1, NULL, row_bytes, bpp);
+        row[0] = PNG_FILTER_NONE;
+        return 0;
+    }
+    return -1;
+}
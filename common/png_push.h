@@ -0,0 +1,252 @@
+/**
+ * @brief  decode a png as it arrives, in pieces of any size
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * A push parser for the bytes of a png as a network transfer hands them
+ * over, e.g. from a cURL write callback. It keeps track of where it is in
+ * the signature and the chunks however the bytes are cut, checks every
+ * chunk CRC, and as soon as the IHDR is complete asks its caller where the
+ * scanlines should go. The IDAT payload is inflated straight there while
+ * the rest of the file is still on its way, so nothing needs to be parsed,
+ * buffered or inflated once the transfer ends.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <limits.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "lab_png.h"
+#include "crc.h"
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+/**
+ * @brief where the scanlines of the png with this IHDR go
+ * @return png_raw_size(ihdr) bytes of output; NULL to only check the file
+ */
+typedef U8 *(*pp_place_fn)(void *ctx, const struct data_IHDR *ihdr);
+
+enum pp_state {
+    PP_SIG,         /* in the signature */
+    PP_HEAD,        /* in a chunk's length and type */
+    PP_DATA,        /* in a chunk's data */
+    PP_CRC,         /* in a chunk's CRC */
+    PP_END          /* past IEND; anything more is ignored */
+};
+
+typedef struct png_push {
+    enum pp_state state;
+    U8 hold[PNG_SIG_SIZE];  /* a field cut in two by the pieces */
+    U32 held;               /* bytes of it in hold */
+    U32 left;               /* data bytes of the chunk still to come */
+    U8 type[CHUNK_TYPE_SIZE];
+    U32 crc;                /* running CRC of the chunk's type and data */
+    U8 ihdr_data[DATA_IHDR_SIZE];
+    struct data_IHDR ihdr;
+    int have_ihdr;
+    pp_place_fn place;
+    void *ctx;
+    U8 *dest;               /* where the scanlines go, from place() */
+    U64 dest_len;
+    z_stream strm;
+    int inflating;          /* 1 after inflateInit(), 2 at the stream end */
+    int ret;                /* Z_OK, or the first error */
+} *png_push_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+void pp_init(struct png_push *pp, pp_place_fn place, void *ctx);
+int pp_feed(struct png_push *pp, const U8 *buf, U64 len);
+int pp_finish(struct png_push *pp, U64 *got);
+void pp_cleanup(struct png_push *pp);
+
+/**
+ * @brief get ready for a new png
+ * @param pp_place_fn place called once the IHDR is in; NULL to check only
+ * @param void *ctx passed on to place
+ */
+void pp_init(struct png_push *pp, pp_place_fn place, void *ctx)
+{
+    memset(pp, 0, sizeof(*pp));
+    pp->state = PP_SIG;
+    pp->place = place;
+    pp->ctx = ctx;
+    pp->ret = Z_OK;
+}
+
+/**
+ * @brief move up to want - pp->held bytes of buf into pp->hold
+ * @return number of bytes taken
+ */
+static U64 pp_take(struct png_push *pp, const U8 *buf, U64 len, U32 want)
+{
+    U64 n = want - pp->held < len ? want - pp->held : len;
+
+    memcpy(pp->hold + pp->held, buf, n);
+    pp->held += n;
+    return n;
+}
+
+/**
+ * @brief the IHDR is complete: find out where the scanlines go
+ */
+static void pp_start(struct png_push *pp)
+{
+    parse_IHDR(&pp->ihdr, pp->ihdr_data);
+    pp->have_ihdr = 1;
+    pp->dest = pp->place != NULL ? pp->place(pp->ctx, &pp->ihdr) : NULL;
+    if (pp->dest == NULL) {
+        return;
+    }
+    pp->dest_len = png_raw_size(&pp->ihdr);
+    if (pp->dest_len == 0 || pp->dest_len > UINT_MAX) {  /* avail_out is 32 bits */
+        pp->ret = Z_DATA_ERROR;
+        return;
+    }
+    pp->strm.zalloc = Z_NULL;
+    pp->strm.zfree = Z_NULL;
+    pp->strm.opaque = Z_NULL;
+    pp->strm.next_in = Z_NULL;
+    pp->strm.avail_in = 0;
+    pp->ret = inflateInit(&pp->strm);
+    if (pp->ret == Z_OK) {
+        pp->inflating = 1;
+        pp->strm.next_out = pp->dest;
+        pp->strm.avail_out = pp->dest_len;
+    }
+}
+
+/**
+ * @brief inflate one piece of IDAT payload into dest
+ */
+static void pp_inflate(struct png_push *pp, const U8 *buf, U64 len)
+{
+    pp->strm.next_in = (U8 *)buf;
+    pp->strm.avail_in = len;
+    while (pp->strm.avail_in > 0 && pp->inflating == 1) {
+        int ret = inflate(&pp->strm, Z_NO_FLUSH);
+
+        if (ret == Z_STREAM_END) {
+            pp->inflating = 2;      /* whatever follows is padding */
+        } else if (ret != Z_OK) {   /* Z_BUF_ERROR: more than the IHDR allows */
+            pp->ret = ret == Z_BUF_ERROR ? Z_DATA_ERROR : ret;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief take the next piece of the png
+ * @param const U8 *buf the piece, of any length
+ * @return Z_OK so far; otherwise the error, and the rest is ignored
+ */
+int pp_feed(struct png_push *pp, const U8 *buf, U64 len)
+{
+    static const U8 png_tag[PNG_SIG_SIZE] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+    while (len > 0 && pp->ret == Z_OK && pp->state != PP_END) {
+        U64 n;
+
+        switch (pp->state) {
+        case PP_SIG:
+            n = pp_take(pp, buf, len, PNG_SIG_SIZE);
+            if (pp->held == PNG_SIG_SIZE) {
+                if (memcmp(pp->hold, png_tag, PNG_SIG_SIZE) != 0) {
+                    pp->ret = Z_DATA_ERROR;
+                }
+                pp->state = PP_HEAD;
+                pp->held = 0;
+            }
+            break;
+        case PP_HEAD:
+            n = pp_take(pp, buf, len, CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE);
+            if (pp->held == CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE) {
+                U32 length;
+
+                memcpy(&length, pp->hold, CHUNK_LEN_SIZE);
+                pp->left = ntohl(length);
+                memcpy(pp->type, pp->hold + CHUNK_LEN_SIZE, CHUNK_TYPE_SIZE);
+                pp->crc = update_crc(0xffffffffL, pp->type, CHUNK_TYPE_SIZE);
+                if (pp->have_ihdr == (memcmp(pp->type, "IHDR", CHUNK_TYPE_SIZE) == 0) ||
+                    (!pp->have_ihdr && pp->left != DATA_IHDR_SIZE)) {
+                    pp->ret = Z_DATA_ERROR;     /* IHDR must come first, once */
+                }
+                pp->state = pp->left > 0 ? PP_DATA : PP_CRC;
+                pp->held = 0;
+            }
+            break;
+        case PP_DATA:
+            n = pp->left < len ? pp->left : len;
+            pp->crc = update_crc(pp->crc, (U8 *)buf, n);
+            if (!pp->have_ihdr) {
+                memcpy(pp->ihdr_data + DATA_IHDR_SIZE - pp->left, buf, n);
+            } else if (pp->inflating == 1 && memcmp(pp->type, "IDAT", CHUNK_TYPE_SIZE) == 0) {
+                pp_inflate(pp, buf, n);
+            }
+            pp->left -= n;
+            if (pp->left == 0) {
+                pp->state = PP_CRC;
+            }
+            break;
+        default: /* PP_CRC */
+            n = pp_take(pp, buf, len, CHUNK_CRC_SIZE);
+            if (pp->held == CHUNK_CRC_SIZE) {
+                U32 crc_val;
+
+                memcpy(&crc_val, pp->hold, CHUNK_CRC_SIZE);
+                if (ntohl(crc_val) != (pp->crc ^ 0xffffffffL)) {
+                    pp->ret = Z_DATA_ERROR;
+                } else if (!pp->have_ihdr) {
+                    pp_start(pp);
+                }
+                pp->state = memcmp(pp->type, "IEND", CHUNK_TYPE_SIZE) == 0 ? PP_END : PP_HEAD;
+                pp->held = 0;
+            }
+            break;
+        }
+        buf += n;
+        len -= n;
+    }
+    return pp->ret;
+}
+
+/**
+ * @brief check that the whole png came and, if it had somewhere to go,
+ *        inflated to exactly what its IHDR says
+ * @param U64 *got output parameter, bytes of scanlines written; may be NULL
+ * @return Z_OK if so; Z_DATA_ERROR or the zlib error otherwise
+ */
+int pp_finish(struct png_push *pp, U64 *got)
+{
+    if (got != NULL) {
+        *got = pp->inflating ? pp->strm.total_out : 0;
+    }
+    if (pp->ret != Z_OK) {
+        return pp->ret;
+    }
+    if (pp->state != PP_END ||
+        (pp->dest != NULL && (pp->inflating != 2 || pp->strm.total_out != pp->dest_len))) {
+        return Z_DATA_ERROR;
+    }
+    return Z_OK;
+}
+
+/**
+ * @brief release the inflate state
+ */
+void pp_cleanup(struct png_push *pp)
+{
+    if (pp->inflating) {
+        inflateEnd(&pp->strm);
+        pp->inflating = 0;
+    }
+}
@@ -0,0 +1,189 @@
+/**
+ * @brief  write a whole png in a single pass from memory
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * The file is laid out in memory before anything is written: the signature
+ * and IHDR built from a struct data_IHDR with its CRC computed there, the
+ * IDAT chunk framing around the caller's compressed payload, and a constant
+ * IEND. All of it goes out in one writev(), so the output is never seeked,
+ * read back or patched, and the payload is never copied.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "lab_png.h"
+#include "crc.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define PNG_HEAD_SIZE (PNG_SIG_SIZE + CHUNK_OVERHEAD + DATA_IHDR_SIZE) /* 33 */
+#define PNG_IEND_SIZE CHUNK_OVERHEAD
+#define PNG_CHUNK_MAX 0x7fffffffUL  /* largest chunk length the spec allows */
+
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+void png_head(U8 *out, const struct data_IHDR *ihdr);
+U32 png_chunk_crc(const char *type, U32 data_crc, U64 len);
+int png_write(const char *path, const struct data_IHDR *ihdr,
+              const U8 *idat, U64 len, const U32 *idat_crc);
+
+/* IEND never changes, CRC included */
+static const U8 png_iend[PNG_IEND_SIZE] = {
+    0, 0, 0, 0, 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82
+};
+
+static void put_u32(U8 *p, U32 v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+/**
+ * @brief build the png signature and a complete IHDR chunk
+ * @param U8 *out PNG_HEAD_SIZE bytes of output
+ * @param const struct data_IHDR *ihdr IHDR fields in host byte order
+ */
+void png_head(U8 *out, const struct data_IHDR *ihdr)
+{
+    static const U8 png_tag[PNG_SIG_SIZE] = {137, 80, 78, 71, 13, 10, 26, 10};
+    U8 *p = out + PNG_SIG_SIZE;
+
+    memcpy(out, png_tag, PNG_SIG_SIZE);
+    put_u32(p, DATA_IHDR_SIZE);
+    memcpy(p + CHUNK_LEN_SIZE, "IHDR", CHUNK_TYPE_SIZE);
+    p += CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE;
+    put_u32(p, ihdr->width);
+    put_u32(p + 4, ihdr->height);
+    p[8]  = ihdr->bit_depth;
+    p[9]  = ihdr->color_type;
+    p[10] = ihdr->compression;
+    p[11] = ihdr->filter;
+    p[12] = ihdr->interlace;
+    put_u32(p + DATA_IHDR_SIZE, crc(p - CHUNK_TYPE_SIZE, CHUNK_TYPE_SIZE + DATA_IHDR_SIZE));
+}
+
+/**
+ * @brief the CRC field of a chunk, given the CRC of its data field alone
+ * @param const char *type chunk type, e.g. "IDAT"
+ * @param U32 data_crc crc() of the data field
+ * @param U64 len length of the data field
+ */
+U32 png_chunk_crc(const char *type, U32 data_crc, U64 len)
+{
+    return crc_combine(crc((U8 *)type, CHUNK_TYPE_SIZE), data_crc, len);
+}
+
+/**
+ * @brief writev() all n iovecs, picking up after short writes
+ * @return 0 on success; -1 with errno set otherwise
+ */
+static int writev_all(int fd, struct iovec *iov, int n)
+{
+    while (n > 0) {
+        ssize_t done = writev(fd, iov, n < IOV_MAX ? n : IOV_MAX);
+
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (U8 *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief write a png holding one zlib stream as its image data
+ * @param const char *path output file, created or truncated
+ * @param const struct data_IHDR *ihdr IHDR fields in host byte order
+ * @param const U8 *idat the zlib stream; written as it is, never copied
+ * @param U64 len length of idat. A stream longer than PNG_CHUNK_MAX is cut
+ *        into several IDAT chunks.
+ * @param const U32 *idat_crc crc() of idat if the caller worked it out
+ *        while producing the stream, e.g. par_def(); NULL to compute it here
+ * @return 0 on success; -1 otherwise
+ */
+int png_write(const char *path, const struct data_IHDR *ihdr,
+              const U8 *idat, U64 len, const U32 *idat_crc)
+{
+    U64 n_idat = len / PNG_CHUNK_MAX + (len % PNG_CHUNK_MAX != 0 || len == 0);
+    U8 head[PNG_HEAD_SIZE];
+    U8 (*frame)[CHUNK_OVERHEAD];  /* every IDAT's length, type and CRC */
+    struct iovec *iov;
+    int n_iov = 0;
+    int ret = 0;
+    int fd;
+
+    frame = malloc(n_idat * sizeof(*frame));
+    iov = malloc((3 * n_idat + 2) * sizeof(struct iovec));
+    if (frame == NULL || iov == NULL) {
+        perror("malloc");
+        free(frame);
+        free(iov);
+        return -1;
+    }
+
+    png_head(head, ihdr);
+    iov[n_iov].iov_base = head;
+    iov[n_iov++].iov_len = PNG_HEAD_SIZE;
+
+    for (U64 i = 0; i < n_idat; i++) {
+        const U8 *p = idat + i * PNG_CHUNK_MAX;
+        U64 k = len - i * PNG_CHUNK_MAX < PNG_CHUNK_MAX ? len - i * PNG_CHUNK_MAX : PNG_CHUNK_MAX;
+        U32 c = (n_idat == 1 && idat_crc != NULL) ? *idat_crc : crc((U8 *)p, k);
+
+        put_u32(frame[i], k);
+        memcpy(frame[i] + CHUNK_LEN_SIZE, "IDAT", CHUNK_TYPE_SIZE);
+        put_u32(frame[i] + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE, png_chunk_crc("IDAT", c, k));
+
+        iov[n_iov].iov_base = frame[i];
+        iov[n_iov++].iov_len = CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE;
+        if (k > 0) {
+            iov[n_iov].iov_base = (U8 *)p;
+            iov[n_iov++].iov_len = k;
+        }
+        iov[n_iov].iov_base = frame[i] + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE;
+        iov[n_iov++].iov_len = CHUNK_CRC_SIZE;
+    }
+
+    iov[n_iov].iov_base = (U8 *)png_iend;
+    iov[n_iov++].iov_len = PNG_IEND_SIZE;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || writev_all(fd, iov, n_iov) != 0) {
+        perror(path);
+        ret = -1;
+    }
+    if (fd >= 0 && close(fd) != 0 && ret == 0) {
+        perror(path);
+        ret = -1;
+    }
+    free(frame);
+    free(iov);
+    return ret;
+}
@@ -0,0 +1,286 @@
+/**
+ * @brief  bounded lock-free queue between processes in shared memory
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Dmitry Vyukov's bounded MPMC queue: a ring of slots, each with a sequence
+ * number that says whose turn it is. A producer claims the slot at the
+ * enqueue position with one compare-and-swap, copies its item in and hands
+ * the slot to the consumers by storing the next sequence number; a consumer
+ * does the same from the dequeue position. Nobody takes a lock, and items
+ * come out in the order they went in, so the first strips are not starved.
+ *
+ * Everything lives in the one block of memory, with no pointers in it, so
+ * the processes may map it anywhere. A push into a full ring, or a pop from
+ * an empty one, spins a little (not at all on one CPU) and then sleeps on a
+ * futex. The other side only makes the wake system call when somebody is
+ * asleep, so while the ring is neither full nor empty no call is made.
+ *
+ * Each writer calls ring_done() when it has pushed everything; after the
+ * last one, pops drain the ring and then fail, so the readers know to stop.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "lab_png.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define RING_SPIN 200     /* tries before sleeping, with more than one CPU */
+#define RING_LINE 64      /* cache line, the two ends are kept apart */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ring_relax() __builtin_ia32_pause()
+#else
+#define ring_relax() ((void) 0)
+#endif
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+struct ring_slot {
+    U32 seq;                /* pos: free for the push at pos; pos + 1: full */
+    U32 pad;
+    U8 data[];              /* item_size bytes, rounded up to 8 */
+};
+
+typedef struct shm_ring {
+    U32 mask;               /* slots - 1, a power of 2 */
+    U32 item_size;
+    U32 stride;             /* bytes from one slot to the next */
+    U32 spin;
+    U32 writers;            /* yet to call ring_done() */
+    U32 closed;             /* 1 once they all have */
+    U32 enq __attribute__((aligned(RING_LINE)));  /* next push */
+    U32 put_ev;             /* bumped to wake readers */
+    U32 readers_asleep;
+    U32 deq __attribute__((aligned(RING_LINE)));  /* next pop */
+    U32 take_ev;            /* bumped to wake writers */
+    U32 writers_asleep;
+    U8 slots[] __attribute__((aligned(RING_LINE)));
+} *shm_ring_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+size_t ring_bytes(U32 n, U32 item_size);
+int ring_init(struct shm_ring *r, U32 n, U32 item_size, U32 writers);
+int ring_try_push(struct shm_ring *r, const void *item);
+int ring_try_pop(struct shm_ring *r, void *item);
+void ring_push(struct shm_ring *r, const void *item);
+int ring_pop(struct shm_ring *r, void *item);
+void ring_done(struct shm_ring *r);
+
+/**
+ * @brief n rounded up to a power of 2
+ */
+static U32 ring_pow2(U32 n)
+{
+    return n <= 1 ? 1 : (U32)1 << (32 - __builtin_clz(n - 1));
+}
+
+static U32 ring_stride(U32 item_size)
+{
+    return sizeof(struct ring_slot) + ((item_size + 7) & ~7U);
+}
+
+static struct ring_slot *ring_slot(struct shm_ring *r, U32 pos)
+{
+    return (struct ring_slot *)(r->slots + (size_t)(pos & r->mask) * r->stride);
+}
+
+/**
+ * @brief memory a ring of n items needs, to allocate or shmget() before
+ *        ring_init()
+ * @param U32 n items it holds, rounded up to a power of 2
+ */
+size_t ring_bytes(U32 n, U32 item_size)
+{
+    return sizeof(struct shm_ring) + (size_t)ring_pow2(n) * ring_stride(item_size);
+}
+
+/**
+ * @brief set up an empty ring in ring_bytes(n, item_size) bytes of memory,
+ *        before any other process uses it
+ * @param U32 writers how many will push; the ring closes when they are done
+ * @return 0 on success; -1 if n or item_size is 0
+ */
+int ring_init(struct shm_ring *r, U32 n, U32 item_size, U32 writers)
+{
+    if (n == 0 || item_size == 0) {
+        return -1;
+    }
+    memset(r, 0, sizeof(*r));
+    r->mask = ring_pow2(n) - 1;
+    r->item_size = item_size;
+    r->stride = ring_stride(item_size);
+    r->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN : 0;
+    r->writers = writers;
+    for (U32 i = 0; i <= r->mask; i++) {
+        ring_slot(r, i)->seq = i;
+    }
+    return 0;
+}
+
+/**
+ * @brief add an item unless the ring is full
+ * @param const void *item item_size bytes, copied in
+ * @return 0 on success; -1 if full
+ */
+int ring_try_push(struct shm_ring *r, const void *item)
+{
+    U32 pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+    struct ring_slot *s;
+
+    for (;;) {
+        s = ring_slot(r, pos);
+        int dif = (int)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->enq, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;      /* the slot still holds an item from a lap ago */
+        } else {
+            pos = __atomic_load_n(&r->enq, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(s->data, item, r->item_size);
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief take the oldest item unless the ring is empty
+ * @param void *item output parameter, item_size bytes
+ * @return 0 on success; -1 if empty, or an item is half pushed
+ */
+int ring_try_pop(struct shm_ring *r, void *item)
+{
+    U32 pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+    struct ring_slot *s;
+
+    for (;;) {
+        s = ring_slot(r, pos);
+        int dif = (int)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->deq, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&r->deq, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(item, s->data, r->item_size);
+    __atomic_store_n(&s->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void ring_futex_wait(U32 *addr, U32 val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void ring_futex_wake(U32 *addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+/**
+ * @brief wake one of those asleep on ev, if anyone is; the fence orders
+ *        the push or pop just done before the look at the sleepers, and a
+ *        sleeper orders its count before its last try the same way
+ */
+static void ring_wake(U32 *ev, U32 *asleep)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(asleep, __ATOMIC_RELAXED) > 0) {
+        __atomic_fetch_add(ev, 1, __ATOMIC_RELEASE);
+        ring_futex_wake(ev, 1);
+    }
+}
+
+/**
+ * @brief add an item, waiting for room if the ring is full
+ */
+void ring_push(struct shm_ring *r, const void *item)
+{
+    for (U32 i = 0; ring_try_push(r, item) != 0; i++) {
+        if (i < r->spin) {
+            ring_relax();
+            continue;
+        }
+        __atomic_fetch_add(&r->writers_asleep, 1, __ATOMIC_SEQ_CST);
+        U32 ev = __atomic_load_n(&r->take_ev, __ATOMIC_SEQ_CST);
+
+        if (ring_try_push(r, item) == 0) {
+            __atomic_fetch_sub(&r->writers_asleep, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        ring_futex_wait(&r->take_ev, ev);
+        __atomic_fetch_sub(&r->writers_asleep, 1, __ATOMIC_RELAXED);
+        i = 0;
+    }
+    ring_wake(&r->put_ev, &r->readers_asleep);
+}
+
+/**
+ * @brief take the oldest item, waiting for one if the ring is empty
+ * @param void *item output parameter, item_size bytes
+ * @return 0 on success; -1 if the ring is empty and every writer is done
+ */
+int ring_pop(struct shm_ring *r, void *item)
+{
+    for (U32 i = 0; ring_try_pop(r, item) != 0; i++) {
+        if (i < r->spin) {
+            ring_relax();
+            continue;
+        }
+        __atomic_fetch_add(&r->readers_asleep, 1, __ATOMIC_SEQ_CST);
+        U32 ev = __atomic_load_n(&r->put_ev, __ATOMIC_SEQ_CST);
+        int closed = __atomic_load_n(&r->closed, __ATOMIC_SEQ_CST);
+
+        if (ring_try_pop(r, item) == 0) {
+            __atomic_fetch_sub(&r->readers_asleep, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (closed) {   /* closed before the try, so nothing comes later */
+            __atomic_fetch_sub(&r->readers_asleep, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        ring_futex_wait(&r->put_ev, ev);
+        __atomic_fetch_sub(&r->readers_asleep, 1, __ATOMIC_RELAXED);
+        i = 0;
+    }
+    ring_wake(&r->take_ev, &r->writers_asleep);
+    return 0;
+}
+
+/**
+ * @brief a writer has pushed all it will; after the last one the readers
+ *        are woken to drain the ring and stop
+ */
+void ring_done(struct shm_ring *r)
+{
+    if (__atomic_sub_fetch(&r->writers, 1, __ATOMIC_SEQ_CST) == 0) {
+        __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&r->put_ev, 1, __ATOMIC_SEQ_CST);
+        ring_futex_wake(&r->put_ev, INT_MAX);
+    }
+}
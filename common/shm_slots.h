@@ -0,0 +1,185 @@
+/**
+ * @brief  fixed-size buffers in shared memory, passed between processes by
+ *         index
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * One block of shared memory holds n slots of the same size, each on its
+ * own cache lines, and two shm_ring.h rings of slot numbers: the free slots
+ * and the ready ones. A producer reserves a free slot, writes into it
+ * where it is, e.g. straight from a cURL write callback, and publishes its
+ * number; a consumer takes the number, reads the slot where it is and
+ * releases it. The data itself never moves from one process to another,
+ * only four byte slot numbers do.
+ *
+ * Nothing in the block is a pointer, the slots are found by their offset
+ * from wherever a process has the block mapped.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include "shm_ring.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define SLOT_HEAD RING_LINE   /* bytes before a slot's data, for its header */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+struct slot_head {
+    int tag;                /* whatever the producer says the data is */
+    U32 len;                /* bytes of data in the slot */
+};
+
+typedef struct shm_slots {
+    U32 n;                  /* slots */
+    U32 size;               /* bytes of data a slot holds */
+    U64 free_off;           /* where the rings and the slots are, */
+    U64 ready_off;          /* from the start of this struct */
+    U64 slot_off;
+} *shm_slots_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+size_t slots_bytes(U32 n, U32 size);
+int slots_init(struct shm_slots *s, U32 n, U32 size, U32 producers);
+int slot_reserve(struct shm_slots *s);
+U8 *slot_data(struct shm_slots *s, int i);
+void slot_publish(struct shm_slots *s, int i, int tag, U32 len);
+int slot_next(struct shm_slots *s, int *tag, U32 *len);
+void slot_release(struct shm_slots *s, int i);
+void slots_done(struct shm_slots *s);
+
+static U64 slots_align(U64 x)
+{
+    return (x + RING_LINE - 1) & ~(U64)(RING_LINE - 1);
+}
+
+static struct shm_ring *slots_ring(struct shm_slots *s, U64 off)
+{
+    return (struct shm_ring *)((U8 *)s + off);
+}
+
+static struct slot_head *slot_head(struct shm_slots *s, int i)
+{
+    return (struct slot_head *)((U8 *)s + s->slot_off + (U64)i * (SLOT_HEAD + s->size));
+}
+
+/**
+ * @brief memory n slots of size bytes need, to shmget() before slots_init()
+ */
+size_t slots_bytes(U32 n, U32 size)
+{
+    U64 ring = slots_align(ring_bytes(n, sizeof(U32)));
+
+    return slots_align(sizeof(struct shm_slots)) + 2 * ring +
+           (U64)n * (SLOT_HEAD + slots_align(size));
+}
+
+/**
+ * @brief set up n free slots in slots_bytes(n, size) bytes of memory,
+ *        before any other process uses it
+ * @param U32 size bytes of data per slot, rounded up to a cache line
+ * @param U32 producers how many will publish; slot_next() fails once they
+ *        have all called slots_done() and every slot is taken
+ * @return 0 on success; -1 if n or size is 0
+ */
+int slots_init(struct shm_slots *s, U32 n, U32 size, U32 producers)
+{
+    U64 ring = slots_align(ring_bytes(n, sizeof(U32)));
+
+    if (n == 0 || size == 0) {
+        return -1;
+    }
+    s->n = n;
+    s->size = slots_align(size);
+    s->free_off = slots_align(sizeof(struct shm_slots));
+    s->ready_off = s->free_off + ring;
+    s->slot_off = s->ready_off + ring;
+    ring_init(slots_ring(s, s->free_off), n, sizeof(U32), 1);  /* never closed */
+    ring_init(slots_ring(s, s->ready_off), n, sizeof(U32), producers);
+    for (U32 i = 0; i < n; i++) {
+        ring_try_push(slots_ring(s, s->free_off), &i);
+    }
+    return 0;
+}
+
+/**
+ * @brief take a free slot to fill, waiting for one if there is none; every
+ *        slot reserved must be published or released
+ * @return its number
+ */
+int slot_reserve(struct shm_slots *s)
+{
+    U32 i;
+
+    ring_pop(slots_ring(s, s->free_off), &i);
+    return i;
+}
+
+/**
+ * @brief where the data of slot i is in this process, s->size bytes
+ */
+U8 *slot_data(struct shm_slots *s, int i)
+{
+    return (U8 *)slot_head(s, i) + SLOT_HEAD;
+}
+
+/**
+ * @brief hand a filled slot to the consumers
+ * @param int tag e.g. what the data is a part of
+ * @param U32 len bytes of data in it
+ */
+void slot_publish(struct shm_slots *s, int i, int tag, U32 len)
+{
+    struct slot_head *h = slot_head(s, i);
+
+    h->tag = tag;
+    h->len = len;
+    ring_push(slots_ring(s, s->ready_off), &i);  /* its release orders the header */
+}
+
+/**
+ * @brief take the oldest slot published, waiting for one if there is none
+ * @param int *tag output parameter, what slot_publish() was told
+ * @param U32 *len output parameter, bytes of data in it
+ * @return the slot number, to release when done with it; -1 if every
+ *         producer is done and every slot taken
+ */
+int slot_next(struct shm_slots *s, int *tag, U32 *len)
+{
+    U32 i;
+
+    if (ring_pop(slots_ring(s, s->ready_off), &i) != 0) {
+        return -1;
+    }
+    *tag = slot_head(s, i)->tag;
+    *len = slot_head(s, i)->len;
+    return i;
+}
+
+/**
+ * @brief give slot i back to be reserved again, after slot_next() or
+ *        instead of slot_publish()
+ */
+void slot_release(struct shm_slots *s, int i)
+{
+    U32 u = i;
+
+    ring_push(slots_ring(s, s->free_off), &u);
+}
+
+/**
+ * @brief a producer will publish no more
+ */
+void slots_done(struct shm_slots *s)
+{
+    ring_done(slots_ring(s, s->ready_off));
+}
@@ -0,0 +1,184 @@
+/**
+ * @brief  read a whole input file into a byte span the png parsers can walk
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Regular files are mmap()ed read-only with MADV_SEQUENTIAL, so parsing the
+ * chunks costs nothing beyond the page faults. Pipes, terminals and stdin
+ * ("-") cannot be mapped and are read() into a malloc()ed buffer instead.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab_png.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define SPAN_READ_SIZE (64*1024) /* first read() buffer size, doubled as needed */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+typedef struct span {
+    const U8 *buf;  /* file contents, read-only */
+    U64 len;        /* length of buf in bytes */
+    int mapped;     /* 1: buf is an mmap(); 0: buf is malloc()ed */
+} *span_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int span_open(struct span *s, const char *path);
+int span_read_fd(struct span *s, int fd);
+void span_close(struct span *s);
+const U8 *span_at(const struct span *s, U64 offset, U64 len);
+int span_IHDR(const struct span *s, struct data_IHDR *out);
+
+/**
+ * @brief read everything left on fd into a malloc()ed span
+ * @param struct span *s output parameter
+ * @param int fd descriptor to read until end of file, it is not closed
+ * @return 0 on success; -1 otherwise
+ */
+int span_read_fd(struct span *s, int fd)
+{
+    U64 cap = SPAN_READ_SIZE;
+    U64 len = 0;
+    U8 *buf = malloc(cap);
+    ssize_t n;
+
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    while ((n = read(fd, buf + len, cap - len)) != 0) {
+        if (n < 0) {
+            perror("read");
+            free(buf);
+            return -1;
+        }
+        len += n;
+        if (len == cap) {
+            U8 *tmp = realloc(buf, cap * 2);
+            if (tmp == NULL) {
+                perror("realloc");
+                free(buf);
+                return -1;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+    }
+    s->buf = buf;
+    s->len = len;
+    s->mapped = 0;
+    return 0;
+}
+
+/**
+ * @brief get the whole contents of a file as one span
+ * @param struct span *s output parameter, release with span_close()
+ * @param const char *path input file path; "-" for stdin
+ * @return 0 on success; -1 otherwise
+ */
+int span_open(struct span *s, const char *path)
+{
+    struct stat st;
+    void *p;
+    int fd;
+    int ret;
+
+    s->buf = NULL;
+    s->len = 0;
+    s->mapped = 0;
+    if (strcmp(path, "-") == 0) {
+        return span_read_fd(s, STDIN_FILENO);
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) { /* nothing to map */
+        ret = span_read_fd(s, fd);
+        close(fd);
+        return ret;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); /* the mapping keeps the file open */
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    s->buf = p;
+    s->len = st.st_size;
+    s->mapped = 1;
+    return 0;
+}
+
+/**
+ * @brief release a span from span_open() or span_read_fd()
+ */
+void span_close(struct span *s)
+{
+    if (s->mapped) {
+        munmap((void *)s->buf, s->len);
+    } else {
+        free((void *)s->buf);
+    }
+    s->buf = NULL;
+    s->len = 0;
+}
+
+/**
+ * @brief bounds checked access to a span
+ * @param const struct span *s the span
+ * @param U64 offset offset of the first byte wanted
+ * @param U64 len number of bytes wanted
+ * @return pointer to byte offset; NULL if the span is shorter than offset+len
+ */
+const U8 *span_at(const struct span *s, U64 offset, U64 len)
+{
+    if (offset > s->len || len > s->len - offset) {
+        return NULL;
+    }
+    return s->buf + offset;
+}
+
+/**
+ * @brief check the signature and read the IHDR of the png in a span
+ * @param const struct span *s the whole png file
+ * @param struct data_IHDR *out output parameter, host byte order
+ * @return 0 on success; -1 if the span does not start with a png signature
+ *         and a well formed IHDR
+ */
+int span_IHDR(const struct span *s, struct data_IHDR *out)
+{
+    struct png_iter it;
+    struct chunk c;
+
+    if (png_iter_init(&it, s->buf, s->len) != 0 ||
+        png_iter_next(&it, &c) != 1 ||
+        memcmp(c.type, "IHDR", CHUNK_TYPE_SIZE) != 0 ||
+        c.length != DATA_IHDR_SIZE) {
+        return -1;
+    }
+    return parse_IHDR(out, c.p_data);
+}
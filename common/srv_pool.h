@@ -0,0 +1,399 @@
+/**
+ * @brief  pick which of several image servers serves the next request
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Every server serves the same image, so any of them will do for any
+ * request; the pool decides which one. With SP_P2C it draws two servers at
+ * random and takes the one with the lower expected wait, its moving average
+ * (EWMA) latency times the requests it has in flight. A fast server ends up
+ * with most of the load, yet no server is ever flooded. SP_RR just takes
+ * turns, for comparison.
+ *
+ * A server fails SP_FAILS times in a row, or gets more than SP_SLOW_X times
+ * slower than the best one, and it is ejected: nothing is sent there for a
+ * backoff that doubles on every ejection in a row, up to SP_BACKOFF_MAX.
+ * Then one probe goes out; a good answer brings the server back, a bad one
+ * ejects it again. While every server is out, or only probes are pending,
+ * sp_pick() sleeps until the first one may take a request, rather than
+ * send requests nobody answers; sp_close() ends that wait at shutdown.
+ *
+ * sp_report() prints per server request counts and the p50/p99 latency from
+ * a log histogram, so how the load was spread is visible.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "lab_png.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define SP_MAX_SERVERS 16
+#define SP_ALPHA       0.2    /* weight of the newest sample in the EWMA */
+#define SP_FAILS       3      /* failures in a row that eject a server */
+#define SP_SLOW_X      8.0    /* EWMA this many times the best ejects one */
+#define SP_BACKOFF     0.5    /* seconds ejected the first time */
+#define SP_BACKOFF_MAX 30.0
+#define SP_TIMEOUT_MS  10000L /* a request slower than this has failed */
+#define SP_HIST        128    /* latency buckets, 4 per power of 2 in us */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+enum sp_policy {
+    SP_P2C,     /* power of two choices on EWMA latency, with ejection */
+    SP_RR       /* round robin, every server in turn */
+};
+
+struct sp_server {
+    const char *url;
+    double ewma;            /* seconds; 0 until measured, or after a return */
+    int inflight;           /* requests sent and not answered yet */
+    int fails;              /* failures in a row */
+    int level;              /* ejections in a row, sets the backoff */
+    double eject_until;     /* sp_now() it is back in the pool; 0 if in */
+    U64 requests;
+    U64 errors;
+    U64 ejections;
+    U64 hist[SP_HIST];      /* latency of good answers */
+};
+
+typedef struct srv_pool {
+    int n;
+    enum sp_policy policy;
+    U64 turn;               /* next server for SP_RR */
+    char *urls;             /* our copy of the list, cut at the commas */
+    int closing;            /* 1: sp_pick() no longer waits */
+    pthread_mutex_t mutex;
+    pthread_cond_t answer;  /* broadcast by sp_done() and sp_close() */
+    struct sp_server srv[SP_MAX_SERVERS];
+} *srv_pool_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+double sp_now(void);
+int sp_init(struct srv_pool *p, const char *urls, enum sp_policy policy);
+int sp_pick(struct srv_pool *p);
+void sp_done(struct srv_pool *p, int i, double secs, int ok);
+void sp_close(struct srv_pool *p);
+double sp_quantile(const struct sp_server *s, double q);
+void sp_report(struct srv_pool *p, FILE *fp);
+void sp_cleanup(struct srv_pool *p);
+
+/**
+ * @brief seconds since an arbitrary point, for timing
+ */
+double sp_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief set up a pool
+ * @param const char *urls one or more URLs separated by commas
+ * @param enum sp_policy policy how to pick a server
+ * @return 0 on success; -1 if there is no URL, too many, or no memory
+ */
+int sp_init(struct srv_pool *p, const char *urls, enum sp_policy policy)
+{
+    char *save = NULL;
+    pthread_condattr_t attr;
+
+    memset(p, 0, sizeof(*p));
+    p->policy = policy;
+    p->urls = strdup(urls);
+    if (p->urls == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);   /* as sp_now() */
+    pthread_cond_init(&p->answer, &attr);
+    pthread_condattr_destroy(&attr);
+    for (char *u = strtok_r(p->urls, ",", &save); u != NULL; u = strtok_r(NULL, ",", &save)) {
+        if (p->n == SP_MAX_SERVERS) {
+            fprintf(stderr, "sp_init: more than %d servers\n", SP_MAX_SERVERS);
+            sp_cleanup(p);
+            return -1;
+        }
+        p->srv[p->n++].url = u;
+    }
+    if (p->n == 0) {
+        fprintf(stderr, "sp_init: no server in \"%s\"\n", urls);
+        sp_cleanup(p);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief what a request sent to s now is expected to cost; a server not
+ *        measured yet gets a single probe
+ */
+static double sp_cost(const struct sp_server *s)
+{
+    if (s->ewma == 0) {
+        return s->inflight == 0 ? 0 : 1e30;
+    }
+    return s->ewma * (s->inflight + 1);
+}
+
+static unsigned sp_rand(void)
+{
+    static __thread unsigned seed;
+
+    if (seed == 0) {
+        seed = (unsigned)(sp_now() * 1e9) ^ (unsigned)(size_t)&seed;
+    }
+    return rand_r(&seed);
+}
+
+/**
+ * @brief whether s is back from an ejection with its one probe out
+ */
+static int sp_probing(const struct sp_server *s)
+{
+    return s->eject_until == 0 && s->level > 0 && s->ewma == 0 && s->inflight > 0;
+}
+
+/**
+ * @brief sleep until sp_done() or sp_close() is called, or until the sp_now()
+ *        time until, if it is not 0; call with the mutex held
+ */
+static void sp_wait(struct srv_pool *p, double until)
+{
+    struct timespec ts;
+
+    if (until == 0) {
+        pthread_cond_wait(&p->answer, &p->mutex);
+        return;
+    }
+    ts.tv_sec = (time_t)until;
+    ts.tv_nsec = (long)((until - ts.tv_sec) * 1e9);
+    pthread_cond_timedwait(&p->answer, &p->mutex, &ts);
+}
+
+/**
+ * @brief choose the server for the next request; report how it went with
+ *        sp_done(), every pick needs exactly one. With SP_P2C this waits
+ *        while no server may take a request, see sp_wait()
+ * @return index into p->srv
+ */
+int sp_pick(struct srv_pool *p)
+{
+    int live[SP_MAX_SERVERS];
+    int n_live = 0;
+    int pick = 0;
+
+    pthread_mutex_lock(&p->mutex);
+    if (p->policy == SP_RR) {
+        pick = p->turn++ % p->n;
+    } else {
+        for (;;) {
+            double now = sp_now();
+            double back = 0;            /* the first ejected server returns */
+
+            n_live = 0;
+            for (int i = 0; i < p->n; i++) {
+                struct sp_server *s = p->srv + i;
+
+                if (s->eject_until != 0 && now >= s->eject_until) {
+                    s->eject_until = 0;     /* back, on probation */
+                    s->ewma = 0;
+                }
+                if (s->eject_until != 0) {
+                    back = (back == 0 || s->eject_until < back) ? s->eject_until : back;
+                } else if (!sp_probing(s)) {
+                    live[n_live++] = i;
+                }
+            }
+            if (n_live > 0 || p->closing) {
+                break;
+            }
+            sp_wait(p, back);
+        }
+        if (n_live == 0) {              /* closing, any server will do */
+            pick = 0;
+        } else if (n_live == 1) {
+            pick = live[0];
+        } else {
+            int a = sp_rand() % n_live;
+            int b = sp_rand() % (n_live - 1);
+
+            b += b >= a;                /* two different servers */
+            a = live[a];
+            b = live[b];
+            pick = sp_cost(p->srv + b) < sp_cost(p->srv + a) ? b : a;
+        }
+    }
+    p->srv[pick].inflight++;
+    pthread_mutex_unlock(&p->mutex);
+    return pick;
+}
+
+/**
+ * @brief take server i out of the pool for a while, even the last one in;
+ *        call with the mutex held
+ */
+static void sp_eject(struct srv_pool *p, int i)
+{
+    struct sp_server *s = p->srv + i;
+    double backoff = SP_BACKOFF;
+
+    for (int k = 0; k < s->level && backoff < SP_BACKOFF_MAX; k++) {
+        backoff *= 2;
+    }
+    s->eject_until = sp_now() + (backoff < SP_BACKOFF_MAX ? backoff : SP_BACKOFF_MAX);
+    s->level++;
+    s->fails = 0;
+    s->ejections++;
+}
+
+static int sp_bucket(double secs)
+{
+    U64 us = secs > 0 ? (U64)(secs * 1e6) : 0;
+    int msb, b;
+
+    if (us < 4) {
+        return (int)us;
+    }
+    msb = 63 - __builtin_clzll(us);
+    b = 4 * msb + ((us >> (msb - 2)) & 3);
+    return b < SP_HIST ? b : SP_HIST - 1;
+}
+
+/**
+ * @brief report how the request sent to server i by sp_pick() went
+ * @param double secs how long it took
+ * @param int ok 0 if it failed: an error, a timeout, or a bad answer
+ */
+void sp_done(struct srv_pool *p, int i, double secs, int ok)
+{
+    struct sp_server *s = p->srv + i;
+    double best = 0;
+
+    pthread_mutex_lock(&p->mutex);
+    s->inflight--;
+    s->requests++;
+    pthread_cond_broadcast(&p->answer);     /* maybe a probe, see sp_pick() */
+    if (!ok) {
+        s->errors++;
+        s->fails++;
+        /* a failed probe ejects the server again at once; answers to
+           requests sent before an ejection do not make it longer */
+        if (p->policy == SP_P2C && s->eject_until == 0 &&
+            (s->fails >= SP_FAILS || (s->level > 0 && s->ewma == 0))) {
+            sp_eject(p, i);
+        }
+        pthread_mutex_unlock(&p->mutex);
+        return;
+    }
+    s->fails = 0;
+    s->hist[sp_bucket(secs)]++;
+    s->ewma = s->ewma == 0 ? secs : SP_ALPHA * secs + (1 - SP_ALPHA) * s->ewma;
+
+    if (p->policy == SP_P2C && s->eject_until == 0) {
+        for (int j = 0; j < p->n; j++) {
+            const struct sp_server *o = p->srv + j;
+
+            if (j != i && o->eject_until == 0 && o->ewma > 0 && (best == 0 || o->ewma < best)) {
+                best = o->ewma;
+            }
+        }
+        if (best > 0 && s->ewma > SP_SLOW_X * best) {
+            sp_eject(p, i);
+        } else {
+            s->level = 0;
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * @brief stop sp_pick() from waiting for a server, e.g. once every request
+ *        that matters has been answered; sp_pick() then returns right away
+ */
+void sp_close(struct srv_pool *p)
+{
+    pthread_mutex_lock(&p->mutex);
+    p->closing = 1;
+    pthread_cond_broadcast(&p->answer);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+/**
+ * @brief latency quantile of the good answers of a server, to within the
+ *        quarter octave of its histogram bucket
+ * @param double q e.g. 0.99
+ * @return seconds; 0 if nothing was measured
+ */
+double sp_quantile(const struct sp_server *s, double q)
+{
+    U64 total = 0, seen = 0;
+
+    for (int b = 0; b < SP_HIST; b++) {
+        total += s->hist[b];
+    }
+    for (int b = 0; b < SP_HIST && total > 0; b++) {
+        seen += s->hist[b];
+        if (seen >= q * total) {
+            if (b < 4) {
+                return (b + 1) / 1e6;
+            }
+            return (double)((U64)(5 + b % 4) << (b / 4 - 2)) / 1e6;  /* bucket top */
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief print a line per server: its share of the requests, errors,
+ *        ejections and latency
+ */
+void sp_report(struct srv_pool *p, FILE *fp)
+{
+    U64 total = 0;
+
+    for (int i = 0; i < p->n; i++) {
+        total += p->srv[i].requests;
+    }
+    fprintf(fp, "pool: %s over %d servers, %lu requests\n",
+            p->policy == SP_RR ? "round robin" : "power of two choices", p->n, total);
+    for (int i = 0; i < p->n; i++) {
+        const struct sp_server *s = p->srv + i;
+
+        fprintf(fp, "pool: %-48s %6lu req %5.1f%% %4lu err %3lu ejected  "
+                "p50 %8.3f ms  p99 %8.3f ms\n", s->url, s->requests,
+                total ? 100.0 * s->requests / total : 0.0, s->errors, s->ejections,
+                1e3 * sp_quantile(s, 0.5), 1e3 * sp_quantile(s, 0.99));
+    }
+}
+
+/**
+ * @brief release the pool; no sp_pick() may be running
+ */
+void sp_cleanup(struct srv_pool *p)
+{
+    if (p->urls != NULL) {
+        pthread_mutex_destroy(&p->mutex);
+        pthread_cond_destroy(&p->answer);
+    }
+    free(p->urls);
+    p->urls = NULL;
+    p->n = 0;
+}
@@ -0,0 +1,665 @@
+/**
+ * @brief  on-disk, content-addressed cache of downloaded and inflated strips
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * A strip is keyed by the URL it was fetched from and the sequence number
+ * the server gave it (X-Ece252-Fragment), and is stored together with a
+ * hash of its content: the png as received and, once known, its inflated
+ * scanlines. Both live in an append-only pack file that readers mmap(), so
+ * a hit hands out pointers into the page cache and nothing is copied or
+ * inflated again. Strips with the same content are stored once however many
+ * keys point at them.
+ *
+ * The cache directory holds three files:
+ *   pack   the png and scanline blobs, back to back
+ *   index  a header and fixed size records, appended as strips come in; a
+ *          later record for the same key supersedes an earlier one
+ *   lock   flock()ed around every change, so several pasters, threads or
+ *          processes can share one cache
+ *
+ * When the pack outgrows its size cap, sc_close() keeps the most recently
+ * used strips that fit in three quarters of the cap and rewrites both files.
+ * Caching is opt-in: the directory is STRIP_CACHE, and with STRIP_CACHE unset
+ * or empty there is no cache, so timed runs always fetch. The cap is
+ * STRIP_CACHE_MB megabytes, or SC_DEFAULT_MB.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab_png.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define SC_DEFAULT_MB  256
+#define SC_MAGIC       "STRIPC01"
+#define SC_HEAD_SIZE   16     /* magic and 8 bytes reserved */
+#define SC_MAX_MAPS    64     /* pack mappings a cache may outgrow */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+/* one index record, stored as it is */
+struct sc_rec {
+    U64 key;        /* sc_key() of the URL and seq */
+    U64 hash;       /* sc_hash() of the png */
+    U64 raw_hash;   /* sc_hash() of the scanlines */
+    U64 png_off;    /* where the png is in the pack */
+    U64 raw_off;    /* where the scanlines are; raw_len 0 if not stored */
+    U64 raw_len;
+    U64 used;       /* when it was last stored or hit, in microseconds */
+    U32 png_len;
+    U32 seq;
+};
+
+/* what sc_get() hands out; valid until sc_close() */
+struct sc_hit {
+    const U8 *png;
+    U64 png_len;
+    const U8 *raw;  /* NULL if the scanlines were never stored */
+    U64 raw_len;
+};
+
+typedef struct strip_cache {
+    char dir[PATH_MAX - 16];
+    int lock_fd;
+    int idx_fd;
+    int pack_fd;
+    ino_t idx_ino;          /* to notice another process compacting */
+    struct sc_rec *rec;     /* the index, as far as it has been read */
+    U64 n_rec;
+    U64 cap_rec;
+    U64 pack_len;
+    U64 cap;                /* size cap of the pack in bytes */
+    void *maps[SC_MAX_MAPS];/* mappings of the pack, newest last */
+    U64 map_len[SC_MAX_MAPS];
+    int n_maps;
+    int stale;              /* the files were replaced, map them anew */
+    pthread_mutex_t mutex;  /* flock() does not exclude threads */
+    /* counters */
+    U64 hits;
+    U64 misses;
+    U64 stores;
+    U64 dedups;             /* stores whose png was already in the pack */
+    U64 evictions;
+} *strip_cache_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+U64 sc_hash(const U8 *buf, U64 len);
+U64 sc_key(const char *url, int seq);
+struct strip_cache *sc_open(const char *dir);
+int sc_get(struct strip_cache *c, const char *url, int seq, struct sc_hit *hit);
+int sc_put(struct strip_cache *c, const char *url, int seq,
+           const U8 *png, U64 png_len, const U8 *raw, U64 raw_len);
+void sc_stats(struct strip_cache *c, FILE *fp);
+void sc_close(struct strip_cache *c);
+
+/******************************************************************************
+ * FUNCTIONS
+ *****************************************************************************/
+/**
+ * @brief 64 bit content hash, eight bytes a step. Not cryptographic: it
+ *        tells strips apart and catches a damaged pack, nothing more.
+ */
+U64 sc_hash(const U8 *buf, U64 len)
+{
+    U64 h = 0x9e3779b97f4a7c15ULL ^ (len * 0xff51afd7ed558ccdULL);
+    U64 w;
+    U64 i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, buf + i, 8);
+        h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 31;
+    }
+    w = 0;
+    memcpy(&w, buf + i, len - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    h *= 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 32);
+}
+
+/**
+ * @brief the key of strip seq of the image at url
+ */
+U64 sc_key(const char *url, int seq)
+{
+    return sc_hash((const U8 *)url, strlen(url)) ^ ((U64)(U32)seq * 0x9e3779b97f4a7c15ULL);
+}
+
+static U64 sc_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (U64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int sc_path(char *out, const struct strip_cache *c, const char *name)
+{
+    return snprintf(out, PATH_MAX, "%s/%s", c->dir, name) < PATH_MAX ? 0 : -1;
+}
+
+static int sc_lock(struct strip_cache *c)
+{
+    pthread_mutex_lock(&c->mutex);
+    while (flock(c->lock_fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            perror("flock");
+            pthread_mutex_unlock(&c->mutex);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void sc_unlock(struct strip_cache *c)
+{
+    flock(c->lock_fd, LOCK_UN);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static int sc_pwrite(int fd, const void *buf, U64 len, U64 off)
+{
+    const U8 *p = buf;
+
+    while (len > 0) {
+        ssize_t done = pwrite(fd, p, len, off);
+
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += done;
+        off += done;
+        len -= done;
+    }
+    return 0;
+}
+
+/**
+ * @brief bring the in-memory index up to date with the files, reopening
+ *        them if another process replaced them; call with the lock held
+ * @return 0 on success; -1 otherwise
+ */
+static int sc_load(struct strip_cache *c)
+{
+    char path[PATH_MAX];
+    U8 head[SC_HEAD_SIZE];
+    struct stat st;
+    U64 n;
+
+    if (sc_path(path, c, "index") != 0 || stat(path, &st) != 0) {
+        st.st_ino = 0;   /* not there yet, or gone: start over */
+    }
+    if (c->idx_fd < 0 || st.st_ino != c->idx_ino) {
+        if (c->idx_fd >= 0) {
+            close(c->idx_fd);
+            close(c->pack_fd);
+        }
+        c->idx_fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (c->idx_fd < 0 || sc_path(path, c, "pack") != 0 ||
+            (c->pack_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 ||
+            fstat(c->idx_fd, &st) != 0) {
+            perror(path);
+            return -1;
+        }
+        c->idx_ino = st.st_ino;
+        c->n_rec = 0;
+        c->stale = 1;
+        if (st.st_size < SC_HEAD_SIZE || pread(c->idx_fd, head, SC_HEAD_SIZE, 0) != SC_HEAD_SIZE ||
+            memcmp(head, SC_MAGIC, 8) != 0) {   /* new, or not ours: start empty */
+            memset(head, 0, SC_HEAD_SIZE);
+            memcpy(head, SC_MAGIC, 8);
+            if (ftruncate(c->idx_fd, 0) != 0 || ftruncate(c->pack_fd, 0) != 0 ||
+                sc_pwrite(c->idx_fd, head, SC_HEAD_SIZE, 0) != 0) {
+                perror("index");
+                return -1;
+            }
+        }
+    }
+
+    if (fstat(c->idx_fd, &st) != 0) {
+        perror("index");
+        return -1;
+    }
+    n = (st.st_size - SC_HEAD_SIZE) / sizeof(struct sc_rec);
+    if (n > c->cap_rec) {
+        struct sc_rec *more = realloc(c->rec, n * 2 * sizeof(struct sc_rec));
+
+        if (more == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        c->rec = more;
+        c->cap_rec = n * 2;
+    }
+    if (n > c->n_rec) {
+        U64 want = (n - c->n_rec) * sizeof(struct sc_rec);
+
+        if (pread(c->idx_fd, c->rec + c->n_rec, want,
+                  SC_HEAD_SIZE + c->n_rec * sizeof(struct sc_rec)) != (ssize_t)want) {
+            perror("index");
+            return -1;
+        }
+    }
+    c->n_rec = n;
+    if (fstat(c->pack_fd, &st) != 0) {
+        perror("pack");
+        return -1;
+    }
+    c->pack_len = st.st_size;
+    return 0;
+}
+
+/**
+ * @brief the newest record of key, or -1
+ */
+static long sc_find(const struct strip_cache *c, U64 key)
+{
+    for (U64 i = c->n_rec; i-- > 0; ) {
+        if (c->rec[i].key == key) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief a pointer to len bytes of the pack at off. The pack is mapped anew
+ *        when it has grown past the newest mapping; older mappings stay,
+ *        so what earlier hits handed out stays valid.
+ */
+static const U8 *sc_view(struct strip_cache *c, U64 off, U64 len)
+{
+    void *p;
+
+    if (off + len > c->pack_len || off + len < off) {
+        return NULL;
+    }
+    if (c->n_maps == 0 || c->stale || off + len > c->map_len[c->n_maps - 1]) {
+        if (c->n_maps == SC_MAX_MAPS) {
+            return NULL;
+        }
+        p = mmap(NULL, c->pack_len, PROT_READ, MAP_SHARED, c->pack_fd, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        c->maps[c->n_maps] = p;
+        c->map_len[c->n_maps++] = c->pack_len;
+        c->stale = 0;
+    }
+    return (const U8 *)c->maps[c->n_maps - 1] + off;
+}
+
+/**
+ * @brief open, or create, the cache in dir
+ * @param const char *dir cache directory; NULL for STRIP_CACHE, no cache
+ *        when that is unset or empty
+ * @return the cache; NULL if caching is turned off or the directory cannot
+ *         be used, the caller then goes without
+ */
+struct strip_cache *sc_open(const char *dir)
+{
+    const char *mb = getenv("STRIP_CACHE_MB");
+    struct strip_cache *c;
+    char path[PATH_MAX];
+
+    if (dir == NULL) {
+        dir = getenv("STRIP_CACHE");
+    }
+    if (dir == NULL || dir[0] == '\0' || strlen(dir) >= sizeof(c->dir)) {
+        return NULL;
+    }
+    c = calloc(1, sizeof(struct strip_cache));
+    if (c == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    strcpy(c->dir, dir);
+    c->idx_fd = c->pack_fd = -1;
+    c->cap = (U64)(mb ? strtoul(mb, NULL, 10) : SC_DEFAULT_MB) << 20;
+    pthread_mutex_init(&c->mutex, NULL);
+
+    if ((mkdir(dir, 0755) != 0 && errno != EEXIST) || sc_path(path, c, "lock") != 0 ||
+        (c->lock_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        perror(dir);
+        pthread_mutex_destroy(&c->mutex);
+        free(c);
+        return NULL;
+    }
+    if (sc_lock(c) != 0) {
+        sc_close(c);
+        return NULL;
+    }
+    if (sc_load(c) != 0) {
+        sc_unlock(c);
+        sc_close(c);
+        return NULL;
+    }
+    sc_unlock(c);
+    return c;
+}
+
+/**
+ * @brief look up strip seq of the image at url
+ * @param struct sc_hit *hit output parameter, pointers into the pack
+ * @return 1 on a hit; 0 on a miss, including a record whose content no
+ *         longer matches its hash
+ */
+int sc_get(struct strip_cache *c, const char *url, int seq, struct sc_hit *hit)
+{
+    U64 key = sc_key(url, seq);
+    struct sc_rec *r;
+    long i;
+    int ret = 0;
+
+    if (c == NULL || sc_lock(c) != 0) {
+        return 0;
+    }
+    if (sc_load(c) == 0 && (i = sc_find(c, key)) >= 0) {
+        r = c->rec + i;
+        hit->png = sc_view(c, r->png_off, r->png_len);
+        hit->png_len = r->png_len;
+        hit->raw = r->raw_len ? sc_view(c, r->raw_off, r->raw_len) : NULL;
+        hit->raw_len = hit->raw ? r->raw_len : 0;
+        ret = hit->png != NULL && sc_hash(hit->png, hit->png_len) == r->hash;
+        if (ret && hit->raw != NULL && sc_hash(hit->raw, hit->raw_len) != r->raw_hash) {
+            hit->raw = NULL;    /* the png is still good */
+            hit->raw_len = 0;
+        }
+        if (ret) {              /* only the LRU clock changes */
+            r->used = sc_now();
+            sc_pwrite(c->idx_fd, &r->used, sizeof(r->used),
+                      SC_HEAD_SIZE + i * sizeof(struct sc_rec) + offsetof(struct sc_rec, used));
+        }
+    }
+    if (ret) {
+        c->hits++;
+    } else {
+        c->misses++;
+    }
+    sc_unlock(c);
+    return ret;
+}
+
+/**
+ * @brief add a blob to the end of the pack
+ * @return its offset; (U64)-1 on failure
+ */
+static U64 sc_append(struct strip_cache *c, const U8 *buf, U64 len)
+{
+    U64 off = c->pack_len;
+
+    if (sc_pwrite(c->pack_fd, buf, len, off) != 0) {
+        perror("pack");
+        return (U64)-1;
+    }
+    c->pack_len += len;
+    return off;
+}
+
+/**
+ * @brief store strip seq of the image at url. A png already in the pack,
+ *        under any key, is not stored again, nor are scanlines already
+ *        stored with it.
+ * @param const U8 *raw its inflated scanlines; NULL to store the png alone
+ * @return 0 on success; -1 otherwise
+ */
+int sc_put(struct strip_cache *c, const char *url, int seq,
+           const U8 *png, U64 png_len, const U8 *raw, U64 raw_len)
+{
+    struct sc_rec r = { 0 };
+    int ret = 0;
+
+    if (c == NULL || png_len > UINT32_MAX) {
+        return -1;
+    }
+    r.key = sc_key(url, seq);
+    r.seq = seq;
+    r.png_len = png_len;
+    r.hash = sc_hash(png, png_len);
+    r.raw_len = raw ? raw_len : 0;
+    r.raw_hash = raw ? sc_hash(raw, raw_len) : 0;
+    r.png_off = r.raw_off = (U64)-1;
+    r.used = sc_now();
+
+    if (sc_lock(c) != 0) {
+        return -1;
+    }
+    if (sc_load(c) != 0) {
+        sc_unlock(c);
+        return -1;
+    }
+    for (U64 i = c->n_rec; i-- > 0; ) {
+        const struct sc_rec *o = c->rec + i;
+
+        if (o->hash == r.hash && o->png_len == r.png_len) {
+            if (o->key == r.key && (o->raw_len > 0 || raw == NULL) &&
+                sc_find(c, r.key) == (long)i) {
+                sc_unlock(c);   /* nothing new */
+                return 0;
+            }
+            r.png_off = o->png_off;
+            if (raw != NULL && o->raw_len == r.raw_len && o->raw_hash == r.raw_hash) {
+                r.raw_off = o->raw_off;
+            } else if (raw == NULL && o->raw_len > 0) {
+                r.raw_off = o->raw_off;
+                r.raw_len = o->raw_len;
+                r.raw_hash = o->raw_hash;
+            }
+            c->dedups++;
+            break;
+        }
+    }
+    if (r.png_off == (U64)-1) {
+        r.png_off = sc_append(c, png, png_len);
+    }
+    if (r.raw_len > 0 && r.raw_off == (U64)-1) {
+        r.raw_off = sc_append(c, raw, raw_len);
+    }
+    if (r.png_off == (U64)-1 || (r.raw_len > 0 && r.raw_off == (U64)-1) ||
+        sc_pwrite(c->idx_fd, &r, sizeof(r),
+                  SC_HEAD_SIZE + c->n_rec * sizeof(struct sc_rec)) != 0) {
+        ret = -1;
+    } else {
+        ret = sc_load(c);   /* picks up the record just written */
+        c->stores++;
+    }
+    sc_unlock(c);
+    return ret;
+}
+
+static int sc_by_use(const void *a, const void *b)
+{
+    const struct sc_rec *p = a;
+    const struct sc_rec *q = b;
+
+    return p->used > q->used ? -1 : p->used < q->used;
+}
+
+/**
+ * @brief copy a blob into the new pack unless an earlier record already did
+ * @param U64 (*moved)[2] old and new offsets of the blobs copied so far
+ * @return its offset in the new pack; (U64)-1 on failure
+ */
+static U64 sc_move(struct strip_cache *c, int fd, U64 *len, U64 (*moved)[2], U64 *n_moved,
+                   U64 off, U64 blob_len)
+{
+    const U8 *p;
+    U64 at = *len;
+
+    for (U64 i = 0; i < *n_moved; i++) {
+        if (moved[i][0] == off) {
+            return moved[i][1];
+        }
+    }
+    p = sc_view(c, off, blob_len);
+    if (p == NULL || sc_pwrite(fd, p, blob_len, at) != 0) {
+        return (U64)-1;
+    }
+    moved[*n_moved][0] = off;
+    moved[(*n_moved)++][1] = at;
+    *len += blob_len;
+    return at;
+}
+
+/**
+ * @brief if the pack is over its cap, rewrite it and the index with only
+ *        the most recently used strips that fit in three quarters of it;
+ *        call with the lock held
+ * @return 0 on success; -1 otherwise, the old files are then left alone
+ */
+static int sc_evict(struct strip_cache *c)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct sc_rec *keep;
+    U64 (*moved)[2];
+    U64 n_keep = 0, n_moved = 0, new_len = 0, budget = c->cap / 4 * 3;
+    U8 head[SC_HEAD_SIZE] = { 0 };
+    int pack_fd = -1, idx_fd = -1;
+    int ret = -1;
+
+    if (c->pack_len <= c->cap) {
+        return 0;
+    }
+    keep = malloc((c->n_rec + 1) * sizeof(struct sc_rec));
+    moved = malloc((2 * c->n_rec + 1) * sizeof(*moved));
+    if (keep == NULL || moved == NULL) {
+        free(keep);
+        free(moved);
+        return -1;
+    }
+    /* the newest record of every key, most recently used first */
+    for (U64 i = 0; i < c->n_rec; i++) {
+        if (sc_find(c, c->rec[i].key) == (long)i) {
+            keep[n_keep++] = c->rec[i];
+        }
+    }
+    qsort(keep, n_keep, sizeof(struct sc_rec), sc_by_use);
+
+    if (sc_path(tmp, c, "pack.tmp") != 0 ||
+        (pack_fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        goto out;
+    }
+    for (U64 i = 0; i < n_keep; i++) {
+        struct sc_rec *r = keep + i;
+        U64 before = new_len;
+
+        r->png_off = sc_move(c, pack_fd, &new_len, moved, &n_moved, r->png_off, r->png_len);
+        if (r->raw_len > 0) {
+            r->raw_off = sc_move(c, pack_fd, &new_len, moved, &n_moved, r->raw_off, r->raw_len);
+        }
+        if (r->png_off == (U64)-1 || (r->raw_len > 0 && r->raw_off == (U64)-1)) {
+            goto out;
+        }
+        if (new_len > budget && before > 0) {   /* it does not fit, nor do older ones */
+            c->evictions += n_keep - i;
+            n_keep = i;
+            new_len = before;
+            break;
+        }
+    }
+    if (ftruncate(pack_fd, new_len) != 0) {
+        goto out;
+    }
+
+    memcpy(head, SC_MAGIC, 8);
+    if (sc_path(path, c, "index.tmp") != 0 ||
+        (idx_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        sc_pwrite(idx_fd, head, SC_HEAD_SIZE, 0) != 0 ||
+        sc_pwrite(idx_fd, keep, n_keep * sizeof(struct sc_rec), SC_HEAD_SIZE) != 0) {
+        goto out;
+    }
+    /* readers reload under the lock, so the pair changes at once for them */
+    if (sc_path(path, c, "pack") != 0 || rename(tmp, path) != 0 ||
+        sc_path(tmp, c, "index.tmp") != 0 || sc_path(path, c, "index") != 0 ||
+        rename(tmp, path) != 0) {
+        goto out;
+    }
+    ret = sc_load(c);
+
+out:
+    if (ret != 0) {
+        perror("strip cache eviction");
+    }
+    if (pack_fd >= 0) {
+        close(pack_fd);
+    }
+    if (idx_fd >= 0) {
+        close(idx_fd);
+    }
+    free(keep);
+    free(moved);
+    return ret;
+}
+
+/**
+ * @brief print the counters, one line
+ */
+void sc_stats(struct strip_cache *c, FILE *fp)
+{
+    if (c == NULL) {
+        return;
+    }
+    fprintf(fp, "strip cache %s: %lu hits, %lu misses, %lu stored, %lu deduplicated, "
+            "%lu evicted, %lu of %lu MB\n", c->dir, c->hits, c->misses, c->stores,
+            c->dedups, c->evictions, c->pack_len >> 20, c->cap >> 20);
+}
+
+/**
+ * @brief evict down to the size cap if needed and release the cache; what
+ *        sc_get() handed out is unmapped
+ */
+void sc_close(struct strip_cache *c)
+{
+    if (c == NULL) {
+        return;
+    }
+    if (c->lock_fd >= 0 && c->idx_fd >= 0 && sc_lock(c) == 0) {
+        if (sc_load(c) == 0) {
+            sc_evict(c);
+        }
+        sc_unlock(c);
+    }
+    for (int i = 0; i < c->n_maps; i++) {
+        munmap(c->maps[i], c->map_len[i]);
+    }
+    if (c->idx_fd >= 0) {
+        close(c->idx_fd);
+    }
+    if (c->pack_fd >= 0) {
+        close(c->pack_fd);
+    }
+    if (c->lock_fd >= 0) {
+        close(c->lock_fd);
+    }
+    pthread_mutex_destroy(&c->mutex);
+    free(c->rec);
+    free(c);
+}
@@ -0,0 +1,439 @@
+/**
+ * @brief  one-shot zlib format compression with interchangeable backends
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Every backend compresses or decompresses a whole buffer in one call,
+ * straight into the caller's buffer, with no bounce buffer in between:
+ *  - zlib:        always built; deflate()/inflate() with the whole output
+ *                 buffer as avail_out
+ *  - libdeflate:  built with -DHAVE_LIBDEFLATE and -ldeflate. Whole buffer
+ *                 only, which is all a png strip of known size needs, and
+ *                 2-3x faster than zlib both ways.
+ *  - zlib-ng:     built with -DHAVE_ZLIBNG and -lz-ng, its native zng_ API
+ * The backend in use is zlib unless ZCODEC_DEFAULT names another at build
+ * time, or the ZCODEC environment variable names one at run time, e.g.
+ * ZCODEC=libdeflate ./paster. The output is a zlib stream whichever backend
+ * wrote it.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include <limits.h>
+#include "lab_png.h"
+
+#ifdef HAVE_LIBDEFLATE
+#  include <libdeflate.h>
+#endif
+#ifdef HAVE_ZLIBNG
+#  include <zlib-ng.h>
+#endif
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#ifndef ZCODEC_DEFAULT
+#  define ZCODEC_DEFAULT "zlib"
+#endif
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+/* All return Z_OK, Z_BUF_ERROR when dest is too small, Z_DATA_ERROR on a
+   corrupt stream or Z_MEM_ERROR, whatever the backend. */
+typedef struct zcodec {
+    const char *name;
+    int (*def)(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len, int level);
+    int (*inf)(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len);
+    U64 (*bound)(U64 src_len);
+} *zcodec_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+const struct zcodec *zc_find(const char *name);
+int zc_def(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len, int level);
+int zc_inf(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len);
+U64 zc_bound(U64 src_len);
+int zc_inf_idat(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *buf, U64 len);
+int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level);
+int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len);
+
+/******************************************************************************
+ * zlib
+ *****************************************************************************/
+static int zlib_def(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len, int level)
+{
+    z_stream strm;
+    int ret;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree  = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit(&strm, level);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm.next_in = (U8 *)src;
+    strm.next_out = dest;
+    strm.avail_in = 0;
+    strm.avail_out = 0;
+
+    /* avail_in and avail_out are only 32 bits wide */
+    do {
+        if (strm.avail_in == 0) {
+            U64 left = src_len - (strm.next_in - src);
+            strm.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        }
+        if (strm.avail_out == 0) {
+            U64 left = dest_cap - (strm.next_out - dest);
+            if (left == 0) {
+                break;
+            }
+            strm.avail_out = left > UINT_MAX ? UINT_MAX : left;
+        }
+        ret = deflate(&strm, (U64)(strm.next_in - src) + strm.avail_in == src_len ?
+                      Z_FINISH : Z_NO_FLUSH);
+    } while (ret == Z_OK || ret == Z_BUF_ERROR);
+
+    *dest_len = strm.next_out - dest;
+    (void) deflateEnd(&strm);
+    return ret == Z_STREAM_END ? Z_OK : ret == Z_STREAM_ERROR ? ret : Z_BUF_ERROR;
+}
+
+static int zlib_inf(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len)
+{
+    z_stream strm;
+    int ret;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree  = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit(&strm);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm.next_in = (U8 *)src;
+    strm.next_out = dest;
+    strm.avail_out = 0;
+
+    do {
+        if (strm.avail_in == 0) {
+            U64 left = src_len - (strm.next_in - src);
+            if (left == 0) {
+                ret = Z_DATA_ERROR;  /* the stream is cut short */
+                break;
+            }
+            strm.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        }
+        if (strm.avail_out == 0) {
+            U64 left = dest_cap - (strm.next_out - dest);
+            if (left == 0) {
+                ret = Z_BUF_ERROR;
+                break;
+            }
+            strm.avail_out = left > UINT_MAX ? UINT_MAX : left;
+        }
+        ret = inflate(&strm, Z_NO_FLUSH);
+    } while (ret == Z_OK);
+
+    *dest_len = strm.next_out - dest;
+    (void) inflateEnd(&strm);
+    if (ret == Z_NEED_DICT) {
+        ret = Z_DATA_ERROR;
+    }
+    return ret == Z_STREAM_END ? Z_OK : ret;
+}
+
+static U64 zlib_bound(U64 src_len)
+{
+    /* compressBound() takes a uLong, which is 64 bits here */
+    return compressBound(src_len);
+}
+
+/******************************************************************************
+ * libdeflate
+ *****************************************************************************/
+#ifdef HAVE_LIBDEFLATE
+/* compressors are costly to set up and not safe to share, so every thread
+   keeps one per level */
+static __thread struct libdeflate_compressor *ld_comp[13];
+static __thread struct libdeflate_decompressor *ld_decomp;
+
+static int libdeflate_def(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len, int level)
+{
+    size_t n;
+
+    if (level == Z_DEFAULT_COMPRESSION) {
+        level = 6;
+    }
+    if (level < 0 || level > 12) {
+        return Z_STREAM_ERROR;
+    }
+    if (ld_comp[level] == NULL) {
+        ld_comp[level] = libdeflate_alloc_compressor(level);
+        if (ld_comp[level] == NULL) {
+            return Z_MEM_ERROR;
+        }
+    }
+    n = libdeflate_zlib_compress(ld_comp[level], src, src_len, dest, dest_cap);
+    *dest_len = n;
+    return n == 0 ? Z_BUF_ERROR : Z_OK;
+}
+
+static int libdeflate_inf(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len)
+{
+    size_t n = 0;
+    enum libdeflate_result r;
+
+    if (ld_decomp == NULL) {
+        ld_decomp = libdeflate_alloc_decompressor();
+        if (ld_decomp == NULL) {
+            return Z_MEM_ERROR;
+        }
+    }
+    r = libdeflate_zlib_decompress(ld_decomp, src, src_len, dest, dest_cap, &n);
+    *dest_len = n;
+    switch (r) {
+    case LIBDEFLATE_SUCCESS:
+        return Z_OK;
+    case LIBDEFLATE_INSUFFICIENT_SPACE:
+        return Z_BUF_ERROR;
+    default:
+        return Z_DATA_ERROR;
+    }
+}
+
+static U64 libdeflate_bound(U64 src_len)
+{
+    return libdeflate_zlib_compress_bound(NULL, src_len);
+}
+#endif /* HAVE_LIBDEFLATE */
+
+/******************************************************************************
+ * zlib-ng, native API; its avail_in and avail_out are 32 bits wide as well
+ *****************************************************************************/
+#ifdef HAVE_ZLIBNG
+static int zlibng_def(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len, int level)
+{
+    zng_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    ret = zng_deflateInit(&strm, level);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm.next_in = src;
+    strm.next_out = dest;
+
+    do {
+        if (strm.avail_in == 0) {
+            U64 left = src_len - (strm.next_in - src);
+            strm.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        }
+        if (strm.avail_out == 0) {
+            U64 left = dest_cap - (strm.next_out - dest);
+            if (left == 0) {
+                break;
+            }
+            strm.avail_out = left > UINT_MAX ? UINT_MAX : left;
+        }
+        ret = zng_deflate(&strm, (U64)(strm.next_in - src) + strm.avail_in == src_len ?
+                          Z_FINISH : Z_NO_FLUSH);
+    } while (ret == Z_OK || ret == Z_BUF_ERROR);
+
+    *dest_len = strm.next_out - dest;
+    (void) zng_deflateEnd(&strm);
+    return ret == Z_STREAM_END ? Z_OK : ret == Z_STREAM_ERROR ? ret : Z_BUF_ERROR;
+}
+
+static int zlibng_inf(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len)
+{
+    zng_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    ret = zng_inflateInit(&strm);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    strm.next_in = src;
+    strm.next_out = dest;
+
+    do {
+        if (strm.avail_in == 0) {
+            U64 left = src_len - (strm.next_in - src);
+            if (left == 0) {
+                ret = Z_DATA_ERROR;
+                break;
+            }
+            strm.avail_in = left > UINT_MAX ? UINT_MAX : left;
+        }
+        if (strm.avail_out == 0) {
+            U64 left = dest_cap - (strm.next_out - dest);
+            if (left == 0) {
+                ret = Z_BUF_ERROR;
+                break;
+            }
+            strm.avail_out = left > UINT_MAX ? UINT_MAX : left;
+        }
+        ret = zng_inflate(&strm, Z_NO_FLUSH);
+    } while (ret == Z_OK);
+
+    *dest_len = strm.next_out - dest;
+    (void) zng_inflateEnd(&strm);
+    if (ret == Z_NEED_DICT) {
+        ret = Z_DATA_ERROR;
+    }
+    return ret == Z_STREAM_END ? Z_OK : ret;
+}
+
+static U64 zlibng_bound(U64 src_len)
+{
+    return zng_compressBound(src_len);
+}
+#endif /* HAVE_ZLIBNG */
+
+/******************************************************************************
+ * backend table and selection
+ *****************************************************************************/
+const struct zcodec zcodecs[] = {
+    { "zlib",       zlib_def,       zlib_inf,       zlib_bound       },
+#ifdef HAVE_LIBDEFLATE
+    { "libdeflate", libdeflate_def, libdeflate_inf, libdeflate_bound },
+#endif
+#ifdef HAVE_ZLIBNG
+    { "zlib-ng",    zlibng_def,     zlibng_inf,     zlibng_bound     },
+#endif
+};
+const int n_zcodecs = sizeof(zcodecs) / sizeof(zcodecs[0]);
+
+/* the backend zc_def() and friends use */
+const struct zcodec *zcodec = &zcodecs[0];
+
+/**
+ * @brief look a backend up by name
+ * @return the backend; NULL if it is unknown or was not built in
+ */
+const struct zcodec *zc_find(const char *name)
+{
+    for (int i = 0; name != NULL && i < n_zcodecs; i++) {
+        if (strcmp(zcodecs[i].name, name) == 0) {
+            return &zcodecs[i];
+        }
+    }
+    return NULL;
+}
+
+__attribute__((constructor)) void zc_init(void)
+{
+    const char *name = getenv("ZCODEC");
+    const struct zcodec *z = zc_find(name ? name : ZCODEC_DEFAULT);
+
+    if (z == NULL) {
+        fprintf(stderr, "zcodec: %s is not built in, using zlib\n", name ? name : ZCODEC_DEFAULT);
+        z = &zcodecs[0];
+    }
+    zcodec = z;
+}
+
+/**
+ * @brief compress src into one zlib stream in dest
+ * @param U8 *dest output buffer
+ * @param U64 dest_cap capacity of dest, zc_bound(src_len) is always enough
+ * @param U64 *dest_len output parameter, length of the stream
+ * @param const U8 *src input
+ * @param U64 src_len length of src
+ * @param int level compression level, as for deflateInit()
+ * @return Z_OK on success; otherwise a zlib error code
+ */
+int zc_def(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len, int level)
+{
+    return zcodec->def(dest, dest_cap, dest_len, src, src_len, level);
+}
+
+/**
+ * @brief decompress the zlib stream src into dest
+ * @param U8 *dest output buffer
+ * @param U64 dest_cap capacity of dest
+ * @param U64 *dest_len output parameter, number of bytes inflated
+ * @param const U8 *src the whole zlib stream
+ * @param U64 src_len length of src
+ * @return Z_OK on success; Z_BUF_ERROR if dest is too small; otherwise a
+ *         zlib error code
+ */
+int zc_inf(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *src, U64 src_len)
+{
+    return zcodec->inf(dest, dest_cap, dest_len, src, src_len);
+}
+
+/**
+ * @brief upper bound of the zc_def() output for src_len input bytes
+ */
+U64 zc_bound(U64 src_len)
+{
+    return zcodec->bound(src_len);
+}
+
+/**
+ * @brief png_inf_idat() through the selected backend. A file with a single
+ *        IDAT, as every strip we paste has, is inflated in one zc_inf()
+ *        call; one split over several IDATs goes through png_inf_idat().
+ */
+int zc_inf_idat(U8 *dest, U64 dest_cap, U64 *dest_len, const U8 *buf, U64 len)
+{
+    struct png_iter it;
+    struct chunk c;
+    struct chunk idat = { 0 };
+    int n_idat = 0;
+    int ret;
+
+    if (png_iter_init(&it, buf, len) != 0) {
+        return Z_DATA_ERROR;
+    }
+    while ((ret = png_iter_next(&it, &c)) == 1) {
+        if (memcmp(c.type, "IDAT", CHUNK_TYPE_SIZE) == 0) {
+            idat = c;
+            if (++n_idat > 1) {
+                break;
+            }
+        }
+    }
+    if (ret < 0 || n_idat == 0) {
+        return Z_DATA_ERROR;
+    }
+    if (n_idat > 1) {
+        return png_inf_idat(dest, dest_cap, dest_len, buf, len);
+    }
+    return zc_inf(dest, dest_cap, dest_len, idat.p_data, idat.length);
+}
+
+/**
+ * @brief deflate source_len bytes at source into dest with zc_def()
+ * @param U8 *dest output buffer
+ * @param U64 *dest_len in: capacity of dest, zc_bound(source_len) is always
+ *        enough; out: length of the zlib stream
+ * @return Z_OK on success; otherwise a zlib error code
+ */
+int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level)
+{
+    return zc_def(dest, *dest_len, dest_len, source, source_len, level);
+}
+
+/**
+ * @brief inflate the zlib stream at source into dest with zc_inf()
+ * @param U8 *dest output buffer
+ * @param U64 *dest_len in: capacity of dest; out: number of bytes inflated
+ * @return Z_OK on success; otherwise a zlib error code
+ */
+int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
+{
+    return zc_inf(dest, *dest_len, dest_len, source, source_len);
+}
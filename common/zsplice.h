@@ -0,0 +1,293 @@
+/**
+ * @brief  join the zlib streams of several pngs into one without
+ *         recompressing them
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * Each strip's IDAT stream is copied as is, minus its 2 byte zlib header
+ * and 4 byte adler32 trailer. The last-block bit of its final deflate block
+ * is cleared and the block is padded out to a byte boundary with empty
+ * blocks, the way zlib's examples/gzjoin.c joins gzip members. The next
+ * strip's deflate data then simply carries on from there. Finding the final
+ * block needs a pass of inflate() with Z_BLOCK, but nothing is deflated
+ * again; the adler32 of the result comes from the strips' own trailers via
+ * adler32_combine().
+ *
+ * The scanlines are not touched either, so a strip whose first row is
+ * filtered with Up, Average or Paeth cannot follow another one: that row was
+ * filtered against zeros, and would be decoded against the last row of the
+ * strip above. The same inflate pass reads its filter type, and such a
+ * strip is refused with ZSPLICE_ROW_ABOVE.
+ */
+#pragma once
+
+/******************************************************************************
+ * INCLUDE HEADER FILES
+ *****************************************************************************/
+#include "lab_png.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define ZSPLICE_ROW_ABOVE 3 /* not a zlib code: first row needs the zero row */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+/* A zlib stream being put together out of the IDAT streams of strips */
+typedef struct zsplice {
+    U8 *buf;      /* the joined zlib stream */
+    U64 len;      /* bytes used in buf */
+    U64 cap;      /* capacity of buf */
+    U32 adler;    /* adler32 of everything joined so far */
+    int n;        /* number of strips joined so far */
+    int done;     /* set once the last strip is in and the trailer written */
+} *zsplice_p;
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int zsplice_init(struct zsplice *z, U64 cap);
+int zsplice_png(struct zsplice *z, const U8 *png, U64 png_len, U64 raw_len, int last);
+void zsplice_cleanup(struct zsplice *z);
+
+/**
+ * @brief get an empty joined stream ready
+ * @param struct zsplice *z the stream
+ * @param U64 cap capacity to allocate; 6 plus the total length of the png
+ *        files to be joined is always enough
+ * @return 0 on success; non-zero otherwise
+ */
+int zsplice_init(struct zsplice *z, U64 cap)
+{
+    memset(z, 0, sizeof(*z));
+    z->buf = malloc(cap);
+    if (z->buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    z->cap = cap;
+    z->len = 2;   /* room for the zlib header, taken from the first strip */
+    z->adler = 1L;
+    return 0;
+}
+
+/**
+ * @brief release the joined stream
+ */
+void zsplice_cleanup(struct zsplice *z)
+{
+    free(z->buf);
+    z->buf = NULL;
+}
+
+/**
+ * @brief find the end of the deflate data at raw and, unless it is the last
+ *        strip, clear its last-block bit and pad it to a byte boundary
+ * @param U8 *raw deflate data, modified in place
+ * @param U64 raw_len length of raw; at least 5 spare bytes must follow it
+ * @param int last non-zero to leave the final block marked as final
+ * @param U64 *out_len output parameter, length of the (padded) deflate data
+ * @param U64 *inf_len output parameter, number of bytes it inflates to
+ * @param U32 *adler output parameter, adler32 of the inflated bytes
+ * @param int *first output parameter, the first inflated byte, i.e. the
+ *        filter type of the first row; -1 if it inflates to nothing
+ * @return Z_OK on success; otherwise a zlib error code
+ */
+static int zsplice_scan(U8 *raw, U64 raw_len, int last, U64 *out_len,
+                        U64 *inf_len, U32 *adler, int *first)
+{
+    U8 junk[32768];   /* inflated bytes are only counted and checksummed */
+    z_stream strm;
+    int is_last = raw[0] & 1;
+    int pos;
+    int ret;
+    U8 *end;
+    U8 tail;
+
+    strm.zalloc = Z_NULL;
+    strm.zfree  = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    ret = inflateInit2(&strm, -MAX_WBITS);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    if (is_last && !last) {
+        raw[0] &= ~1;
+    }
+    strm.next_in = raw;
+    strm.avail_in = raw_len;
+    *inf_len = 0;
+    *adler = adler32(0L, Z_NULL, 0);
+    *first = -1;
+
+    for (;;) {
+        strm.avail_out = sizeof(junk);
+        strm.next_out = junk;
+        ret = inflate(&strm, Z_BLOCK); /* returns at every block boundary */
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            (void) inflateEnd(&strm);
+            return ret == Z_NEED_DICT ? Z_DATA_ERROR : ret;
+        }
+        if (*inf_len == 0 && strm.avail_out < sizeof(junk)) {
+            *first = junk[0];
+        }
+        *inf_len += sizeof(junk) - strm.avail_out;
+        *adler = adler32(*adler, junk, sizeof(junk) - strm.avail_out);
+
+        if (strm.data_type & 128) {  /* just past the end of a block */
+            if (is_last) {
+                break;
+            }
+            /* the next block's last-block bit is its first bit */
+            pos = strm.data_type & 7;  /* unused bits in the last byte taken */
+            if (pos != 0) {
+                is_last = strm.next_in[-1] & (0x100 >> pos);
+                if (is_last && !last) {
+                    strm.next_in[-1] &= ~(0x100 >> pos);
+                }
+            } else if (strm.avail_in == 0) {
+                (void) inflateEnd(&strm);
+                return Z_DATA_ERROR;  /* stream ends without a final block */
+            } else {
+                is_last = strm.next_in[0] & 1;
+                if (is_last && !last) {
+                    strm.next_in[0] &= ~1;
+                }
+            }
+        } else if (ret == Z_STREAM_END || (ret == Z_BUF_ERROR && strm.avail_in == 0)) {
+            (void) inflateEnd(&strm);
+            return Z_DATA_ERROR;      /* truncated, or lost track of the blocks */
+        }
+    }
+
+    pos = strm.data_type & 7;
+    end = strm.next_in;               /* one past the final byte used */
+    (void) inflateEnd(&strm);
+
+    if (pos == 0 || last) {           /* byte aligned or last strip: as is */
+        *out_len = end - raw;
+        return Z_OK;
+    }
+
+    /* pad the final byte out with empty blocks, see zlib's gzjoin.c */
+    tail = end[-1] & ((0x100 >> pos) - 1); /* clear the unused bits */
+    end--;
+    if (pos & 1) {       /* odd: one empty stored block */
+        *end++ = tail;
+        if (pos == 1) {
+            *end++ = 0;  /* two more bits of the block header */
+        }
+        memcpy(end, "\0\0\xff\xff", 4);
+        end += 4;
+    } else {             /* even: 1, 2 or 3 empty fixed blocks */
+        switch (pos) {
+        case 6:
+            *end++ = tail | 8;
+            tail = 0;
+            /* fall through */
+        case 4:
+            *end++ = tail | 0x20;
+            tail = 0;
+            /* fall through */
+        case 2:
+            *end++ = tail | 0x80;
+            *end++ = 0;
+        }
+    }
+    *out_len = end - raw;
+    return Z_OK;
+}
+
+/**
+ * @brief append the IDAT stream of one png to the joined stream
+ * @param struct zsplice *z the joined stream
+ * @param const U8 *png the whole png file in memory, it is not modified
+ * @param U64 png_len length of png in bytes
+ * @param U64 raw_len number of bytes the strip must inflate to, i.e.
+ *        png_raw_size() of its IHDR
+ * @param int last non-zero for the last strip; the adler32 trailer is
+ *        written after it
+ * @return Z_OK on success; ZSPLICE_ROW_ABOVE if it is not the first
+ *         strip and its first row is filtered against the row above;
+ *         otherwise a zlib error code. On anything but Z_OK z is left
+ *         unusable and the strips should be recompressed instead
+ */
+int zsplice_png(struct zsplice *z, const U8 *png, U64 png_len, U64 raw_len, int last)
+{
+    struct png_iter it;
+    struct chunk c;
+    U64 start = z->len;
+    U64 stream_len;
+    U64 out_len, inf_len;
+    U32 adler, trailer;
+    int first;
+    int ret;
+
+    if (z->done || png_iter_init(&it, png, png_len) != 0) {
+        return Z_DATA_ERROR;
+    }
+
+    /* gather the IDAT payloads, they are usually a single chunk */
+    while ((ret = png_iter_next(&it, &c)) == 1) {
+        if (memcmp(c.type, "IDAT", CHUNK_TYPE_SIZE) != 0) {
+            continue;
+        }
+        if (z->len + c.length > z->cap) {
+            return Z_BUF_ERROR;
+        }
+        memcpy(z->buf + z->len, c.p_data, c.length);
+        z->len += c.length;
+    }
+    stream_len = z->len - start;
+    z->len = start;
+    if (ret < 0 || stream_len < 2 + 1 + 4) {
+        return Z_DATA_ERROR;
+    }
+
+    /* zlib header: deflate, window no bigger than 32K, no preset dictionary */
+    if ((z->buf[start] & 0x0f) != Z_DEFLATED || (z->buf[start] >> 4) > 7 ||
+        (z->buf[start + 1] & 0x20) || ((z->buf[start] << 8) | z->buf[start + 1]) % 31) {
+        return Z_DATA_ERROR;
+    }
+    if (z->n == 0) {
+        z->buf[0] = z->buf[start];
+        z->buf[1] = z->buf[start + 1];
+    }
+    memcpy(&trailer, z->buf + start + stream_len - 4, 4);
+    trailer = ntohl(trailer);
+
+    /* drop the header; the header and trailer leave 6 spare bytes behind
+       the deflate data for the padding zsplice_scan() may add */
+    memmove(z->buf + start, z->buf + start + 2, stream_len - 6);
+    ret = zsplice_scan(z->buf + start, stream_len - 6, last, &out_len, &inf_len, &adler,
+                       &first);
+    if (ret != Z_OK) {
+        return ret;
+    }
+    if (adler != trailer || inf_len != raw_len) {
+        return Z_DATA_ERROR;
+    }
+    if (z->n > 0 && (first == 2 || first == 3 || first == 4)) { /* Up, Average, Paeth */
+        return ZSPLICE_ROW_ABOVE;
+    }
+
+    z->len = start + out_len;
+    z->adler = (z->n == 0) ? adler : adler32_combine(z->adler, adler, inf_len);
+    z->n++;
+
+    if (last) { /* adler32 trailer, big endian */
+        if (z->len + 4 > z->cap) {
+            return Z_BUF_ERROR;
+        }
+        trailer = htonl(z->adler);
+        memcpy(z->buf + z->len, &trailer, 4);
+        z->len += 4;
+        z->done = 1;
+    }
+    return Z_OK;
+}
@@ -0,0 +1,89 @@
+/**
+ * @brief microbenchmark of the crc.h kernels against zlib's crc32()
+ * To execute: ./bench_crc.o [size in MB] [repetitions]
+ */
+
+#include <time.h>
+#include "helper.h"
+
+/**
+ * @brief seconds since an arbitrary point, for timing
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static U32 zlib_kernel(U32 c, const U8 *buf, U64 len)
+{
+    /* zlib takes and returns the finished crc, not the running one */
+    return ~(U32)crc32(~c & 0xffffffffUL, buf, len);
+}
+
+int main(int argc, char **argv)
+{
+    U64 size = (argc > 1 ? atol(argv[1]) : 64) << 20;
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    struct {
+        const char *name;
+        crc_kernel_t fn;
+    } kernels[] = {
+        { "bytewise", crc32_bytewise },
+        { "slice8",   crc32_slice8   },
+        { "pclmul",   crc32_pclmul   },
+        { "zlib",     zlib_kernel    },
+    };
+    int n_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    U8 *buf = malloc(size);
+    U32 expect;
+
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    srand(252);
+    for (U64 i = 0; i < size; i++) {
+        buf[i] = rand();
+    }
+    expect = crc32(0, buf, size);
+
+    printf("%lu MB, %d reps, update_crc uses %s\n", size >> 20, reps,
+           crc_kernel == crc32_pclmul ? "pclmul" : "slice8");
+    for (int k = 0; k < n_kernels; k++) {
+        double best = 1e9;
+        U32 got = 0;
+
+        if (kernels[k].fn == crc32_pclmul && crc_kernel != crc32_pclmul) {
+            printf("%-10s not supported by this CPU\n", kernels[k].name);
+            continue;
+        }
+        for (int r = 0; r < reps; r++) {
+            double t = now();
+            got = kernels[k].fn(0xffffffffL, buf, size) ^ 0xffffffffL;
+            t = now() - t;
+            best = t < best ? t : best;
+        }
+        printf("%-10s %8.2f GB/s %s\n", kernels[k].name, size / best / 1e9,
+               got == expect ? "" : "MISMATCH");
+    }
+
+    /* odd lengths and offsets, and crc_combine() of the two halves */
+    for (U64 len = 0; len < 300; len++) {
+        U64 cut = len / 3;
+        U32 a = crc(buf + 1 + cut, len - cut);
+        U32 whole = crc(buf + 1, len);
+
+        if (whole != crc32(0, buf + 1, len) ||
+            crc_combine(crc(buf + 1, cut), a, len - cut) != whole) {
+            printf("crc mismatch at len %lu\n", len);
+            return 1;
+        }
+    }
+    printf("crc_combine    ok\n");
+
+    free(buf);
+    return 0;
+}
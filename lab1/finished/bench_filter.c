@@ -0,0 +1,124 @@
+/**
+ * @brief benchmark of the png_filter.h kernels: rows/sec of unfiltering and
+ *        refiltering at each SIMD level, and the deflated size of the
+ *        adaptive refilter against passing the filtered bytes through
+ * To execute: ./bench_filter.o [png file] [repetitions]
+ */
+
+#include <time.h>
+#include "helper.h"
+#include "png_filter.h"
+
+/**
+ * @brief seconds since an arbitrary point, for timing
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static U64 def_size(U8 *src, U64 len)
+{
+    U64 got = zc_bound(len);
+    U8 *buf = malloc(got);
+
+    if (buf == NULL || mem_def(buf, &got, src, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        got = 0;
+    }
+    free(buf);
+    return got;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "images/uweng.png";
+    int reps = argc > 2 ? atoi(argv[2]) : 20;
+    static const char *level_name[] = { "scalar", "sse2", "avx2" };
+    static const char *type_name[] = { "none", "sub", "up", "avg", "paeth" };
+    int top = png_filter_simd;
+    struct span png;
+    struct data_IHDR ihdr;
+    U64 raw_len, got = 0, row_bytes;
+    U8 *raw, *pixels, *work, *ref = NULL;
+    int bpp;
+
+    if (span_open(&png, path) != 0 || span_IHDR(&png, &ihdr) != 0) {
+        fprintf(stderr, "%s: not a png\n", path);
+        return 1;
+    }
+    raw_len = png_raw_size(&ihdr);
+    row_bytes = png_row_bytes(&ihdr);
+    bpp = png_bpp(&ihdr);
+    raw = malloc(raw_len);
+    pixels = malloc(raw_len);
+    work = malloc(raw_len);
+    if (raw == NULL || pixels == NULL || work == NULL || ihdr.interlace != 0 ||
+        png_inf_idat(raw, raw_len, &got, png.buf, png.len) != Z_OK || got != raw_len) {
+        fprintf(stderr, "%s: cannot inflate, or interlaced\n", path);
+        return 1;
+    }
+    memcpy(pixels, raw, raw_len);
+    if (png_unfilter_rows(pixels, ihdr.height, row_bytes, bpp, NULL) != 0) {
+        fprintf(stderr, "%s: bad filter type\n", path);
+        return 1;
+    }
+
+    printf("%s: %u x %u, %d bytes per pixel, %d reps, best SIMD level %s\n",
+           path, ihdr.width, ihdr.height, bpp, reps, level_name[top]);
+
+    for (int level = FILTER_SCALAR; level <= top; level++) {
+        double t_unf = 1e9, t_ref = 1e9;
+
+        png_filter_simd = level;
+        for (int r = 0; r < reps; r++) {
+            double t;
+
+            memcpy(work, raw, raw_len);
+            t = now();
+            png_unfilter_rows(work, ihdr.height, row_bytes, bpp, NULL);
+            t = now() - t;
+            t_unf = t < t_unf ? t : t_unf;
+
+            memcpy(work, pixels, raw_len);
+            t = now();
+            png_refilter_rows(work, ihdr.height, row_bytes, bpp, NULL, PNG_FILTER_ADAPTIVE);
+            t = now() - t;
+            t_ref = t < t_ref ? t : t_ref;
+        }
+
+        /* every level must produce the same bytes, and round trip */
+        if (ref == NULL) {
+            ref = malloc(raw_len);
+            memcpy(ref, work, raw_len);
+        }
+        if (memcmp(ref, work, raw_len) != 0) {
+            printf("%-7s refilter MISMATCH against scalar\n", level_name[level]);
+        }
+        png_unfilter_rows(work, ihdr.height, row_bytes, bpp, NULL);
+        if (memcmp(work, pixels, raw_len) != 0) {
+            printf("%-7s round trip MISMATCH\n", level_name[level]);
+        }
+        printf("%-7s unfilter %10.0f rows/s   adaptive refilter %10.0f rows/s\n",
+               level_name[level], ihdr.height / t_unf, ihdr.height / t_ref);
+    }
+    png_filter_simd = top;
+
+    printf("deflated size, level %d:\n", Z_DEFAULT_COMPRESSION);
+    printf("  %-12s %8lu\n", "passthrough", def_size(raw, raw_len));
+    for (int type = PNG_FILTER_NONE; type <= PNG_FILTER_PAETH; type++) {
+        memcpy(work, pixels, raw_len);
+        png_refilter_rows(work, ihdr.height, row_bytes, bpp, NULL, type);
+        printf("  %-12s %8lu\n", type_name[type], def_size(work, raw_len));
+    }
+    printf("  %-12s %8lu\n", "adaptive", def_size(ref, raw_len));
+
+    free(raw);
+    free(pixels);
+    free(work);
+    free(ref);
+    span_close(&png);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/**
+ * @brief benchmark of the zcodec.h backends at every compression level:
+ *        deflate and inflate MB/s and the compression ratio, on the
+ *        filtered scanlines of a png, which is what the pasters compress
+ * To execute: ./bench_zcodec.o [png file] [repetitions]
+ * Build with more backends: make bench ZCODEC=-DHAVE_LIBDEFLATE ZCODEC_LIBS=-ldeflate
+ */
+
+#include <time.h>
+#include "helper.h"
+
+/**
+ * @brief seconds since an arbitrary point, for timing
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "images/uweng.png";
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    struct span png;
+    struct data_IHDR ihdr;
+    U64 raw_len, got = 0;
+    U8 *raw, *def, *back;
+
+    if (span_open(&png, path) != 0 || span_IHDR(&png, &ihdr) != 0) {
+        fprintf(stderr, "%s: not a png\n", path);
+        return 1;
+    }
+    raw_len = png_raw_size(&ihdr);
+    raw = malloc(raw_len);
+    back = malloc(raw_len);
+    def = NULL;
+    if (raw == NULL || back == NULL ||
+        png_inf_idat(raw, raw_len, &got, png.buf, png.len) != Z_OK || got != raw_len) {
+        fprintf(stderr, "%s: cannot inflate\n", path);
+        return 1;
+    }
+
+    printf("%s: %lu bytes of scanlines, %d reps, %d backends, default %s\n",
+           path, raw_len, reps, n_zcodecs, zcodec->name);
+    printf("%-11s %5s %10s %10s %8s\n", "backend", "level", "def MB/s", "inf MB/s", "ratio");
+
+    for (int b = 0; b < n_zcodecs; b++) {
+        const struct zcodec *z = zcodecs + b;
+        U64 cap = z->bound(raw_len);
+
+        free(def);
+        def = malloc(cap);
+        if (def == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        for (int level = 1; level <= 9; level++) {
+            double t_def = 1e9, t_inf = 1e9;
+            U64 def_len = 0;
+            int ret = Z_OK;
+
+            for (int r = 0; r < reps && ret == Z_OK; r++) {
+                double t = now();
+                ret = z->def(def, cap, &def_len, raw, raw_len, level);
+                t = now() - t;
+                t_def = t < t_def ? t : t_def;
+            }
+            for (int r = 0; r < reps && ret == Z_OK; r++) {
+                double t = now();
+                ret = z->inf(back, raw_len, &got, def, def_len);
+                t = now() - t;
+                t_inf = t < t_inf ? t : t_inf;
+            }
+            if (ret != Z_OK || got != raw_len || memcmp(back, raw, raw_len) != 0) {
+                printf("%-11s %5d round trip FAILED, ret = %d\n", z->name, level, ret);
+                continue;
+            }
+            printf("%-11s %5d %10.1f %10.1f %8.3f\n", z->name, level,
+                   raw_len / 1e6 / t_def, raw_len / 1e6 / t_inf, (double)raw_len / def_len);
+        }
+    }
+
+    free(raw);
+    free(def);
+    free(back);
+    span_close(&png);
+    return 0;
+}
@@ -6,8 +6,12 @@
  * This software may be freely redistributed under the terms of MIT License
  */
 
-   /* for errno                   */
-#include "helper.h"   /* for mem_def() and mem_inf() */
+#include <stdint.h> /* for UINT32_MAX              */
+#include "helper.h"   /* for mem_def(), mem_inf() and span_open() */
+#include "par_zlib.h" /* for par_inf_strips() and par_def() */
+#include "zsplice.h"  /* for zsplice_png() */
+#include "png_filter.h" /* for png_refilter_rows() */
+#include "png_convert.h" /* for px_paste_strips() */
 
 
 
@@ -16,12 +20,12 @@
  *****************************************************************************/
 #define BUF_LEN  (256*16)
 #define BUF_LEN2 (256*32*32)
+#define USAGE "Usage: %s [-s | -n | -p [-f] [-j threads] | -g COLSxROWS | -H] <png file> ...\n" \
+              "       %s -m <placement map>\n"
 
 /******************************************************************************
  * GLOBALS 
  *****************************************************************************/
-U8 gp_buf_def[BUF_LEN2]; /* output buffer for mem_def() */
- /* output buffer for mem_inf() */
 
 /******************************************************************************
  * FUNCTION PROTOTYPES 
@@ -31,109 +35,1225 @@ U8 gp_buf_def[BUF_LEN2]; /* output buffer for mem_def() */
 /******************************************************************************
  * FUNCTIONS 
  *****************************************************************************/
-int get_height(FILE* fp);
 int is_png( U8 *buf );
 void resize(U8** buffer, long int *size);
+int concat_buffered(int n, char **paths);
+int concat_stream(int n, char **paths);
+int concat_parallel(int n, char **paths, int n_threads, int refilter);
+int concat_splice(int n, char **paths);
+int concat_tiles(int n, char **paths, int cols, const char *map);
+static int parallel_spans(int n, char **paths, struct span *spans, int n_threads, int refilter);
+
+/**
+ * @brief open every input file as a span, see span_open()
+ * @param int n number of input files
+ * @param char **paths input file paths; at most one of them may be "-"
+ * @return n spans; NULL on failure. Release with close_spans()
+ */
+static struct span *open_spans(int n, char **paths)
+{
+    struct span *spans = calloc(n, sizeof(struct span));
+
+    if (spans == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        if (span_open(spans + i, paths[i]) != 0) {
+            while (i-- > 0) {
+                span_close(spans + i);
+            }
+            free(spans);
+            return NULL;
+        }
+    }
+    return spans;
+}
+
+static void close_spans(struct span *spans, int n)
+{
+    for (int i = 0; i < n; i++) {
+        span_close(spans + i);
+    }
+    free(spans);
+}
+
+/**
+ * @brief whether the scanlines of strip can go out as they are, next to
+ *        those of first: the row format must match, and palette indices
+ *        cannot, the output has no PLTE chunk for them to refer to
+ * @return 1 if so; 0 if the strips must be converted
+ */
+static int rows_pass_through(const struct data_IHDR *strip, const struct data_IHDR *first)
+{
+    return px_same_rows(strip, first) && strip->color_type != 3;
+}
 
 int main (int argc, char **argv)
+{
+    int c;
+    int mode = 'b';   /* b: buffered, s: streaming, n: no recompress, p: parallel */
+    int threads = 0;  /* 0: one per online CPU */
+    int refilter = 0;
+    int cols = 0;     /* tiles per row, with -g and -H */
+    int rows = 0;
+    const char *map = NULL;
+
+    while ((c = getopt(argc, argv, "snpfj:g:Hm:")) != -1) {
+        switch (c) {
+        case 's':     /* inflate/deflate in CHUNK sized pieces */
+        case 'n':     /* splice the deflate streams, no deflate at all */
+        case 'p':     /* inflate strips and deflate blocks on all cores */
+            mode = c;
+            break;
+        case 'f':     /* choose every row's filter again, with -p */
+            refilter = 1;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':     /* a grid of tiles, row major */
+            if (sscanf(optarg, "%dx%d", &cols, &rows) != 2 || cols <= 0 || rows <= 0) {
+                fprintf(stderr, USAGE, argv[0], argv[0]);
+                return -1;
+            }
+            mode = 't';
+            break;
+        case 'H':     /* all of them side by side */
+            mode = 't';
+            break;
+        case 'm':     /* tiles wherever the map puts them */
+            map = optarg;
+            mode = 't';
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0], argv[0]);
+            return -1;
+        }
+    }
+
+    if (optind >= argc && map == NULL) {
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        return -1;
+    }
+    if (mode == 't' && map == NULL && cols == 0) {
+        cols = argc - optind;
+    }
+    if (mode == 't' && map == NULL && (long)cols * rows < argc - optind && rows != 0) {
+        fprintf(stderr, "%d files do not fit a %dx%d grid\n", argc - optind, cols, rows);
+        return -1;
+    }
+
+    if (mode == 's') {
+        return concat_stream(argc - optind, argv + optind);
+    } else if (mode == 'n') {
+        return concat_splice(argc - optind, argv + optind);
+    } else if (mode == 't') {
+        return concat_tiles(argc - optind, argv + optind, cols, map);
+    } else if (mode == 'p') {
+        return concat_parallel(argc - optind, argv + optind, par_threads(threads), refilter);
+    }
+    return concat_buffered(argc - optind, argv + optind);
+}
+
+/**
+ * @brief concatenate the pngs by inflating all of them into one buffer and
+ *        deflating that buffer in a single mem_def() call
+ * @param int n number of input files
+ * @param char **paths input file paths, top strip first
+ * @return 0 on success; non-zero otherwise
+ */
+int concat_buffered(int n, char **paths)
 {
     int ret = 0;          /* return value for various routines             */
     U64 len_def = 0;      /* compressed data length                        */
     U64 len_inf = 0;      /* uncompressed data length                      */
     U64 len_concat = 0; // length of concatenated data uncompressed
     int concat_height = 0;
-    U32 crc_val = 0;
+    int convert = 0;      /* 1: the strips differ, concat_parallel() them */
+    struct data_IHDR first;
+    struct span png = { NULL };   /* the strip being inflated */
+    struct simple_PNG data;
+    int parsed = 0;       /* 1: data holds png's chunks */
+    U8 *gp_buf_def = NULL;        /* output buffer for mem_def() */
 
     U64 inf_buf_size = BUF_LEN2;
 
   //  long int buf_size = BUF_LEN2;
 
-    U8* gp_buf_inf = malloc(inf_buf_size);
-    memset(gp_buf_inf, 0, inf_buf_size);
-    memset(gp_buf_def, 0, BUF_LEN2);
+    U8* gp_buf_inf = calloc(1, inf_buf_size);
 
+    if (gp_buf_inf == NULL) {
+        perror("calloc");
+        return -1;
+    }
 
     // LOOP writting uncompressed IDAT to file then recompress and look at length and ntoh length and ad length field to IHDR and make IEND data
-    for(int i=1; i < argc; i++){
-        
-        FILE* fp = fopen(argv[i], "rb");  // DO NOT DELETE
-        struct chunk data;
+    for(int i=0; i < n; i++){
 
-        get_png_data_IDAT( &data, fp);
-        concat_height = concat_height + get_height(fp);
-        // resize array if we are nearly full or predicted to go over capacity given an average inflation sizae of ~24 times
-        if(len_concat+data.length*23 > inf_buf_size){
-            gp_buf_inf = (U8 *) realloc(gp_buf_inf, (len_concat+data.length*24)*2 );
-            inf_buf_size = (len_concat+data.length*23)*2;
+        struct data_IHDR ihdr;
+        U64 len_idat = 0;
+
+        if (span_open(&png, paths[i]) != 0) {
+            ret = -1;
+            goto out;
+        }
+        if (png_parse(&data, png.buf, png.len) != 0) {
+            fprintf(stderr, "%s: not a well formed png\n", paths[i]);
+            ret = -1;
+            goto out;
+        }
+        parsed = 1;
+        parse_IHDR(&ihdr, data.IHDR.p_data);
+        if (i == 0) {
+            first = ihdr;
+        }
+        if (!rows_pass_through(&ihdr, &first)) {
+            fprintf(stderr, "strips differ in format, converting them\n");
+            convert = 1;
+            goto out;
+        }
+        concat_height = concat_height + ihdr.height;
+        for (U32 k = 0; k < data.n_IDAT; k++) {
+            len_idat += data.p_IDAT[k].length;
+        }
+        // the IHDR tells us exactly how much room the inflated strip needs
+        if(len_concat + png_raw_size(&ihdr) > inf_buf_size){
+            U8 *grown = realloc(gp_buf_inf, (len_concat + png_raw_size(&ihdr))*2);
+
+            if (grown == NULL) {
+                fprintf(stderr, "%s: out of memory\n", paths[i]);
+                ret = -1;
+                goto out;
+            }
+            gp_buf_inf = grown;
+            inf_buf_size = (len_concat + png_raw_size(&ihdr))*2;
         }
 
-        ret = mem_inf(gp_buf_inf + len_concat, &len_inf, data.p_data, data.length);
+        ret = zc_inf_idat(gp_buf_inf + len_concat, inf_buf_size - len_concat, &len_inf, png.buf, png.len);
+        // its first row was filtered against zeros, not the strip above
+        if (ret == 0 && len_inf > 0 &&
+            png_detach_row(gp_buf_inf + len_concat, png_row_bytes(&ihdr), png_bpp(&ihdr)) != 0) {
+            ret = Z_DATA_ERROR;
+        }
         if (ret == 0) { /* success */
-            printf("original len = %d, len_inf = %lu\n", data.length, len_inf);
+            printf("original len = %lu in %u IDAT, len_inf = %lu\n", len_idat, data.n_IDAT, len_inf);
         } else { /* failure */
-            fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
-            return ret;
+            fprintf(stderr,"mem_inf failed. ret = %d.\n", ret);
+            goto out;
         }
 
         len_concat = len_concat + len_inf;
-        fclose(fp);
+        png_free(&data);
+        parsed = 0;
+        span_close(&png);
 
     }
 
-    ret = mem_def(gp_buf_def, &len_def, gp_buf_inf, len_concat, Z_DEFAULT_COMPRESSION);
+    len_def = zc_bound(len_concat);
+    gp_buf_def = malloc(len_def);
+    ret = gp_buf_def ? mem_def(gp_buf_def, &len_def, gp_buf_inf, len_concat, Z_DEFAULT_COMPRESSION)
+                     : Z_MEM_ERROR;
     if (ret == 0) { /* success */
         printf("len inf all together = %ld, len_def = %lu\n", \
                len_concat, len_def);
     } else { /* failure */
         fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
+        goto out;
     }
 
-    FILE* bp = fopen("concat.png", "wb+");
-
-    // write png sig to file copying from the first png
-    // make sure at least one arg 
-    FILE* fp = fopen(argv[1], "rb");                  // DO NOT DELETE
-    
-    // copy ihdr from the first file into the new png that will be created so it has all the same info   
-    char bytes[33]; // make dynamic to free
-    fread(bytes, 33, 1, fp); // read 33 bytes into buffer bytes
-    fwrite(bytes, 33, 1, bp);
-    //write height to file
-    fseek(bp, 20, SEEK_SET);
-    concat_height = ntohl(concat_height);
-    fwrite( &concat_height, 4, 1, bp);
-    // calculate crc for ihdr and add
-    fseek(bp, 12, SEEK_SET); // seek to ihdr data field
-    fread(bytes, 17, 1, bp); // read the ihdr data field (13 bytes)
-    crc_val = htonl(crc(bytes, 17));
-    fseek(bp, 29, SEEK_SET);    // go to crc position
-    fwrite( &crc_val, 4, 1, bp); //write crc data
+    // the first strip's IHDR with the height of the whole stack
+    first.height = concat_height;
+    ret = png_write("concat.png", &first, gp_buf_def, len_def, NULL);
 
-    fclose(fp);
+out:
+    if (parsed) {
+        png_free(&data);
+    }
+    if (png.buf != NULL) {
+        span_close(&png);
+    }
+    free(gp_buf_inf);
+    free(gp_buf_def);
+    return convert ? concat_parallel(n, paths, par_threads(0), 0) : ret;
+}
 
-    // add IDAT data length and chunk type along with data
-    unsigned char idat[4] = { 'I', 'D', 'A', 'T'};
-    /* merge idat chunk type and deflated data */
-    U8* idat_crc_buf = malloc(len_def + 4);
-    memcpy(idat_crc_buf, idat, 4); // copy chars into crc buffer
-    memcpy(idat_crc_buf+4, gp_buf_def, len_def); // copy chars into crc buffer
-    len_def = htonl(len_def);
-    fwrite(&len_def, 4,1,bp); // write length of idat chunk
-    len_def = ntohl(len_def);
-    fwrite(idat_crc_buf, len_def+4,1,bp);
-
-    crc_val = htonl( crc(idat_crc_buf, len_def+4) ); // CRC USES TYPE AND DATA FIELD
-    fwrite(&crc_val, 4,1,bp); // write compressed binary data 
-    
-    // ADD IEND DATA AND FIX HEIGHT VALUE IN CORRECT ENDIANESS -> try pnginfo function and opening file 
-    // iend = 4 bytes of 0 + "IEND" + crc
-    unsigned char iend[8] = {0, 0, 0, 0, 'I', 'E', 'N', 'D'};
-    fwrite(iend, 8,1,bp);
-    crc_val = htonl(crc(&iend[4], 4));
-    fwrite(&crc_val, 4,1,bp); // write proper crc
-    
-    /* Clean up */
-    free(idat_crc_buf);
+/**
+ * @brief feed len bytes at src into the deflate stream and write every full
+ *        CHUNK of compressed output as its own IDAT chunk
+ * @param z_stream *def deflate stream, next_out/avail_out point into out
+ * @param U8 *src uncompressed input, may be NULL when len is 0
+ * @param U32 len length of src in bytes
+ * @param int flush Z_NO_FLUSH while strips remain, Z_FINISH for the last call
+ * @param U8 *out CHUNK sized compressed output buffer
+ * @param FILE *bp output png file
+ * @param U64 *len_def accumulated compressed length
+ * @return 0 on success; non-zero otherwise
+ */
+static int stream_deflate(z_stream *def, U8 *src, U32 len, int flush,
+                          U8 *out, FILE *bp, U64 *len_def)
+{
+    int ret = Z_OK;
+
+    def->next_in = src;
+    def->avail_in = len;
+
+    do {
+        ret = deflate(def, flush);
+        assert(ret != Z_STREAM_ERROR);
+        if (def->avail_out == 0) { /* out is full, ship it as one IDAT */
+            if (write_chunk(bp, "IDAT", out, CHUNK) != 0) {
+                return -1;
+            }
+            *len_def += CHUNK;
+            def->next_out = out;
+            def->avail_out = CHUNK;
+        }
+    } while (def->avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+    if (flush == Z_FINISH && def->avail_out < CHUNK) { /* last partial IDAT */
+        if (write_chunk(bp, "IDAT", out, CHUNK - def->avail_out) != 0) {
+            return -1;
+        }
+        *len_def += CHUNK - def->avail_out;
+    }
+    return 0;
+}
+
+/**
+ * @brief concatenate the pngs with one deflate stream kept open across all
+ *        strips. Each strip's IDATs are inflated in place from the mapped
+ *        file CHUNK bytes at a time and the inflated pieces go straight into
+ *        deflate(), so peak memory is a few CHUNK sized buffers whatever the
+ *        total image height. Only each strip's first row is held back whole,
+ *        to be rewritten by png_detach_row() before it goes on.
+ * @param int n number of input files
+ * @param char **paths input file paths, top strip first, for messages
+ * @param struct span *spans the n input files
+ * @return 0 on success; non-zero otherwise
+ */
+static int stream_spans(int n, char **paths, struct span *spans)
+{
+    z_stream inf;        /* inflate state of the current strip       */
+    z_stream def;        /* one deflate state for the whole output   */
+    U8 mid[CHUNK];       /* inflated bytes waiting for deflate()     */
+    U8 out[CHUNK];       /* compressed bytes waiting to become IDAT  */
+    U8 *row0 = NULL;     /* a strip's first row, type byte first     */
+    U64 row_len;         /* bytes in it                              */
+    int bpp;
+    struct data_IHDR ihdr;
+    struct data_IHDR strip;
+    U64 len_inf = 0;     /* total uncompressed length                */
+    U64 len_def = 0;     /* total compressed length                  */
+    U32 height = 0;
+    int convert = 0;
+    int ret = 0;
+    FILE *bp = NULL;
+
+    /* heights first, so the IHDR can go out before any IDAT */
+    for (int i = 0; i < n; i++) {
+        if (span_IHDR(spans + i, &strip) != 0) {
+            fprintf(stderr, "%s: no IHDR\n", paths[i]);
+            return -1;
+        }
+        if (i == 0) {
+            ihdr = strip;
+        }
+        convert |= !rows_pass_through(&strip, &ihdr);
+        height += strip.height;
+    }
+    ihdr.height = height;
+
+    /* scanlines are passed through as they are, but for each strip's first
+       row, so only matching strips can be streamed */
+    if (convert) {
+        fprintf(stderr, "strips differ in format, converting them\n");
+        return parallel_spans(n, paths, spans, par_threads(0), 0);
+    }
+    row_len = 1 + png_row_bytes(&ihdr);
+    bpp = png_bpp(&ihdr);
+    row0 = malloc(row_len);
+    if (row0 == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    bp = fopen("concat.png", "wb");
+    if (bp == NULL) {
+        perror("concat.png");
+        free(row0);
+        return -1;
+    }
+    if (write_png_header(bp, &ihdr) != 0) {
+        fclose(bp);
+        free(row0);
+        return -1;
+    }
+
+    def.zalloc = Z_NULL;
+    def.zfree  = Z_NULL;
+    def.opaque = Z_NULL;
+    ret = deflateInit(&def, Z_DEFAULT_COMPRESSION);
+    if (ret != Z_OK) {
+        zerr(ret);
+        fclose(bp);
+        free(row0);
+        return ret;
+    }
+    def.next_out = out;
+    def.avail_out = CHUNK;
+
+    for (int i = 0; i < n && ret == 0; i++) {
+        struct png_iter it;
+        U64 got = 0;     /* bytes of this strip inflated so far */
+
+        png_iter_init(&it, spans[i].buf, spans[i].len);
+
+        inf.zalloc = Z_NULL;
+        inf.zfree  = Z_NULL;
+        inf.opaque = Z_NULL;
+        inf.avail_in = 0;
+        inf.next_in = Z_NULL;
+        ret = inflateInit(&inf);
+        if (ret != Z_OK) {
+            zerr(ret);
+            break;
+        }
+
+        /* inflate the IDATs in place: the first row into row0, the rest in
+           CHUNK sized output pieces */
+        do {
+            U8 *dst = got < row_len ? row0 + got : mid;
+            U32 room = got < row_len ? row_len - got : CHUNK;
+
+            if (inf.avail_in == 0 && idat_next(&it, &inf) != 1) {
+                fprintf(stderr, "%s: IDAT stream ends early\n", paths[i]);
+                ret = Z_DATA_ERROR;
+                break;
+            }
+            inf.avail_out = room;
+            inf.next_out = dst;
+            ret = inflate(&inf, Z_NO_FLUSH);
+            assert(ret != Z_STREAM_ERROR);
+            if (ret == Z_BUF_ERROR) { /* no progress, wait for more input */
+                ret = Z_OK;
+            }
+            if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+                ret = (ret == Z_NEED_DICT) ? Z_DATA_ERROR : ret;
+                break;
+            }
+            len_inf += room - inf.avail_out;
+            got += room - inf.avail_out;
+            if (dst == row0 && got == row_len) {
+                /* filtered against zeros, it now goes under another strip */
+                if (png_detach_row(row0, row_len - 1, bpp) != 0) {
+                    fprintf(stderr, "%s: invalid filter type\n", paths[i]);
+                    ret = Z_DATA_ERROR;
+                    break;
+                }
+                if (stream_deflate(&def, row0, row_len, Z_NO_FLUSH, out, bp, &len_def) != 0) {
+                    ret = -1;
+                    break;
+                }
+            } else if (dst == mid && inf.avail_out < CHUNK &&
+                       stream_deflate(&def, mid, CHUNK - inf.avail_out, Z_NO_FLUSH,
+                                      out, bp, &len_def) != 0) {
+                ret = -1;
+                break;
+            }
+        } while (ret == Z_OK);
+        if (ret == Z_STREAM_END && got > 0 && got < row_len &&
+            stream_deflate(&def, row0, got, Z_NO_FLUSH, out, bp, &len_def) != 0) {
+            ret = -1;   /* less than a row, it goes on as it is */
+        }
+
+        (void) inflateEnd(&inf);
+
+        if (ret != Z_STREAM_END) {
+            fprintf(stderr, "%s: inflate failed. ret = %d.\n", paths[i], ret);
+            ret = (ret == Z_OK) ? Z_DATA_ERROR : ret;
+        } else {
+            ret = 0;
+        }
+    }
+
+    if (ret == 0) {
+        ret = stream_deflate(&def, NULL, 0, Z_FINISH, out, bp, &len_def);
+    }
+    (void) deflateEnd(&def);
+
+    if (ret == 0) {
+        printf("len inf all together = %lu, len_def = %lu\n", len_inf, len_def);
+        ret = write_chunk(bp, "IEND", NULL, 0);
+    }
     fclose(bp);
+    free(row0);
+    return ret;
+}
+
+/**
+ * @brief concatenate the pngs with one deflate stream, see stream_spans()
+ * @param int n number of input files
+ * @param char **paths input file paths, top strip first
+ * @return 0 on success; non-zero otherwise
+ */
+int concat_stream(int n, char **paths)
+{
+    struct span *spans = open_spans(n, paths);
+    int ret;
+
+    if (spans == NULL) {
+        return -1;
+    }
+    ret = stream_spans(n, paths, spans);
+    close_spans(spans, n);
+    return ret;
+}
+
+struct refilter_ctx {
+    U8 *raw;              /* all strips inflated, top to bottom */
+    struct strip *s;
+    U8 *bound;            /* strip i's last row, unfiltered, at i * row_bytes */
+    U64 row_bytes;
+    int bpp;
+    int pass;             /* 0: unfilter, 1: refilter */
+};
+
+static void refilter_job(void *ctx, int i)
+{
+    struct refilter_ctx *p = ctx;
+    struct strip *s = p->s + i;
+    U8 *rows = p->raw + s->offset;
+
+    if (p->pass == 0) {
+        /* par_inf_strips() detached every strip's first row from the one above */
+        s->ret = png_unfilter_rows(rows, s->ihdr.height, p->row_bytes, p->bpp, NULL);
+        if (s->ret == 0 && s->ihdr.height > 0) {
+            memcpy(p->bound + i * p->row_bytes,
+                   rows + s->raw_len - p->row_bytes, p->row_bytes);
+        }
+    } else {
+        /* now the row above a strip is the previous strip's last row */
+        s->ret = png_refilter_rows(rows, s->ihdr.height, p->row_bytes, p->bpp,
+                                   i > 0 ? p->bound + (i - 1) * p->row_bytes : NULL,
+                                   PNG_FILTER_ADAPTIVE);
+    }
+}
+
+/**
+ * @brief unfilter every strip and filter the rows again as one image,
+ *        choosing each row's filter with png_filter_best(), for a smaller
+ *        output. The strips decode right stacked without this too, see
+ *        png_detach_row().
+ * @param U8 *raw all strips inflated, laid out by strips_layout()
+ * @param struct strip *s n strips
+ * @param int n number of strips
+ * @param int n_threads number of threads
+ * @return 0 on success; non-zero otherwise
+ */
+static int refilter_strips(U8 *raw, struct strip *s, int n, int n_threads)
+{
+    struct refilter_ctx ctx;
+    int ret = 0;
+
+    for (int i = 1; i < n; i++) {
+        if (s[i].ihdr.width != s[0].ihdr.width || s[i].ihdr.bit_depth != s[0].ihdr.bit_depth ||
+            s[i].ihdr.color_type != s[0].ihdr.color_type || s[i].ihdr.interlace != 0 ||
+            s[0].ihdr.interlace != 0) {
+            fprintf(stderr, "strip %d: rows differ from the first strip, cannot refilter\n", i);
+            return -1;
+        }
+    }
+    ctx.raw = raw;
+    ctx.s = s;
+    ctx.row_bytes = png_row_bytes(&s[0].ihdr);
+    ctx.bpp = png_bpp(&s[0].ihdr);
+    ctx.bound = malloc(n * ctx.row_bytes + 1);
+    if (ctx.bound == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (ctx.pass = 0; ctx.pass < 2 && ret == 0; ctx.pass++) {
+        if (par_run(n, n_threads, refilter_job, &ctx) != 0) {
+            ret = -1;
+        }
+        for (int i = 0; i < n && ret == 0; i++) {
+            if (s[i].ret != 0) {
+                fprintf(stderr, "strip %d: %s failed\n", i, ctx.pass ? "refilter" : "unfilter");
+                ret = -1;
+            }
+        }
+    }
+    free(ctx.bound);
+    return ret;
+}
+
+/**
+ * @brief concatenate the pngs on n_threads threads. Every strip is inflated
+ *        on a worker straight into its slot of the output, then the output
+ *        is deflated in independent PAR_BLOCK sized blocks, see par_def().
+ *        Strips that differ in width, bit depth or color type are converted
+ *        to a common format on the way, see png_convert.h.
+ * @param int n number of input files
+ * @param char **paths input file paths, top strip first, for messages
+ * @param struct span *spans the n input files
+ * @param int n_threads number of worker threads
+ * @param int refilter non-zero to filter the rows again, see refilter_strips();
+ *        ignored when palette strips were expanded
+ * @return 0 on success; non-zero otherwise
+ */
+static int parallel_spans(int n, char **paths, struct span *spans, int n_threads, int refilter)
+{
+    struct strip *strips = calloc(n, sizeof(struct strip));
+    struct data_IHDR ihdr;
+    U8 *p_inf = NULL;     /* all strips inflated, top to bottom */
+    U8 *p_def = NULL;     /* the deflated output */
+    U64 len_inf = 0;
+    U64 len_def = 0;
+    U32 crc_def = 0;      /* crc() of p_def, from par_def() */
+    int convert = 0;      /* 1: the strips go through px_paste_strips() */
+    int indexed = 0;      /* 1: some strip has a palette, expanded on the way */
+    int ret = 0;
+
+    if (strips == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        strips[i].png = spans[i].buf;
+        strips[i].png_len = spans[i].len;
+    }
+    ret = strips_layout(strips, n, &len_inf);
+    if (ret == 0) {
+        convert = px_target(&ihdr, strips, n);
+        ret = (convert < 0) ? -1 : 0;
+    }
+    for (int i = 0; i < n && ret == 0; i++) {
+        indexed |= strips[i].ihdr.color_type == 3;
+    }
+    if (ret == 0 && convert) {
+        len_inf = png_raw_size(&ihdr);
+        printf("converting to %u bit color type %u, %u wide\n",
+               ihdr.bit_depth, ihdr.color_type, ihdr.width);
+    }
+    if (ret == 0) {
+        p_inf = malloc(len_inf ? len_inf : 1);
+        p_def = malloc(par_def_bound(len_inf));
+        ret = (p_inf == NULL || p_def == NULL) ? Z_MEM_ERROR : 0;
+    }
+    if (ret == 0) {
+        ret = convert ? px_paste_strips(p_inf, &ihdr, strips, n, n_threads)
+                      : par_inf_strips(p_inf, strips, n, n_threads);
+        for (int i = 0; i < n && ret != Z_OK; i++) {
+            if (strips[i].ret != Z_OK) {
+                fprintf(stderr, "%s: inflate failed. ret = %d.\n", paths[i], strips[i].ret);
+                break;
+            }
+        }
+    }
+    if (ret == 0 && refilter && indexed) {
+        /* a few palette colours spread over RGB only get worse filtered */
+        printf("palette strips expanded, keeping filter type None\n");
+    } else if (ret == 0 && refilter) {
+        ret = refilter_strips(p_inf, strips, n, n_threads);
+    }
+    if (ret == 0) {
+        ret = par_def(p_def, par_def_bound(len_inf), &len_def, &crc_def, p_inf, len_inf,
+                      Z_DEFAULT_COMPRESSION, n_threads);
+        if (ret != Z_OK) {
+            zerr(ret);
+        }
+    }
+
+    if (ret == 0) {
+        printf("len inf all together = %lu, len_def = %lu, threads = %d\n",
+               len_inf, len_def, n_threads);
+        ret = png_write("concat.png", &ihdr, p_def, len_def, &crc_def);
+    }
+
+    /* Clean up */
+    free(strips);
+    free(p_inf);
+    free(p_def);
+    return ret;
+}
+
+/**
+ * @brief concatenate the pngs on n_threads threads, see parallel_spans()
+ * @param int n number of input files
+ * @param char **paths input file paths, top strip first
+ * @param int n_threads number of worker threads
+ * @param int refilter non-zero to filter the rows again, see refilter_strips()
+ * @return 0 on success; non-zero otherwise
+ */
+int concat_parallel(int n, char **paths, int n_threads, int refilter)
+{
+    struct span *spans = open_spans(n, paths);
+    int ret;
+
+    if (spans == NULL) {
+        return -1;
+    }
+    ret = parallel_spans(n, paths, spans, n_threads, refilter);
+    close_spans(spans, n);
+    return ret;
+}
+
+/**
+ * @brief concatenate the pngs without recompressing them. The strips' zlib
+ *        streams are spliced into one, see zsplice.h, so the only work is an
+ *        inflate pass to find where each stream ends. The strips must agree
+ *        on everything in the IHDR but the height; if they do not, or a
+ *        stream cannot be spliced, e.g. a strip's first row is filtered
+ *        against the row above, this falls back to stream_spans().
+ * @param int n number of input files
+ * @param char **paths input file paths, top strip first
+ * @return 0 on success; non-zero otherwise
+ */
+int concat_splice(int n, char **paths)
+{
+    struct strip *strips = calloc(n, sizeof(struct strip));
+    struct span *spans = strips ? open_spans(n, paths) : NULL;
+    struct zsplice z = { NULL };
+    struct data_IHDR ihdr;
+    U64 len_inf = 0;
+    U64 cap = 6;
+    U32 height = 0;
+    int ret = 0;
+
+    if (strips == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    if (spans == NULL) {
+        free(strips);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        strips[i].png = spans[i].buf;
+        strips[i].png_len = spans[i].len;
+        cap += strips[i].png_len;
+    }
+    ret = strips_layout(strips, n, &len_inf);
+
+    ihdr = strips[0].ihdr;
+    for (int i = 0; i < n && ret == 0; i++) {
+        struct data_IHDR *s = &strips[i].ihdr;
+
+        /* scanlines only line up if the strips share the row format */
+        if (!rows_pass_through(s, &ihdr) || s->compression != ihdr.compression ||
+            s->filter != ihdr.filter || s->interlace != 0) {
+            fprintf(stderr, "%s: IHDR differs from %s or is indexed, cannot splice\n",
+                    paths[i], paths[0]);
+            ret = 1;
+        }
+        height += s->height;
+    }
+    if (ret == 0) {
+        ret = zsplice_init(&z, cap);
+    }
+    for (int i = 0; i < n && ret == 0; i++) {
+        ret = zsplice_png(&z, strips[i].png, strips[i].png_len, strips[i].raw_len, i == n - 1);
+        if (ret == ZSPLICE_ROW_ABOVE) {
+            fprintf(stderr, "%s: first row filtered against the row above, cannot splice\n",
+                    paths[i]);
+            ret = 1;
+        } else if (ret != Z_OK) {
+            fprintf(stderr, "%s: cannot splice its IDAT stream. ret = %d.\n", paths[i], ret);
+            ret = 1;
+        }
+    }
+
+    if (ret == 0) {
+        printf("len inf all together = %lu, len_def = %lu, spliced\n", len_inf, z.len);
+        ihdr.height = height;
+        ret = png_write("concat.png", &ihdr, z.buf, z.len, NULL);
+    }
+
+    if (ret > 0) { /* well formed input that just cannot be spliced */
+        fprintf(stderr, "falling back to recompressing\n");
+        ret = stream_spans(n, paths, spans);
+    }
+
+    /* Clean up */
+    close_spans(spans, n);
+    free(strips);
+    zsplice_cleanup(&z);
+    return ret;
+}
+
+/* one input of the tile compositor, placed with its top left corner at x, y */
+struct tile {
+    char *path;
+    U32 x;
+    U32 y;
+    struct data_IHDR ihdr;
+    U64 row_bytes;        /* bytes per scanline without the type byte */
+    px_kernel_t k;        /* NULL: its rows are copied as they are */
+    /* only while the scanline being built crosses the tile */
+    struct span span;
+    struct png_iter it;
+    z_stream inf;
+    U8 *rows;             /* row and prev, one allocation */
+    U8 *row;              /* the tile's current scanline, type byte first */
+    U8 *prev;             /* the one above it, unfiltered */
+    U16 *plte;            /* its RGBA palette if indexed */
+    U32 rows_done;
+};
+
+/**
+ * @brief read a placement map: one tile a line, "x y path", with x and y
+ *        the pixel position of the tile's top left corner. Blank lines and
+ *        lines starting with '#' are skipped.
+ * @param const char *map path of the map file
+ * @param int *n output parameter, number of tiles
+ * @return the tiles, with malloc()ed paths; NULL on failure
+ */
+static struct tile *read_tile_map(const char *map, int *n)
+{
+    FILE *fp = fopen(map, "r");
+    struct tile *t = NULL;
+    char line[4096 + 64];
+    int cap = 0;
+
+    *n = 0;
+    if (fp == NULL) {
+        perror(map);
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long x, y;
+        int at = 0;
+        size_t len;
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "%lu %lu %n", &x, &y, &at) != 2 || line[at] == '\0' ||
+            x > UINT32_MAX || y > UINT32_MAX) {
+            fprintf(stderr, "%s: bad line \"%s\", want \"x y path\"\n", map, line);
+            goto fail;
+        }
+        if (*n == cap) {
+            struct tile *more;
+
+            cap = cap ? 2 * cap : 64;
+            more = realloc(t, cap * sizeof(struct tile));
+            if (more == NULL) {
+                perror("realloc");
+                goto fail;
+            }
+            t = more;
+        }
+        len = strlen(line + at);
+        memset(t + *n, 0, sizeof(struct tile));
+        t[*n].path = malloc(len + 1);
+        if (t[*n].path == NULL) {
+            perror("malloc");
+            goto fail;
+        }
+        memcpy(t[*n].path, line + at, len + 1);
+        t[*n].x = x;
+        t[*n].y = y;
+        (*n)++;
+    }
+    fclose(fp);
+    if (*n == 0) {
+        fprintf(stderr, "%s: no tiles\n", map);
+        free(t);
+        return NULL;
+    }
+    return t;
+
+fail:
+    fclose(fp);
+    while (*n > 0) {
+        free(t[--(*n)].path);
+    }
+    free(t);
+    return NULL;
+}
+
+/**
+ * @brief get a tile ready to hand out scanlines: map the file and start
+ *        inflating its IDATs
+ * @return 0 on success; -1 otherwise
+ */
+static int tile_open(struct tile *t)
+{
+    int ret;
+
+    if (span_open(&t->span, t->path) != 0) {
+        return -1;
+    }
+    png_iter_init(&t->it, t->span.buf, t->span.len);
+    t->rows = malloc(2 * (1 + t->row_bytes));
+    t->row = t->rows;
+    t->prev = t->rows + 1 + t->row_bytes;
+    t->plte = NULL;
+    t->rows_done = 0;
+    if (t->rows == NULL) {
+        perror("malloc");
+        span_close(&t->span);
+        return -1;
+    }
+    if (t->ihdr.color_type == 3) {
+        t->plte = malloc(256 * 4 * sizeof(U16));
+        if (t->plte == NULL || px_palette(t->plte, t->span.buf, t->span.len) < 0) {
+            fprintf(stderr, "%s: indexed but no PLTE\n", t->path);
+            free(t->plte);
+            free(t->rows);
+            span_close(&t->span);
+            return -1;
+        }
+    }
+
+    t->inf.zalloc = Z_NULL;
+    t->inf.zfree  = Z_NULL;
+    t->inf.opaque = Z_NULL;
+    t->inf.avail_in = 0;
+    t->inf.next_in = Z_NULL;
+    ret = inflateInit(&t->inf);
+    if (ret != Z_OK) {
+        zerr(ret);
+        free(t->plte);
+        free(t->rows);
+        span_close(&t->span);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief release everything tile_open() took, the mapping included, so a
+ *        tile costs nothing once the output has moved below it
+ */
+static void tile_close(struct tile *t)
+{
+    (void) inflateEnd(&t->inf);
+    free(t->plte);
+    free(t->rows);
+    span_close(&t->span);
+    t->rows = t->row = t->prev = NULL;
+    t->plte = NULL;
+}
+
+/**
+ * @brief inflate and unfilter the tile's next scanline and paste it into
+ *        the output scanline
+ * @param struct tile *t an open tile
+ * @param U8 *canvas the output scanline without its type byte
+ * @param int out_bpp bytes per pixel of the output
+ * @return 0 on success; -1 on a truncated or corrupt tile
+ */
+static int tile_row(struct tile *t, U8 *canvas, int out_bpp)
+{
+    U8 *swap;
+    int ret;
+
+    t->inf.next_out = t->row;
+    t->inf.avail_out = 1 + t->row_bytes;
+    while (t->inf.avail_out > 0) {
+        if (t->inf.avail_in == 0 && idat_next(&t->it, &t->inf) != 1) {
+            fprintf(stderr, "%s: IDAT stream ends early\n", t->path);
+            return -1;
+        }
+        ret = inflate(&t->inf, Z_NO_FLUSH);
+        assert(ret != Z_STREAM_ERROR);
+        if (ret == Z_STREAM_END && t->inf.avail_out > 0) {
+            fprintf(stderr, "%s: too few scanlines\n", t->path);
+            return -1;
+        }
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            fprintf(stderr, "%s: inflate failed. ret = %d.\n", t->path, ret);
+            return -1;
+        }
+    }
+
+    if (png_unfilter_row(t->row[0], t->row + 1, t->rows_done ? t->prev + 1 : NULL,
+                         t->row_bytes, png_bpp(&t->ihdr)) != 0) {
+        fprintf(stderr, "%s: bad filter type\n", t->path);
+        return -1;
+    }
+    if (t->k != NULL) {
+        t->k(canvas + (U64)t->x * out_bpp, t->row + 1, t->ihdr.width, t->plte);
+    } else {
+        memcpy(canvas + (U64)t->x * out_bpp, t->row + 1, t->row_bytes);
+    }
+    swap = t->row;
+    t->row = t->prev;
+    t->prev = swap;
+    t->rows_done++;
     return 0;
 }
+
+static int tile_cmp_y(const void *a, const void *b)
+{
+    const struct tile *p = *(struct tile * const *)a;
+    const struct tile *q = *(struct tile * const *)b;
+
+    return p->y < q->y ? -1 : p->y > q->y ? 1 : (p < q ? -1 : p > q);
+}
+
+/**
+ * @brief composite the tiles into one image, a scanline at a time. Every
+ *        output scanline is gathered from the row segments of the tiles it
+ *        crosses, each inflated and unfiltered one row ahead, then filtered
+ *        and handed to a single deflate stream whose output is written out
+ *        as IDAT chunks as it comes. A tile is opened when the output
+ *        reaches its top row and closed after its bottom row, so memory is
+ *        two output scanlines plus two scanlines per tile of the current
+ *        band, whatever the size of the mosaic.
+ * @param struct tile *t n tiles with paths and positions; later tiles are
+ *        drawn over earlier ones where they overlap, and pixels no tile
+ *        covers are zero
+ * @param int n number of tiles
+ * @return 0 on success; non-zero otherwise
+ */
+static int composite_tiles(struct tile *t, int n)
+{
+    struct data_IHDR ihdr;   /* the output */
+    struct px_pick pick;
+    struct tile **order = NULL;  /* by top row */
+    struct tile **band = NULL;   /* open tiles, in drawing order */
+    U8 out[CHUNK];
+    U8 *line = NULL;         /* filtered output scanline, type byte first */
+    U8 *cur = NULL;          /* unfiltered output scanline */
+    U8 *above = NULL;
+    U8 *tmp = NULL;
+    U64 width = 0, height = 0, row_bytes;
+    U64 len_def = 0;
+    int n_band = 0, next = 0;
+    int out_bpp;
+    int ret = 0;
+    z_stream def;
+    FILE *bp = NULL;
+
+    /* one look at every IHDR first, for the output's size and format */
+    px_pick_init(&pick);
+    for (int i = 0; i < n; i++) {
+        U16 plte[256 * 4];
+        int trns = 0;
+
+        if (span_open(&t[i].span, t[i].path) != 0) {
+            return -1;
+        }
+        if (span_IHDR(&t[i].span, &t[i].ihdr) != 0) {
+            fprintf(stderr, "%s: no IHDR\n", t[i].path);
+            ret = -1;
+        } else if (t[i].ihdr.interlace != 0) {
+            fprintf(stderr, "%s: interlaced tiles are not supported\n", t[i].path);
+            ret = -1;
+        } else if (t[i].ihdr.color_type == 3 &&
+                   (trns = px_palette(plte, t[i].span.buf, t[i].span.len)) < 0) {
+            fprintf(stderr, "%s: indexed but no PLTE\n", t[i].path);
+            ret = -1;
+        } else if (px_pick_add(&pick, &t[i].ihdr, trns) != 0) {
+            fprintf(stderr, "%s: bit depth %d is not valid for color type %d\n",
+                    t[i].path, t[i].ihdr.bit_depth, t[i].ihdr.color_type);
+            ret = -1;
+        }
+        span_close(&t[i].span);
+        if (ret != 0) {
+            return ret;
+        }
+        t[i].row_bytes = png_row_bytes(&t[i].ihdr);
+        width = (U64)t[i].x + t[i].ihdr.width > width ? (U64)t[i].x + t[i].ihdr.width : width;
+        height = (U64)t[i].y + t[i].ihdr.height > height ? (U64)t[i].y + t[i].ihdr.height : height;
+    }
+    if (width > 0x7fffffff || height > 0x7fffffff) {
+        fprintf(stderr, "mosaic of %lu x %lu is too large for a png\n", width, height);
+        return -1;
+    }
+    px_pick_done(&pick, &ihdr);
+    if (ihdr.bit_depth < 8) { /* tiles must start on a byte */
+        ihdr.bit_depth = 8;
+    }
+    ihdr.width = width;
+    ihdr.height = height;
+    row_bytes = png_row_bytes(&ihdr);
+    out_bpp = png_bpp(&ihdr);
+    for (int i = 0; i < n; i++) {
+        t[i].k = px_kernel(&t[i].ihdr, &ihdr);
+    }
+
+    order = malloc(n * sizeof(struct tile *));
+    band = malloc(n * sizeof(struct tile *));
+    line = malloc(1 + row_bytes);
+    cur = calloc(1, row_bytes);
+    above = calloc(1, row_bytes);
+    tmp = malloc(row_bytes);
+    if (order == NULL || band == NULL || line == NULL || cur == NULL ||
+        above == NULL || tmp == NULL) {
+        perror("malloc");
+        ret = -1;
+        goto out;
+    }
+    for (int i = 0; i < n; i++) {
+        order[i] = t + i;
+    }
+    qsort(order, n, sizeof(struct tile *), tile_cmp_y);
+
+    bp = fopen("concat.png", "wb");
+    if (bp == NULL) {
+        perror("concat.png");
+        ret = -1;
+        goto out;
+    }
+    if (write_png_header(bp, &ihdr) != 0) {
+        ret = -1;
+        goto out;
+    }
+    def.zalloc = Z_NULL;
+    def.zfree  = Z_NULL;
+    def.opaque = Z_NULL;
+    ret = deflateInit(&def, Z_DEFAULT_COMPRESSION);
+    if (ret != Z_OK) {
+        zerr(ret);
+        goto out;
+    }
+    def.next_out = out;
+    def.avail_out = CHUNK;
+
+    for (U64 y = 0; y < height && ret == 0; y++) {
+        U8 *swap;
+        int k = 0;
+
+        /* drop the tiles the output has left behind */
+        for (int i = 0; i < n_band; i++) {
+            if (y >= band[i]->y + band[i]->ihdr.height) {
+                tile_close(band[i]);
+            } else {
+                band[k++] = band[i];
+            }
+        }
+        n_band = k;
+
+        /* and open the ones starting here, keeping the drawing order */
+        while (next < n && order[next]->y == y) {
+            struct tile *p = order[next++];
+            int at = n_band;
+
+            if (tile_open(p) != 0) {
+                ret = -1;
+                break;
+            }
+            while (at > 0 && band[at - 1] > p) {
+                band[at] = band[at - 1];
+                at--;
+            }
+            band[at] = p;
+            n_band++;
+        }
+
+        memset(cur, 0, row_bytes);
+        for (int i = 0; i < n_band && ret == 0; i++) {
+            ret = tile_row(band[i], cur, out_bpp);
+        }
+        if (ret != 0) {
+            break;
+        }
+
+        line[0] = png_filter_best(line + 1, cur, y ? above : NULL, row_bytes, out_bpp, tmp);
+        if (stream_deflate(&def, line, 1 + row_bytes, Z_NO_FLUSH, out, bp, &len_def) != 0) {
+            ret = -1;
+        }
+        swap = above;
+        above = cur;
+        cur = swap;
+    }
+
+    if (ret == 0) {
+        ret = stream_deflate(&def, NULL, 0, Z_FINISH, out, bp, &len_def);
+    }
+    (void) deflateEnd(&def);
+    if (ret == 0) {
+        printf("mosaic %lu x %lu of %d tiles, len_def = %lu\n", width, height, n, len_def);
+        ret = write_chunk(bp, "IEND", NULL, 0);
+    }
+
+out:
+    for (int i = 0; i < n_band; i++) {
+        tile_close(band[i]);
+    }
+    if (bp != NULL) {
+        fclose(bp);
+    }
+    free(order);
+    free(band);
+    free(line);
+    free(cur);
+    free(above);
+    free(tmp);
+    return ret;
+}
+
+/**
+ * @brief paste the pngs into a mosaic instead of a vertical stack, see
+ *        composite_tiles()
+ * @param int n number of input files
+ * @param char **paths input file paths in row major order
+ * @param int cols tiles per row of the grid; a tile's x is the sum of the
+ *        widths to its left and a row's y the sum of the tallest tile of
+ *        every row above. Ignored with a map.
+ * @param const char *map a placement map, see read_tile_map(); NULL for a
+ *        grid of the input files
+ * @return 0 on success; non-zero otherwise
+ */
+int concat_tiles(int n, char **paths, int cols, const char *map)
+{
+    struct tile *t;
+    int ret;
+
+    if (map != NULL) {
+        t = read_tile_map(map, &n);
+        if (t == NULL) {
+            return -1;
+        }
+    } else {
+        struct data_IHDR ihdr;
+        U64 x = 0, y = 0;
+        U32 tallest = 0;
+
+        t = calloc(n, sizeof(struct tile));
+        if (t == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            struct span s;
+
+            if (i % cols == 0) {
+                x = 0;
+                y += tallest;
+                tallest = 0;
+            }
+            if (span_open(&s, paths[i]) != 0) {
+                free(t);
+                return -1;
+            }
+            ret = span_IHDR(&s, &ihdr);
+            span_close(&s);
+            if (ret != 0 || x > UINT32_MAX || y > UINT32_MAX) {
+                fprintf(stderr, "%s: no IHDR, or placed too far out\n", paths[i]);
+                free(t);
+                return -1;
+            }
+            t[i].path = paths[i];
+            t[i].x = x;
+            t[i].y = y;
+            x += ihdr.width;
+            tallest = ihdr.height > tallest ? ihdr.height : tallest;
+        }
+    }
+
+    ret = composite_tiles(t, n);
+
+    for (int i = 0; map != NULL && i < n; i++) {
+        free(t[i].path);
+    }
+    free(t);
+    return ret;
+}
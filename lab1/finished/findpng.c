@@ -1,109 +1,466 @@
-// IMPLEMENT ERROR CHECK FUNCTIOPN TO MAKE SURE PNG ISNT CORRUPT??
-
+/**
+ * @brief  findpng: list every png file under a directory tree
+ *
+ * Copyright 2018-2020 Yiqing Huang
+ *
+ * This software may be freely redistributed under the terms of MIT License
+ *
+ * The tree is walked by a pool of threads. Each worker keeps a stack of
+ * directories still to be read and steals from the others once its own runs
+ * dry. Entries are typed from d_type, so no stat() is needed unless the file
+ * system leaves it DT_UNKNOWN, and files and subdirectories are opened with
+ * openat() relative to the directory being read; a subdirectory is queued
+ * open, so its path is never looked up again. The paths found are handed to
+ * the main thread through a lock-free queue and printed there. Workers with
+ * nothing to steal, and the main thread with nothing to print, sleep on a
+ * condition variable until there is.
+ */
 
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include "helper.h"
-void recurse_dir(char* dir_path);
-// acount for more than one directory input
+#include "par_run.h"  /* for par_threads() */
+#include "mpsc.h"
+
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define USAGE "Usage: %s [-j threads] <directory name>\n"
+#define FD_SPARE 64     /* descriptors left for reading files and the rest */
+#define PRINT_BATCH 64  /* pngs found before the main thread is woken */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+/* a directory waiting to be read */
+struct dir_item {
+    struct dir_item *next;
+    int fd;               /* open on it; -1 if it is to be opened by path */
+    char path[];          /* as printed, e.g. "dir/sub" */
+};
+
+/* a png found, on its way to the main thread */
+struct png_item {
+    struct mpsc_node node;
+    char path[];
+};
+
+/* one worker's stack of directories; other workers steal from it */
+struct work_stack {
+    pthread_mutex_t lock;
+    struct dir_item *top;
+};
+
+struct walk {
+    struct work_stack *stacks; /* one per worker */
+    int n_workers;
+    long pending;         /* directories queued or being read */
+    int running;          /* workers that have not exited yet */
+    struct mpsc out;      /* pngs found */
+    U64 n_files;          /* regular files looked at */
+    U64 n_dirs;           /* directories read */
+    long open_fds;        /* directories queued open */
+    long fd_budget;       /* at most that many, see find_png() */
+    pthread_mutex_t idle_lock; /* for the two below */
+    pthread_cond_t work;  /* a directory queued, or the walk done */
+    pthread_cond_t found; /* pngs queued, or a worker gone */
+    int idle;             /* workers waiting on work */
+    int printer_idle;     /* 1 while the main thread waits on found */
+    long unprinted;       /* pngs found since it started waiting */
+};
 
-int main(int argc, char *argv[]) 
+struct worker_args {
+    struct walk *w;
+    int id;
+};
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int find_png(const char *root, int n_threads);
+
+/******************************************************************************
+ * FUNCTIONS
+ *****************************************************************************/
+int main(int argc, char *argv[])
 {
-    DIR *p_dir;
-    struct dirent *p_dirent;
-    char str[64];
+    int c;
+    int threads = 0;  /* 0: one per online CPU */
 
-    if (argc == 1) {
-        fprintf(stderr, "Usage: %s <directory name>\n", argv[0]);
-        exit(1);
+    while ((c = getopt(argc, argv, "j:")) != -1) {
+        switch (c) {
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            return 1;
+        }
     }
-
-    if ((p_dir = opendir(argv[1])) == NULL) {
-        sprintf(str, "opendir(%s)", argv[1]);
-        perror(str);
-        exit(2);
+    if (optind >= argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        return 1;
     }
+    return find_png(argv[optind], par_threads(threads));
+}
 
-    while ((p_dirent = readdir(p_dir)) != NULL) {
-        char *str_path = p_dirent->d_name;  /* relative path name! */
+/**
+ * @brief join dir and name with a '/' into a new heap block of size
+ *        header + strlen(path) + 1, with the path starting at header
+ */
+static void *make_path(size_t header, const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir);
+    size_t name_len = (name == NULL) ? 0 : strlen(name);
+    char *p = malloc(header + dir_len + name_len + 2);
 
-        if (str_path == NULL) {
-            fprintf(stderr,"Null pointer found!"); 
-            exit(3);
-        } else if ( ( (strcmp(str_path, "..") == 0 ) || ( strcmp(str_path, ".") ) == 0) ){
-            continue;
+    if (p == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memcpy(p + header, dir, dir_len);
+    if (name != NULL) {
+        p[header + dir_len] = '/';
+        memcpy(p + header + dir_len + 1, name, name_len + 1);
+    } else {
+        p[header + dir_len] = '\0';
+    }
+    return p;
+}
+
+/**
+ * @brief wake a thread waiting on cv, or all of them, if *waiting says any
+ *        is; the waiter checks for work after it sets *waiting, and the
+ *        fences see that one of the two notices the other
+ */
+static void wake(struct walk *w, int *waiting, pthread_cond_t *cv, int all)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&w->idle_lock);
+        if (all) {
+            pthread_cond_broadcast(cv);
+        } else {
+            pthread_cond_signal(cv);
         }
-        else {
-        //    printf("%s\n", str_path );
-            char relative_path[64];
-            snprintf(relative_path, sizeof(relative_path), "%s/%s", argv[1], str_path);
-            int type = filetype(relative_path);
-            if( type == 1 ){
-                recurse_dir(relative_path);
-                // printf("%s\n", relative_path);
-            } else if (type == 0){
-                char buf[8];
-                FILE* fp = fopen(relative_path, "rb");
-                fread(buf, sizeof(buf), 1, fp);
-
-                if(is_png(buf)){
-                    // is a png
-                    printf("%s\n", relative_path);
-                }
+        pthread_mutex_unlock(&w->idle_lock);
+    }
+}
 
-            }
+static void push_dir(struct walk *w, int id, struct dir_item *d)
+{
+    struct work_stack *s = w->stacks + id;
+
+    __atomic_add_fetch(&w->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&s->lock);
+    d->next = s->top;
+    __atomic_store_n(&s->top, d, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&s->lock);
+    wake(w, &w->idle, &w->work, 0);
+}
+
+static struct dir_item *pop_dir(struct work_stack *s)
+{
+    struct dir_item *d;
+
+    if (__atomic_load_n(&s->top, __ATOMIC_RELAXED) == NULL) {
+        return NULL; /* do not bother with the lock */
+    }
+    pthread_mutex_lock(&s->lock);
+    d = s->top;
+    if (d != NULL) {
+        __atomic_store_n(&s->top, d->next, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return d;
+}
+
+/**
+ * @brief get the next directory: from our own stack first, otherwise stolen
+ *        from another worker's
+ */
+static struct dir_item *next_dir(struct walk *w, int id)
+{
+    struct dir_item *d = pop_dir(w->stacks + id);
+
+    for (int i = 1; d == NULL && i < w->n_workers; i++) {
+        d = pop_dir(w->stacks + (id + i) % w->n_workers);
+    }
+    return d;
+}
+
+/**
+ * @brief sleep until a directory is queued on any stack or the walk is done
+ */
+static void wait_dir(struct walk *w)
+{
+    int queued = 0;
+
+    pthread_mutex_lock(&w->idle_lock);
+    __atomic_add_fetch(&w->idle, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);  /* see wake() */
+        for (int i = 0; i < w->n_workers && !queued; i++) {
+            queued = __atomic_load_n(&w->stacks[i].top, __ATOMIC_RELAXED) != NULL;
         }
+        if (queued || __atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        }
+        pthread_cond_wait(&w->work, &w->idle_lock);
     }
+    __atomic_sub_fetch(&w->idle, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&w->idle_lock);
+}
 
-    if ( closedir(p_dir) != 0 ) {
-        perror("closedir");
-        exit(3);
+/**
+ * @brief open the subdirectory name of dir_fd to queue it, while the open
+ *        directories stay within w->fd_budget
+ * @return the descriptor; -1 if it is to be opened by path when read
+ */
+static int open_dir(struct walk *w, int dir_fd, const char *name)
+{
+    int fd;
+
+    if (__atomic_add_fetch(&w->open_fds, 1, __ATOMIC_RELAXED) > w->fd_budget) {
+        __atomic_sub_fetch(&w->open_fds, 1, __ATOMIC_RELAXED);
+        return -1;
     }
-    // IMPLEMNT ---> "findpng: No PNG file found" error msg
-    return 0;
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        __atomic_sub_fetch(&w->open_fds, 1, __ATOMIC_RELAXED);
+    }
+    return fd;
 }
 
-// every level we go down add a /
+/**
+ * @brief check the signature of the file name in the directory dir_fd
+ * @return 1 if it is a png; 0 otherwise
+ */
+static int check_png(int dir_fd, const char *name)
+{
+    U8 sig[PNG_SIG_SIZE];
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NOCTTY);
+    ssize_t n;
 
-void recurse_dir(char* dir_path){
+    if (fd < 0) {
+        return 0;
+    }
+    n = read(fd, sig, PNG_SIG_SIZE);
+    close(fd);
+    return n == PNG_SIG_SIZE && is_png(sig);
+}
 
-    DIR *p_dir;
+/**
+ * @brief read one directory: queue its subdirectories on our own stack and
+ *        send every png in it to the output queue
+ */
+static void read_dir(struct walk *w, int id, struct dir_item *d)
+{
+    DIR *p_dir = d->fd >= 0 ? fdopendir(d->fd) : opendir(d->path);
     struct dirent *p_dirent;
-    char str[64];
+    U64 n_files = 0;
+    U64 n_png = 0;
+    int dir_fd;
 
-    p_dir = opendir(dir_path); // Add in path sytax / not found error
-    p_dirent = readdir(p_dir);
+    if (p_dir == NULL) {
+        fprintf(stderr, "opendir(%s): %s\n", d->path, strerror(errno));
+        if (d->fd >= 0) {
+            close(d->fd);
+            __atomic_sub_fetch(&w->open_fds, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    dir_fd = dirfd(p_dir);
 
     while ((p_dirent = readdir(p_dir)) != NULL) {
-        char *str_path = p_dirent->d_name;  /* relative path name! */
+        const char *name = p_dirent->d_name;
+        unsigned char type = p_dirent->d_type;
 
-        if (str_path == NULL) {
-            fprintf(stderr,"Null pointer found!"); 
-            exit(3);
-        }else if ( ( (strcmp(str_path, "..") == 0 ) || ( strcmp(str_path, ".") ) == 0) ){
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
             continue;
-        } else {
-            char relative_path[64];
-            snprintf(relative_path, sizeof(relative_path), "%s/%s", dir_path, str_path);
-            //printf("%s\n", relative_path);
-            int type = filetype(relative_path);
-            if( type == 1 ){
-                recurse_dir(relative_path);
-                // printf("%s", relative_path);
-            } else if (type == 0){
-                char buf[8];
-                FILE* fp = fopen(relative_path, "rb");
-                fread(buf, sizeof(buf), 1, fp);
-
-                if(is_png(buf)){
-                    // is a png
-                    printf("%s\n", relative_path);
+        }
+        if (type == DT_UNKNOWN) { /* not every file system fills d_type */
+            struct stat buf;
+            if (fstatat(dir_fd, name, &buf, AT_SYMLINK_NOFOLLOW) < 0) {
+                continue;
+            }
+            type = S_ISDIR(buf.st_mode) ? DT_DIR : S_ISREG(buf.st_mode) ? DT_REG : DT_LNK;
+        }
+
+        if (type == DT_DIR) {
+            struct dir_item *sub = make_path(offsetof(struct dir_item, path), d->path, name);
+            if (sub != NULL) {
+                sub->fd = open_dir(w, dir_fd, name);
+                push_dir(w, id, sub);
+            }
+        } else if (type == DT_REG) {
+            n_files++;
+            if (check_png(dir_fd, name)) {
+                struct png_item *png = make_path(offsetof(struct png_item, path), d->path, name);
+                if (png != NULL) {
+                    mpsc_push(&w->out, &png->node);
+                    n_png++;
                 }
             }
         }
     }
+    closedir(p_dir);
+    if (d->fd >= 0) {
+        __atomic_sub_fetch(&w->open_fds, 1, __ATOMIC_RELAXED);
+    }
+    if (n_png > 0 && __atomic_add_fetch(&w->unprinted, n_png, __ATOMIC_RELAXED) >= PRINT_BATCH) {
+        wake(w, &w->printer_idle, &w->found, 0);
+    }
+
+    __atomic_add_fetch(&w->n_files, n_files, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&w->n_dirs, 1, __ATOMIC_RELAXED);
+}
+
+static void *walk_worker(void *arg)
+{
+    struct worker_args *p = arg;
+    struct walk *w = p->w;
+    struct dir_item *d;
 
-    if ( closedir(p_dir) != 0 ) {
-        perror("closedir");
-        exit(3);
+    for (;;) {
+        d = next_dir(w, p->id);
+        if (d != NULL) {
+            read_dir(w, p->id, d);
+            free(d);
+            if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_RELEASE) == 0) {
+                wake(w, &w->idle, &w->work, 1);
+            }
+        } else if (__atomic_load_n(&w->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;   /* nothing queued and nobody reading: the walk is done */
+        } else {
+            wait_dir(w);
+        }
     }
+    __atomic_sub_fetch(&w->running, 1, __ATOMIC_RELEASE);
+    wake(w, &w->printer_idle, &w->found, 1);
+    return NULL;
+}
 
-}
\ No newline at end of file
+/**
+ * @brief print every png under root, one path per line, then report how
+ *        fast the tree was walked on stderr
+ * @param const char *root directory to search
+ * @param int n_threads number of walker threads
+ * @return 0 on success; non-zero otherwise
+ */
+int find_png(const char *root, int n_threads)
+{
+    struct walk w;
+    struct worker_args *args;
+    pthread_t *p_tids;
+    struct dir_item *d;
+    struct mpsc_node *n = NULL;
+    struct timespec t0, t1;
+    struct rlimit rl;
+    struct stat st;
+    U64 n_png = 0;
+    int started = 0;
+    double secs;
+
+    if (stat(root, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "findpng: %s is not a directory\n", root);
+        return 2;
+    }
+
+    memset(&w, 0, sizeof(w));
+    mpsc_init(&w.out);
+    w.n_workers = n_threads;
+    /* queued directories hold a descriptor each; the rest are opened by
+       path, so a wide tree never leaves check_png() without one */
+    w.fd_budget = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ?
+                  (long)rl.rlim_cur - FD_SPARE - 2 * n_threads : 1024;
+    pthread_mutex_init(&w.idle_lock, NULL);
+    pthread_cond_init(&w.work, NULL);
+    pthread_cond_init(&w.found, NULL);
+    w.stacks = calloc(n_threads, sizeof(struct work_stack));
+    args = calloc(n_threads, sizeof(struct worker_args));
+    p_tids = calloc(n_threads, sizeof(pthread_t));
+    d = make_path(offsetof(struct dir_item, path), root, NULL);
+    if (w.stacks == NULL || args == NULL || p_tids == NULL || d == NULL) {
+        perror("calloc");
+        return 3;
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_mutex_init(&w.stacks[i].lock, NULL);
+    }
+    d->fd = -1;
+    push_dir(&w, 0, d);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    w.running = n_threads;
+    for (int i = 0; i < n_threads; i++) {
+        args[i].w = &w;
+        args[i].id = i;
+        if (pthread_create(p_tids + i, NULL, walk_worker, args + i) != 0) {
+            break;
+        }
+        started++;
+    }
+    __atomic_sub_fetch(&w.running, n_threads - started, __ATOMIC_RELEASE);
+    if (started == 0) {
+        args[0].w = &w;
+        args[0].id = 0;
+        w.running = 1;
+        walk_worker(args); /* walk it here rather than not at all */
+    }
+
+    /* print as the workers find them, until they are all gone and the
+       queue is drained; in between, sleep until the workers have found a
+       batch more or one of them is gone */
+    for (;;) {
+        int running = __atomic_load_n(&w.running, __ATOMIC_ACQUIRE);
+
+        for (n = n ? n : mpsc_pop(&w.out); n != NULL; n = mpsc_pop(&w.out)) {
+            struct png_item *png = (struct png_item *)n;
+            puts(png->path);
+            free(png);
+            n_png++;
+        }
+        if (running == 0) {
+            break;
+        }
+        pthread_mutex_lock(&w.idle_lock);
+        __atomic_store_n(&w.unprinted, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&w.printer_idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);  /* see wake() */
+        n = mpsc_pop(&w.out);
+        if (n == NULL && __atomic_load_n(&w.running, __ATOMIC_ACQUIRE) != 0) {
+            pthread_cond_wait(&w.found, &w.idle_lock);
+        }
+        __atomic_store_n(&w.printer_idle, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&w.idle_lock);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(p_tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (n_png == 0) {
+        printf("findpng: No PNG file found\n");
+    }
+    fflush(stdout);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "findpng: %lu files in %lu directories, %lu png, %.3f s, "
+            "%.0f files/s, %d threads\n", w.n_files, w.n_dirs, n_png, secs,
+            secs > 0 ? w.n_files / secs : 0.0, n_threads);
+
+    for (int i = 0; i < n_threads; i++) {
+        pthread_mutex_destroy(&w.stacks[i].lock);
+    }
+    pthread_cond_destroy(&w.found);
+    pthread_cond_destroy(&w.work);
+    pthread_mutex_destroy(&w.idle_lock);
+    free(w.stacks);
+    free(args);
+    free(p_tids);
+    return 0;
+}
@@ -1,36 +1,362 @@
 /**
- * @brief: How to pass command line input arguments to main program
- * To execute: <executable> [arg1] [arg2]...[argN] 
- * EXAMPLE: ./cmd_arg.out Hello ECE252 101 201 
+ * @brief: pnginfo: print the dimensions of png files and, with --verify,
+ *         check every chunk's CRC and optionally the IDAT zlib stream
+ * To execute: <executable> [--verify [--inflate]] [-j threads] <png file> ...
+ * EXAMPLE: ./pnginfo.o --verify images/WEEF_1.png images/uweng.png
+ *
+ * A single large file has its chunk CRCs checked on all threads, in segments
+ * that are put back together with crc_combine(). Several files are checked
+ * one file per thread, and the throughput is reported at the end.
  */
 
 #include <stdio.h>	/* printf needs to include this header file */
 #include <stdlib.h>
 #include <libgen.h>
-#include "lab_png.h"
+#include <getopt.h>
+#include <time.h>
+#include "helper.h"
+#include "par_run.h"  /* for par_run() */
 
-int main(int argc, char *argv[]) 
+/******************************************************************************
+ * DEFINED MACROS
+ *****************************************************************************/
+#define USAGE "Usage: %s [--verify [--inflate]] [-j threads] <png file> ...\n"
+#define PAR_CRC_MIN (4*1024*1024) /* smaller files are checked on one thread */
+#define CRC_SEG     (1024*1024)   /* bytes per parallel CRC job */
+
+/*************************************************************************
+ * STRUCTURES and TYPEDEFS
+*****************************************************************************/
+struct info_opts {
+    int verify;       /* check the CRC of every chunk */
+    int inflate;      /* also inflate the IDATs and check their length */
+    int n_threads;
+};
+
+/* part of one chunk's type and data fields, CRCed on its own */
+struct crc_seg {
+    const U8 *p;
+    U64 len;
+    U32 crc;
+};
+
+/* the result of one file in batch mode */
+struct file_report {
+    const char *path;
+    char *msg;        /* what it would have printed */
+    size_t msg_len;
+    U64 bytes;        /* file size */
+    int ret;
+};
+
+struct batch_ctx {
+    struct file_report *r;
+    const struct info_opts *o;
+};
+
+/******************************************************************************
+ * FUNCTION PROTOTYPES
+ *****************************************************************************/
+int png_info(const char *path, const struct info_opts *o, int n_threads, FILE *out, U64 *bytes);
+
+static void crc_seg_job(void *ctx, int i)
 {
-    
-    char *filepath = argv[1];
-    char* filename = basename( filepath);
-    // printf("%s\n", filepath);
-    char buf[8];
-    FILE* fp = fopen(filepath, "rb");
-    fread(buf, sizeof(buf), 1, fp);
-
-    is_png(buf);
-    //if ( is_png( filepath ) ) {
-    //    get_IHDR( filepath );
-    //}
-
-    // try allocating data on heap so its a poiner and do "get_png_data_IHDR( data, fp);" and free(data)
-    struct data_IHDR data;
-    get_png_data_IHDR( &data, fp);
-    printf("%s: %u x %u\n", filename, data.width, data.height );
+    struct crc_seg *s = (struct crc_seg *)ctx + i;
+
+    s->crc = crc((unsigned char *)s->p, s->len);
+}
+
+/**
+ * @brief compute the CRC of every chunk's type and data fields
+ * @param struct chunk *c n chunk views
+ * @param U32 *out n computed CRCs
+ * @param int n_threads threads to spread the work over; large chunks are
+ *        cut into CRC_SEG sized segments so even a single IDAT is split
+ * @return 0 on success; -1 if out of memory
+ */
+static int chunk_crcs(struct chunk *c, U32 *out, int n, int n_threads)
+{
+    struct crc_seg *segs;
+    int n_segs = 0;
+    int k = 0;
+
+    if (n_threads <= 1) {
+        for (int i = 0; i < n; i++) {
+            out[i] = crc(c[i].p_data - CHUNK_TYPE_SIZE, c[i].length + CHUNK_TYPE_SIZE);
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < n; i++) {
+        n_segs += (c[i].length + CHUNK_TYPE_SIZE + CRC_SEG - 1) / CRC_SEG;
+    }
+    segs = malloc(sizeof(struct crc_seg) * (n_segs ? n_segs : 1));
+    if (segs == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        const U8 *p = c[i].p_data - CHUNK_TYPE_SIZE;
+        U64 left = c[i].length + CHUNK_TYPE_SIZE;
+
+        for (; left > 0; k++) {
+            segs[k].p = p;
+            segs[k].len = left < CRC_SEG ? left : CRC_SEG;
+            p += segs[k].len;
+            left -= segs[k].len;
+        }
+    }
+    if (par_run(n_segs, n_threads, crc_seg_job, segs) != 0) {
+        free(segs);
+        return -1;
+    }
+
+    /* put every chunk's CRC back together from its segments */
+    k = 0;
+    for (int i = 0; i < n; i++) {
+        U64 left = c[i].length + CHUNK_TYPE_SIZE;
+
+        out[i] = segs[k].crc;
+        left -= segs[k++].len;
+        while (left > 0) {
+            out[i] = crc_combine(out[i], segs[k].crc, segs[k].len);
+            left -= segs[k++].len;
+        }
+    }
+    free(segs);
     return 0;
 }
 
-// void get_data_IHDR(*width buffer, * height buffer)
+/**
+ * @brief check every chunk of a png and, if asked, its IDAT zlib stream
+ * @param const struct span *png the whole file
+ * @param struct data_IHDR *ihdr the file's IHDR
+ * @param const struct info_opts *o what to check
+ * @param int n_threads threads for the chunk CRCs of a large file
+ * @param FILE *out where the errors found are printed
+ * @return 0 if the file is intact; 1 if not; -1 on a local error
+ */
+static int verify_png(const struct span *png, struct data_IHDR *ihdr,
+                      const struct info_opts *o, int n_threads, FILE *out)
+{
+    struct png_iter it;
+    struct chunk *c = NULL;
+    U32 *computed = NULL;
+    int n = 0;
+    int cap = 0;
+    int bad = 0;
+    int ret;
+
+    png_iter_init(&it, png->buf, png->len);
+    for (;;) {
+        if (n == cap) {
+            struct chunk *tmp = realloc(c, sizeof(struct chunk) * (cap ? cap * 2 : 16));
+            if (tmp == NULL) {
+                perror("realloc");
+                free(c);
+                return -1;
+            }
+            c = tmp;
+            cap = cap ? cap * 2 : 16;
+        }
+        ret = png_iter_next(&it, c + n);
+        if (ret != 1) {
+            break;
+        }
+        n++;
+    }
+    if (ret < 0) {
+        fprintf(out, "chunk at offset %lu is truncated\n", it.pos);
+        bad = 1;
+    } else if (n == 0 || memcmp(c[n - 1].type, "IEND", CHUNK_TYPE_SIZE) != 0) {
+        fprintf(out, "IEND chunk is missing\n");
+        bad = 1;
+    }
+
+    computed = malloc(sizeof(U32) * (n ? n : 1));
+    if (png->len < PAR_CRC_MIN) {
+        n_threads = 1;   /* not worth the threads */
+    }
+    if (computed == NULL || chunk_crcs(c, computed, n, n_threads) != 0) {
+        free(c);
+        free(computed);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (computed[i] != c[i].crc) {
+            fprintf(out, "%.4s chunk CRC error: computed %08x, expected %08x\n",
+                    (char *)c[i].type, computed[i], c[i].crc);
+            bad = 1;
+        }
+    }
+    free(c);
+    free(computed);
 
+    if (o->inflate) {
+        U64 raw_len = png_raw_size(ihdr);
+        U8 *raw = malloc(raw_len ? raw_len : 1);
+        U64 got = 0;
 
+        if (raw == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        ret = zc_inf_idat(raw, raw_len, &got, png->buf, png->len);
+        if (ret == Z_BUF_ERROR) {
+            fprintf(out, "IDAT inflates to more than the %lu bytes expected\n", raw_len);
+            bad = 1;
+        } else if (ret != Z_OK) {
+            fprintf(out, "IDAT zlib stream is corrupt. ret = %d.\n", ret);
+            bad = 1;
+        } else if (got != raw_len) {
+            fprintf(out, "IDAT inflates to %lu bytes, expected %lu\n", got, raw_len);
+            bad = 1;
+        }
+        free(raw);
+    }
+    return bad;
+}
+
+/**
+ * @brief print the dimensions of one png, then check it if o->verify
+ * @param const char *path input file path; "-" reads stdin
+ * @param const struct info_opts *o what to check
+ * @param int n_threads threads for the chunk CRCs
+ * @param FILE *out where the results are printed
+ * @param U64 *bytes output parameter, size of the file
+ * @return 0 if the file is a png that passed every check; non-zero otherwise
+ */
+int png_info(const char *path, const struct info_opts *o, int n_threads, FILE *out, U64 *bytes)
+{
+    struct span png;
+    struct data_IHDR data;
+    char *copy;
+    char *filename;
+    int ret = 0;
+
+    *bytes = 0;
+    if (span_open(&png, path) != 0) {
+        return 1;
+    }
+    *bytes = png.len;
+    copy = strdup(path); // basename() may modify its argument
+    filename = basename(copy);
+
+    if (png.len < PNG_SIG_SIZE || !is_png((U8 *)png.buf)) {
+        fprintf(out, "%s: Not a PNG file\n", filename);
+        ret = 1;
+    } else if (span_IHDR(&png, &data) != 0) {
+        fprintf(out, "%s: IHDR chunk is missing or truncated\n", filename);
+        ret = 1;
+    } else {
+        fprintf(out, "%s: %u x %u\n", filename, data.width, data.height );
+        if (o->verify) {
+            ret = (verify_png(&png, &data, o, n_threads, out) != 0);
+        }
+    }
+
+    free(copy);
+    span_close(&png);
+    return ret;
+}
+
+static void batch_job(void *ctx, int i)
+{
+    struct batch_ctx *b = ctx;
+    struct file_report *r = b->r + i;
+    FILE *out = open_memstream(&r->msg, &r->msg_len);
+
+    if (out == NULL) {
+        r->ret = -1;
+        return;
+    }
+    r->ret = png_info(r->path, b->o, 1, out, &r->bytes);
+    fclose(out);
+}
+
+/**
+ * @brief run png_info() on many files, one file per thread, print the
+ *        results in argument order and report the throughput on stderr
+ * @return 0 if every file passed; 1 otherwise
+ */
+static int batch_info(int n, char **paths, const struct info_opts *o)
+{
+    struct file_report *r = calloc(n, sizeof(struct file_report));
+    struct batch_ctx ctx = { r, o };
+    struct timespec t0, t1;
+    U64 bytes = 0;
+    int n_bad = 0;
+    double secs;
+
+    if (r == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        r[i].path = paths[i];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (par_run(n, o->n_threads, batch_job, &ctx) != 0) {
+        free(r);
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    for (int i = 0; i < n; i++) {
+        if (r[i].msg != NULL) {
+            fwrite(r[i].msg, 1, r[i].msg_len, stdout);
+            free(r[i].msg);
+        }
+        n_bad += (r[i].ret != 0);
+        bytes += r[i].bytes;
+    }
+    fflush(stdout);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "pnginfo: %d files, %d failed, %.1f MB, %.3f s, %.0f files/s, "
+            "%.1f MB/s, %d threads\n", n, n_bad, bytes / 1e6, secs,
+            secs > 0 ? n / secs : 0.0, secs > 0 ? bytes / 1e6 / secs : 0.0, o->n_threads);
+    free(r);
+    return n_bad ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_opts[] = {
+        { "verify",  no_argument, NULL, 'v' },
+        { "inflate", no_argument, NULL, 'z' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct info_opts o = { 0, 0, 0 };
+    U64 bytes;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "vzj:", long_opts, NULL)) != -1) {
+        switch (c) {
+        case 'v':
+            o.verify = 1;
+            break;
+        case 'z':     /* implies --verify */
+            o.verify = 1;
+            o.inflate = 1;
+            break;
+        case 'j':
+            o.n_threads = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, USAGE, argv[0]);
+        return 1;
+    }
+    o.n_threads = par_threads(o.n_threads);
+
+    if (argc - optind > 1) {
+        return batch_info(argc - optind, argv + optind, &o);
+    }
+    return png_info(argv[optind], &o, o.n_threads, stdout, &bytes);
+}
@@ -0,0 +1,132 @@
+/**
+ * @brief benchmark of the srv_pool.h policies: the same number of image
+ *        requests spread over the same servers by round robin and by power
+ *        of two choices, with the wall time, throughput and latency of each
+ * To execute: ./bench_pool [url[,url...]] [threads] [requests]
+ * The servers should differ in speed to see a difference, e.g. three copies
+ * of ../lab3/stub.py that sleep 5, 20 and 80 ms per request:
+ *   python3 ../lab3/stub.py 2521 0.005 &
+ *   python3 ../lab3/stub.py 2522 0.02 &
+ *   python3 ../lab3/stub.py 2523 0.08 &
+ *   ./bench_pool http://127.0.0.1:2521/image?img=1,http://127.0.0.1:2522/image?img=1,\
+ *                http://127.0.0.1:2523/image?img=1 10 1000
+ * (one argument, no space after the comma) which gave round robin 3.6 s,
+ * p2c 0.75 s with 89% of the requests on the fastest server.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include "curl_share.h"
+#include "srv_pool.h"
+
+#define URLS "http://ece252-1.uwaterloo.ca:2520/image?img=1," \
+             "http://ece252-2.uwaterloo.ca:2520/image?img=1," \
+             "http://ece252-3.uwaterloo.ca:2520/image?img=1"
+
+struct bench {
+    struct srv_pool pool;
+    struct curl_share share;
+    int left;                   /* requests nobody has sent yet, shared */
+    struct sp_server all;       /* latency over every server */
+};
+
+static size_t discard(char *p, size_t size, size_t nmemb, void *userdata)
+{
+    (void) p;
+    (void) userdata;
+    return size * nmemb;
+}
+
+static void *fetcher(void *arg)
+{
+    struct bench *b = arg;
+    CURL *h = cs_easy(&b->share, b->pool.srv[0].url);
+
+    if (h == NULL) {
+        return NULL;
+    }
+    curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(h, CURLOPT_TIMEOUT_MS, SP_TIMEOUT_MS);
+    while (__atomic_sub_fetch(&b->left, 1, __ATOMIC_RELAXED) >= 0) {
+        int srv = sp_pick(&b->pool);
+        double t = sp_now();
+        long code = 0;
+        CURLcode res;
+
+        curl_easy_setopt(h, CURLOPT_URL, b->pool.srv[srv].url);
+        res = curl_easy_perform(h);
+        curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &code);
+        t = sp_now() - t;
+        sp_done(&b->pool, srv, t, res == CURLE_OK && code == 200);
+
+        pthread_mutex_lock(&b->pool.mutex);
+        b->all.hist[sp_bucket(t)]++;
+        pthread_mutex_unlock(&b->pool.mutex);
+    }
+    curl_easy_cleanup(h);
+    return NULL;
+}
+
+/**
+ * @brief send n_req requests from n_threads threads under one policy
+ * @return 0 on success; -1 otherwise
+ */
+static int run(const char *urls, enum sp_policy policy, int n_threads, int n_req)
+{
+    struct bench b;
+    pthread_t *tids = malloc(n_threads * sizeof(pthread_t));
+    double t;
+
+    memset(&b, 0, sizeof(b));
+    b.left = n_req;
+    if (tids == NULL || sp_init(&b.pool, urls, policy) != 0) {
+        free(tids);
+        return -1;
+    }
+    if (cs_init(&b.share) != 0) {
+        sp_cleanup(&b.pool);
+        free(tids);
+        return -1;
+    }
+
+    t = sp_now();
+    for (int i = 0; i < n_threads; i++) {
+        pthread_create(tids + i, NULL, fetcher, &b);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    t = sp_now() - t;
+
+    printf("%-12s %8.3f s %8.1f req/s  p50 %8.3f ms  p99 %8.3f ms\n",
+           policy == SP_RR ? "round robin" : "p2c", t, n_req / t,
+           1e3 * sp_quantile(&b.all, 0.5), 1e3 * sp_quantile(&b.all, 0.99));
+    sp_report(&b.pool, stdout);
+    printf("\n");
+
+    cs_cleanup(&b.share);
+    sp_cleanup(&b.pool);
+    free(tids);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *urls = argc > 1 ? argv[1] : URLS;
+    int n_threads = argc > 2 ? atoi(argv[2]) : 10;
+    int n_req = argc > 3 ? atoi(argv[3]) : 500;
+
+    if (n_threads <= 0 || n_req <= 0) {
+        fprintf(stderr, "Usage: %s [url[,url...]] [threads] [requests]\n", argv[0]);
+        return 1;
+    }
+    printf("%d requests from %d threads\n\n", n_req, n_threads);
+    if (run(urls, SP_RR, n_threads, n_req) != 0 ||
+        run(urls, SP_P2C, n_threads, n_req) != 0) {
+        return 1;
+    }
+    return 0;
+}
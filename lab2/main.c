@@ -27,12 +27,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <curl/curl.h>
 #include <stdint.h>
 #include <pthread.h>
 #include "helper.h"
+#include "par_zlib.h"
+#include "png_convert.h"
+#include "strip_cache.h"
+#include "frag_reg.h"
+#include "curl_share.h"
+#include "srv_pool.h"
+#include "png_push.h"
+#include "buf_pool.h"
 
 /******************************************************************************
  * DEFINED MACROS 
@@ -43,14 +52,20 @@
 /******************************************************************************
  * GLOBALS 
  *****************************************************************************/
-U8 gp_buf_def[BUF_LEN2]; /* output buffer for mem_def() */
-char* buffer[50]; // buffer of 50 buffer pointers
-
-#define IMG_URL "http://ece252-1.uwaterloo.ca:2520/image?img=1"
+struct frag_reg frags;      // the strips received so far, see frag_reg.h
+struct strip_cache *cache;  // NULL when caching is off, see sc_open()
+struct sc_hit *cached;      // strips found in the cache; png NULL if not
+
+#define N_STRIPS 50   /* fragments the server cuts an image into */
+#define N_HEDGE  10   /* extra fetchers for the last few strips */
+#define HEDGE_LEFT(n) (((n) + 4) / 5)  /* strips left when they join in */
+#define IMG_URL "http://ece252-1.uwaterloo.ca:2520/image?img=1," \
+                "http://ece252-2.uwaterloo.ca:2520/image?img=1," \
+                "http://ece252-3.uwaterloo.ca:2520/image?img=1"
 #define DUM_URL "https://example.com/"
 #define ECE252_HEADER "X-Ece252-Fragment: "
-#define BUF_SIZE 1048576  /* 1024*1024 = 1M */
-#define BUF_INC  524288   /* 1024*512  = 0.5M */
+#define CLEN_HEADER "Content-Length:"
+#define ABORT_MIN 65536   /* smaller duplicate bodies are drained, not aborted */
 
 #define max(a, b) \
    ({ __typeof__ (a) _a = (a); \
@@ -58,17 +73,53 @@ char* buffer[50]; // buffer of 50 buffer pointers
      _a > _b ? _a : _b; })
 
 typedef struct recv_buf2 {
-    char *buf;       /* memory to hold a copy of received data */
+    char *buf;       /* memory to hold a copy of received data, */
+                     /* NULL until the body starts to arrive */
     size_t size;     /* size of valid data in buf in bytes*/
     size_t max_size; /* max capacity of buf in bytes*/
+    struct buf_pool *pool;   /* where buf comes from, see buf_pool.h */
     int seq;         /* >=0 sequence number extracted from http header */
                      /* <0 indicates an invalid seq number */
+    struct frag_reg *frags;  /* a seq claimed here already is not kept, */
+                             /* see header_cb_curl(); NULL to keep all */
+    long clen;       /* body length the header announced, <0 if none */
+    int owned;       /* 1 if this transfer claimed seq, see frag_claim() */
+    int skip;        /* 1 if the body is let through but not kept */
+    int aborted;     /* 1 if the transfer stopped at the header */
+    struct png_push pp;  /* inflates an owned strip as it arrives */
 } RECV_BUF;
 
+struct canvas {                 /* the pasted image, filled as strips arrive */
+    pthread_mutex_t mutex;      /* for setting it up only */
+    struct data_IHDR ihdr;      /* of the first strip placed */
+    U64 strip_len;              /* scanline bytes of one such strip */
+    U8 *buf;                    /* a strip_len slot per seq; NULL until the
+                                   first strip but the last arrives */
+    U8 *in_place;               /* per seq, 1 once its slot is complete */
+} canvas = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+struct fetch_stats {            /* what the transfers bought, see report */
+    pthread_mutex_t mutex;
+    U64 kept;                   /* strips received and kept */
+    U64 dups;                   /* whole strips received and dropped */
+    U64 skipped;                /* bodies drained without a copy */
+    U64 aborted;                /* stopped at the header, no body */
+    U64 bytes_full;             /* body bytes of kept and dup transfers */
+    U64 bytes_drained;          /* of skipped ones */
+    U64 bytes_aborted;          /* announced by aborted ones */
+    U64 unknown_len;            /* aborted ones that announced no length */
+    double t_full;              /* seconds in kept and dup transfers */
+    double t_aborted;           /* seconds in aborted ones */
+} stats = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+struct bp_stats bufs;           /* of every fetcher's buffer pool */
+
 struct thread_args              /* thread input parameters struct */
 {
-    uint64_t *curr_mask;
-    uint64_t full_mask;
+    struct frag_reg *frags;
+    struct curl_share *share;       /* one transport for every thread */
+    struct srv_pool *pool;          /* which server gets each request */
+    int start_at;                   /* strips published before it starts */
     char* url;
 
 };
@@ -81,14 +132,17 @@ struct thread_ret               /* thread return values struct   */
 
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
-int recv_buf_init(RECV_BUF *ptr, size_t max_size);
+int recv_buf_init(RECV_BUF *ptr, struct buf_pool *pool);
 int recv_buf_cleanup(RECV_BUF *ptr);
 int write_file(const char *path, const void *in, size_t len);
 
 void clean_output_dir(char* folder);
-int concat_50();
+int concat_50(const char *url);
 int recv_buf_reset( RECV_BUF *ptr );
 void * get_image(void* args);
+void fetch_count(CURL *h, const RECV_BUF *p, double secs, int kept);
+U8 *canvas_place(void *ctx, const struct data_IHDR *ihdr);
+void fetch_report(FILE *fp);
 /**
  * @brief  cURL header call back function to extract image sequence number from 
  *         http header data. An example header for image part n (assume n = 2) is:
@@ -102,6 +156,12 @@ void * get_image(void* args);
  * header data are received.  we are only interested in the ECE252_HEADER line 
  * received so that we can extract the image sequence number from it. This
  * explains the if block in the code.
+ * Once the header is complete the transfer tries to claim its strip. If it
+ * wins, the body is inflated into the canvas while it arrives. If not, the
+ * strip is not wanted. A big body, or one of unknown length, is not received
+ * at all: returning 0 makes cURL abort the transfer. A small one costs less
+ * than the new connection aborting would take, so it is let through without
+ * being copied.
  */
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
 {
@@ -114,6 +174,19 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
         /* extract img sequence number */
 	p->seq = atoi(p_recv + strlen(ECE252_HEADER));
 
+    } else if (strncasecmp(p_recv, CLEN_HEADER, strlen(CLEN_HEADER)) == 0) {
+        p->clen = atol(p_recv + strlen(CLEN_HEADER));
+    } else if (realsize <= 2 && p->frags != NULL && p->seq >= 0) {
+        /* the blank line ending the header */
+        if (frag_claim(p->frags, p->seq)) {
+            p->owned = 1;
+            pp_init(&p->pp, canvas_place, p);
+        } else if (p->clen < 0 || p->clen > ABORT_MIN) {
+            p->aborted = 1;
+            return 0;
+        } else {
+            p->skip = 1;
+        }
     }
     return realsize;
 }
@@ -134,19 +207,29 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     size_t realsize = size * nmemb;
     RECV_BUF *p = (RECV_BUF *)p_userdata;
  
-    if (p->size + realsize + 1 > p->max_size) {/* hope this rarely happens */ 
-        /* received data is not 0 terminated, add one byte for terminating 0 */
-        size_t new_size = p->max_size + max(BUF_INC, realsize + 1);   
-        char *q = realloc(p->buf, new_size);
-        if (q == NULL) {
-            perror("realloc"); /* out of memory */
+    if (p->skip) {  /* a duplicate, see header_cb_curl() */
+        p->size += realsize;
+        return realsize;
+    }
+    if (p->owned) { /* a failure here is caught by pp_finish() */
+        pp_feed(&p->pp, (U8 *)p_recv, realsize);
+    }
+    if (p->size + realsize + 1 > p->max_size) {
+        /* received data is not 0 terminated, add one byte for terminating 0;
+           the first piece takes a buffer the size the header announced */
+        size_t need = p->size + realsize + 1;
+
+        if (p->buf == NULL) {
+            need = max(need, bp_expect(p->pool, p->clen));
+        }
+        if (bp_fit(p->pool, &p->buf, &p->max_size, p->size, need) != 0) {
+            perror("malloc"); /* out of memory */
             return -1;
         }
-        p->buf = q;
-        p->max_size = new_size;
     }
 
     memcpy(p->buf + p->size, p_recv, realsize); /*copy data from libcurl*/
+    p->pool->st.bytes_recv += realsize;
     p->size += realsize;
     p->buf[p->size] = 0;
 
@@ -154,30 +237,40 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
 }
 
 
-int recv_buf_init(RECV_BUF *ptr, size_t max_size)
+/**
+ * @brief set up a receive buffer; no memory is taken until a body arrives
+ * @param struct buf_pool *pool the thread's pool to take it from
+ */
+int recv_buf_init(RECV_BUF *ptr, struct buf_pool *pool)
 {
-    void *p = NULL;
-    
     if (ptr == NULL) {
         return 1;
     }
 
-    p = malloc(max_size);
-    if (p == NULL) {
-	return 2;
-    }
-    
-    ptr->buf = p;
+    ptr->buf = NULL;
     ptr->size = 0;
-    ptr->max_size = max_size;
+    ptr->max_size = 0;
+    ptr->pool = pool;
     ptr->seq = -1;              /* valid seq should be non-negative */
+    ptr->frags = NULL;
+    ptr->clen = -1;
+    ptr->owned = 0;
+    ptr->skip = 0;
+    ptr->aborted = 0;
     return 0;
 }
 
+/**
+ * @brief get ready for the next transfer; the buffer is kept as it is, the
+ *        write callback only ever reads what it wrote
+ */
 int recv_buf_reset( RECV_BUF *ptr ){
-    memset(ptr->buf, 0, ptr->max_size);
     ptr->size = 0;
     ptr->seq = -1;
+    ptr->clen = -1;
+    ptr->owned = 0;
+    ptr->skip = 0;
+    ptr->aborted = 0;
     return 0;
 }
 
@@ -187,7 +280,8 @@ int recv_buf_cleanup(RECV_BUF *ptr)
 	return 1;
     }
     
-    free(ptr->buf);
+    bp_put(ptr->pool, ptr->buf, ptr->max_size);
+    ptr->buf = NULL;
     ptr->size = 0;
     ptr->max_size = 0;
     return 0;
@@ -233,43 +327,93 @@ int main( int argc, char** argv )
 {
     int NUM_THREADS = 10; // hardcoded for now
 
-    uint64_t mask = 0;
-    uint64_t full_mask = ((uint64_t)1<<50)-1; 
-    pthread_t *p_tids = malloc(sizeof(pthread_t) * NUM_THREADS);
-    struct thread_args in_params[NUM_THREADS];
+    int n_strips = N_STRIPS;
+    struct curl_share share;
+    struct srv_pool pool;
+    const char *policy = getenv("SRV_POLICY");  // "rr" for round robin
+    pthread_t *p_tids = malloc(sizeof(pthread_t) * (NUM_THREADS + N_HEDGE));
+    struct thread_args in_params[NUM_THREADS + N_HEDGE];
     struct thread_ret *p_results[NUM_THREADS];
-    char url[256];
+    char url[1024];     // one or more URLs, separated by commas
 
 
-    if (argc == 1) {
-        strcpy(url, IMG_URL); 
-    } else {
-        strcpy(url, argv[1]);
+    snprintf(url, sizeof(url), "%s", argc == 1 ? IMG_URL : argv[1]);
+    if (argc > 2) {
+        n_strips = atoi(argv[2]);
+    }
+    if (n_strips <= 0 || frag_init(&frags, n_strips) != 0 ||
+        (cached = calloc(n_strips, sizeof(struct sc_hit))) == NULL ||
+        (canvas.in_place = calloc(n_strips, 1)) == NULL) {
+        fprintf(stderr, "Usage: %s [url[,url...] [number of strips]]\n", argv[0]);
+        return -1;
     }
 
     printf("%s: URL is %s\n", argv[0], url);
     
 //    clean_output_dir("./outputs/");
 
-    for (int i=0; i<NUM_THREADS; i++) {
-        in_params[i].curr_mask = &mask;
-        in_params[i].full_mask = full_mask;
+    // strips pasted before need no download, and maybe no inflate either
+    cache = sc_open(NULL);
+    for (int i=0; i<n_strips; i++) {
+        if (sc_get(cache, url, i, cached + i) && frag_claim(&frags, i)) {
+            frag_publish(&frags, i, cached[i].png, cached[i].png_len);
+        } else {
+            cached[i].png = NULL;
+        }
+    }
+    // threads to download the rest; the hedge threads sleep until only a
+    // few strips are missing, when most fetches bring duplicates and the
+    // wait for the last ones is what more requests in flight cut down
+    int n_fetch = frag_complete(&frags) ? 0 : NUM_THREADS + N_HEDGE;
+
+    if (n_fetch > 0 && (sp_init(&pool, url, policy && strcmp(policy, "rr") == 0 ? SP_RR : SP_P2C) != 0 ||
+                        cs_init(&share) != 0)) {
+        return -1;
+    }
+    for (int i=0; i<n_fetch; i++) {
+        in_params[i].frags = &frags;
+        in_params[i].share = &share;
+        in_params[i].pool = &pool;
+        in_params[i].start_at = i < NUM_THREADS ? 0 : n_strips - HEDGE_LEFT(n_strips);
         in_params[i].url = url;
         pthread_create(p_tids + i, NULL, get_image, in_params+i); 
     }
 
-    /* get it! */
-    for (int i=0; i<NUM_THREADS; i++) {
+    /* get it! the paste need not wait for transfers still in flight */
+    frag_wait(&frags);
+    if (n_fetch > 0) {
+        sp_close(&pool);    // no fetcher sleeps on an ejected server now
+    }
+
+    /* Concat images by sequence number */
+    concat_50(url);
+
+    for (int i=0; i<n_fetch; i++) {
      //   pthread_join(p_tids[i], (void **)&(p_results[i]));
         pthread_join(p_tids[i], NULL);
 //        printf("Thread ID %lu joined.\n", p_tids[i]);
         
     }
 
-    /* Concat images by sequence number */
-    // concate 50 png files
-    concat_50();
-
+    if (n_fetch > 0) {
+        cs_report(&share, stdout);
+        cs_cleanup(&share);
+        sp_report(&pool, stdout);
+        sp_cleanup(&pool);
+        fetch_report(stdout);
+        bp_report(&bufs, stats.kept, stdout);
+    }
+    sc_stats(cache, stdout);
+    for (int i=0; i<n_strips; i++) {
+        if (cached[i].png == NULL) {  // downloaded, not mapped from the cache
+            free((void *)frag_get(&frags, i, NULL));
+        }
+    }
+    sc_close(cache);
+    frag_cleanup(&frags);
+    free(canvas.buf);
+    free(canvas.in_place);
+    free(cached);
     free(p_tids);
     
     /* the memory was allocated in the do_work thread for return values */
@@ -286,24 +430,23 @@ void * get_image(void* args){
     CURLcode res;
     struct thread_args *p_in = args;
     RECV_BUF recv_buf;
+    struct buf_pool pool;       /* this thread's receive buffers */
     char fname[256];
     pid_t pid = getpid();
     
-    recv_buf_init(&recv_buf, BUF_SIZE);
+    bp_init(&pool);
+    recv_buf_init(&recv_buf, &pool);
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-
-    /* init a curl session */
-    curl_handle = curl_easy_init();
+    /* a curl session on the shared DNS, TLS and connection caches, kept
+       for every request of this thread */
+    curl_handle = cs_easy(p_in->share, p_in->pool->srv[0].url);
 
     if (curl_handle == NULL) {
-        fprintf(stderr, "curl_easy_init: returned NULL\n");
-        return -1;
+        recv_buf_cleanup(&recv_buf);
+        bp_cleanup(&pool);
+        return NULL;
     }
 
-    /* specify URL to get */
-    curl_easy_setopt(curl_handle, CURLOPT_URL, p_in->url);
-    
     /* register write call back function to process received data */
     curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3); 
     /* user defined data structure passed to the call back function */
@@ -314,43 +457,169 @@ void * get_image(void* args){
     /* user defined data structure passed to the call back function */
     curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&recv_buf);
 
-    /* some servers requires a user-agent field */
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-    
+    /* a server that hangs counts as failed, so the pool can eject it */
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT_MS, SP_TIMEOUT_MS);
 
-    res = curl_easy_perform(curl_handle);
-        
-    //printf("curr_mask: %lu, ");
-    while(*p_in->curr_mask != p_in->full_mask){  
+    /* strips owned already are not downloaded again, see header_cb_curl() */
+    recv_buf.frags = p_in->frags;
+
+    /* a hedge thread sleeps until the collection gets to its slow end */
+    frag_wait_for(p_in->frags, p_in->start_at);
+
+    while(!frag_complete(p_in->frags)){  
+
+        int srv = sp_pick(p_in->pool);
+        long code = 0;
+        double secs = 0;
 
         recv_buf_reset( &recv_buf ); // clear buffer every time
+        curl_easy_setopt(curl_handle, CURLOPT_URL, p_in->pool->srv[srv].url);
         res = curl_easy_perform(curl_handle);
-
-        if( res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        } else {
+        cs_account(p_in->share, curl_handle);
+        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &code);
+        curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME, &secs);
+        sp_done(p_in->pool, srv, secs, (res == CURLE_OK || recv_buf.aborted) &&
+                code == 200 && recv_buf.seq >= 0 && recv_buf.seq < p_in->frags->n);
+
+        if (recv_buf.aborted || (res == CURLE_OK && recv_buf.skip)) {
+            fetch_count(curl_handle, &recv_buf, secs, 0);
+        } else if (recv_buf.owned) {
 	        // printf("%lu bytes received in memory %p, seq=%d.\n", recv_buf.size, recv_buf.buf, recv_buf.seq);
-            if( 0 == ( (uint64_t) *p_in->curr_mask & ((uint64_t)1<< recv_buf.seq)) ){  
-                *(p_in->curr_mask) |= (uint64_t)1 << recv_buf.seq;
-                //sprintf(fname, "./outputs/%d.png", recv_buf.seq);
-                int id = recv_buf.seq;
-                buffer[id] = malloc( recv_buf.size );
-                memcpy(buffer[id], recv_buf.buf, recv_buf.size);
-                //write_file(fname, recv_buf.buf, recv_buf.size);
-//                printf("MASK: %lu\n", *p_in->curr_mask );
+            // the strip is ours since its header; its scanlines are in the
+            // canvas already if they fitted there and came out whole
+            int placed = pp_finish(&recv_buf.pp, NULL) == Z_OK && recv_buf.pp.dest != NULL;
+
+            pp_cleanup(&recv_buf.pp);
+            if (res != CURLE_OK || code != 200 || recv_buf.size == 0) {
+                if (res != CURLE_OK) {
+                    fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+                }
+                frag_release(p_in->frags, recv_buf.seq);  // for another fetcher
+                continue;
             }
+            canvas.in_place[recv_buf.seq] = placed;
+            fetch_count(curl_handle, &recv_buf, secs, 1);
+
+            // the buffer itself is handed over, the next body takes another
+            bp_seen(&pool, recv_buf.size + 1);
+            frag_publish(p_in->frags, recv_buf.seq, (U8 *)recv_buf.buf, recv_buf.size);
+            bp_give(&pool);
+            recv_buf.buf = NULL;
+            recv_buf.max_size = 0;
+        } else if( res != CURLE_OK) {
+            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        } else {
+            fetch_count(curl_handle, &recv_buf, secs, 0);  // no strip in it
         }
     }
 
-        /* cleaning up */
+        /* cleaning up, libcurl itself goes in cs_cleanup() */
     curl_easy_cleanup(curl_handle);
-    curl_global_cleanup();
     recv_buf_cleanup(&recv_buf);
+    bp_cleanup(&pool);
+    bp_stats_add(&bufs, &pool.st);
     pthread_exit(0);
         
   //  return ((void *)p_out);
     }
 
+/**
+ * @brief add a finished transfer to the fetch statistics
+ * @param CURL *h the handle it ran on
+ * @param const RECV_BUF *p what it received
+ * @param double secs how long it took
+ * @param int kept 1 if its strip was new and is kept
+ */
+void fetch_count(CURL *h, const RECV_BUF *p, double secs, int kept)
+{
+    curl_off_t len = -1;
+
+    curl_easy_getinfo(h, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len);
+
+    pthread_mutex_lock(&stats.mutex);
+    if (p->aborted) {
+        stats.aborted++;
+        stats.t_aborted += secs;
+        if (len >= 0) {
+            stats.bytes_aborted += len;
+        } else {
+            stats.unknown_len++;    /* the strip came before the length */
+        }
+    } else if (p->skip) {
+        stats.skipped++;
+        stats.bytes_drained += p->size;
+    } else {
+        stats.kept += kept;
+        stats.dups += !kept;
+        stats.bytes_full += p->size;
+        stats.t_full += secs;
+    }
+    pthread_mutex_unlock(&stats.mutex);
+}
+
+/**
+ * @brief print where the transfers went and what dropping duplicates at the
+ *        header saved: the bodies not received, or not copied, and the time
+ *        a whole transfer takes on average minus what the aborted ones took
+ */
+void fetch_report(FILE *fp)
+{
+    U64 full = stats.kept + stats.dups;
+    int streamed = 0;
+    double size = full ? (double)stats.bytes_full / full : 0;
+    double t_saved = stats.aborted * (full ? stats.t_full / full : 0) - stats.t_aborted;
+
+    fprintf(fp, "fetch: %lu strips kept, %lu duplicates received whole, %lu drained "
+            "uncopied, %lu aborted at the header\n",
+            stats.kept, stats.dups, stats.skipped, stats.aborted);
+    fprintf(fp, "fetch: aborting saved %.1f KB of bodies and %.3f s of transfers, "
+            "draining %.1f KB of copies\n",
+            (stats.bytes_aborted + stats.unknown_len * size) / 1024,
+            t_saved > 0 ? t_saved : 0, stats.bytes_drained / 1024.0);
+    for (int i = 0; i < frags.n; i++) {
+        streamed += canvas.in_place[i];
+    }
+    fprintf(fp, "fetch: %d of %lu strips inflated while they downloaded\n",
+            streamed, stats.kept);
+}
+
+/**
+ * @brief pp_place_fn for the strip a transfer owns: its slot in the canvas,
+ *        seq strips of the first one's size down. The first strip in sets
+ *        the canvas up, unless it is the last strip, which may be shorter
+ *        or taller than the rest.
+ * @param void *ctx the RECV_BUF of the transfer
+ * @return where its scanlines go; NULL if it does not fit, then concat_50()
+ *         inflates it from the png as before
+ */
+U8 *canvas_place(void *ctx, const struct data_IHDR *ihdr)
+{
+    RECV_BUF *p = ctx;
+    struct data_IHDR h = *ihdr;
+    int last = (p->seq == frags.n - 1);
+    U64 len = png_raw_size(&h);
+
+    if (h.interlace != 0 || png_row_bytes(&h) == 0) {
+        return NULL;    /* such strips are pasted through png_convert.h */
+    }
+    pthread_mutex_lock(&canvas.mutex);
+    if (canvas.buf == NULL && (!last || frags.n == 1)) {
+        canvas.buf = malloc(len * frags.n);
+        if (canvas.buf == NULL) {
+            perror("malloc");
+        }
+        canvas.ihdr = h;
+        canvas.strip_len = len;
+    }
+    pthread_mutex_unlock(&canvas.mutex);
+
+    if (canvas.buf == NULL || !px_same_rows(&h, &canvas.ihdr) ||
+        (last ? len > canvas.strip_len : len != canvas.strip_len)) {
+        return NULL;
+    }
+    return canvas.buf + (U64)p->seq * canvas.strip_len;
+}
+
 void clean_output_dir(char* folder){
     DIR *p_dir = opendir(folder);
     struct dirent *p_dirent;
@@ -373,100 +642,106 @@ void clean_output_dir(char* folder){
 }
 
 
-int concat_50(){
+int concat_50(const char *url){
     int ret = 0;          /* return value for various routines             */
     U64 len_def = 0;      /* compressed data length                        */
-    U64 len_inf = 0;      /* uncompressed data length                      */
     U64 len_concat = 0; // length of concatenated data uncompressed
-    int concat_height = 0;
-    U32 crc_val = 0;
-
-    U64 inf_buf_size = BUF_LEN2;
-    char path[100] = {0};
-
-    U8* gp_buf_inf = malloc(inf_buf_size);
-    memset(gp_buf_inf, 0, inf_buf_size);
-    memset(gp_buf_def, 0, BUF_LEN2);
-    
+    U32 crc_def = 0;      /* crc() of gp_buf_def, from par_def() */
+    struct data_IHDR ihdr;
+    int convert;          /* 1: the strips differ in format, see px_target() */
 
-    // LOOP writting uncompressed IDAT to file then recompress and look at length and ntoh length and ad length field to IHDR and make IEND data
-    for(int i=0; i < 50; i++){
+    int n = frags.n;
+    struct strip *strips = calloc(n, sizeof(struct strip));
+    int n_threads = par_threads(0);
 
-        struct chunk data;
+    if (strips == NULL) {
+        perror("calloc");
+        return -1;
+    }
 
-        get_png_data_IDAT( &data, buffer[i]);
-        concat_height = concat_height + get_height(buffer[i]);
-        // resize array if we are nearly full or predicted to go over capacity given an average inflation sizae of ~24 times
-        if(len_concat+data.length*23 > inf_buf_size){
-            gp_buf_inf = (U8 *) realloc(gp_buf_inf, (len_concat+data.length*24)*2 );
-            inf_buf_size = (len_concat+data.length*23)*2;
-        }
+    // inflate every strip on its own worker straight into its rows of gp_buf_inf
+    for(int i=0; i < n; i++){
+        strips[i].png = frag_get(&frags, i, &strips[i].png_len);
+    }
+    if (strips_layout(strips, n, &len_concat) != 0) {
+        free(strips);
+        return -1;
+    }
+    // scanlines from the cache are copied, not inflated
+    for(int i=0; i < n; i++){
+        strips[i].raw = (cached[i].png != NULL && cached[i].raw_len == strips[i].raw_len) ?
+                        cached[i].raw : NULL;
+    }
+    // the first strip's IHDR with the height of the whole stack, or a format
+    // every strip converts to if they differ
+    convert = px_target(&ihdr, strips, n);
+    if (convert < 0) {
+        free(strips);
+        return -1;
+    } else if (convert) {
+        len_concat = png_raw_size(&ihdr);
+    }
 
-        ret = mem_inf(gp_buf_inf + len_concat, &len_inf, data.p_data, data.length);
-        if (ret == 0) { /* success */
-//            printf("original len = %d, len_inf = %lu\n", data.length, len_inf);
-        } else { /* failure */
-            fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
-            return ret;
+    // the strips inflated as they arrived are in the canvas already; it is
+    // the output if that is where the layout puts them too, i.e. all but
+    // maybe the last strip are of one size. A taller last strip grows it.
+    int reuse = !convert && canvas.buf != NULL;
+    for(int i=0; i < n && reuse; i++){
+        reuse = !canvas.in_place[i] || strips[i].offset == (U64)i * canvas.strip_len;
+    }
+    U8* gp_buf_inf = NULL;
+    if (reuse) {
+        gp_buf_inf = len_concat > n * canvas.strip_len ? realloc(canvas.buf, len_concat) : canvas.buf;
+        if (gp_buf_inf != NULL) {
+            canvas.buf = NULL;
+            for(int i=0; i < n; i++){
+                strips[i].in_place = canvas.in_place[i];
+            }
         }
+    } else {
+        gp_buf_inf = malloc(len_concat);
+    }
+    U8* gp_buf_def = malloc(par_def_bound(len_concat));
+    if (gp_buf_inf == NULL || gp_buf_def == NULL) {
+        perror("malloc");
+        ret = -1;
+        goto out;
+    }
 
-        len_concat = len_concat + len_inf;
-//        fclose(fp);
+    ret = convert ? px_paste_strips(gp_buf_inf, &ihdr, strips, n, n_threads)
+                  : par_inf_strips(gp_buf_inf, strips, n, n_threads);
+    if (ret != 0) { /* failure */
+        fprintf(stderr,"mem_inf failed. ret = %d.\n", ret);
+        goto out;
+    }
 
+    // remember what was downloaded or inflated this time; converted
+    // scanlines are not the strip's own, so those keep the png alone
+    for(int i=0; i < n && cache != NULL; i++){
+        if (cached[i].png == NULL || (strips[i].raw == NULL && !convert)) {
+            sc_put(cache, url, i, strips[i].png, strips[i].png_len,
+                   convert ? NULL : gp_buf_inf + strips[i].offset, strips[i].raw_len);
+        }
     }
 
-    ret = mem_def(gp_buf_def, &len_def, gp_buf_inf, len_concat, Z_DEFAULT_COMPRESSION);
+    // deflate in independent blocks on all cores and stitch them into one stream
+    ret = par_def(gp_buf_def, par_def_bound(len_concat), &len_def, &crc_def, gp_buf_inf,
+                  len_concat, Z_DEFAULT_COMPRESSION, n_threads);
     if (ret == 0) { /* success */
         printf("len inf all together = %ld, len_def = %lu\n", \
                len_concat, len_def);
     } else { /* failure */
         fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
+        goto out;
     }
 
-    FILE* bp = fopen("concat.png", "wb+");
+    // IHDR, IDAT and IEND, all in one write
+    ret = png_write("concat.png", &ihdr, gp_buf_def, len_def, &crc_def);
 
-    // write png sig to file copying from the first png
-    // make sure at least one arg 
-//    FILE* fp = fopen("./outputs/0.png", "rb");                  // DO NOT DELETE
-    
-    // copy ihdr from the first file into the new png that will be created so it has all the same info   
- //   char bytes[33]; // make dynamic to free]
- //   fread(bytes, 33, 1, fp); // read 33 bytes into buffer bytes
-    fwrite(buffer[0], 33, 1, bp);
-    //write height to file
-    fseek(bp, 20, SEEK_SET);
-    concat_height = ntohl(concat_height);
-    fwrite( &concat_height, 4, 1, bp);
-    // calculate crc for ihdr and add
-    fseek(bp, 12, SEEK_SET); // seek to ihdr data field
-    fread(buffer[0], 17, 1, bp); // read the ihdr data field (13 bytes)
-    crc_val = htonl(crc(buffer[0], 17));
-    fseek(bp, 29, SEEK_SET);    // go to crc position
-    fwrite( &crc_val, 4, 1, bp); //write crc data
-
-    // add IDAT data length and chunk type along with data
-    unsigned char idat[4] = { 'I', 'D', 'A', 'T'};
-    /* merge idat chunk type and deflated data */
-    U8* idat_crc_buf = malloc(len_def + 4);
-    memcpy(idat_crc_buf, idat, 4); // copy chars into crc buffer
-    memcpy(idat_crc_buf+4, gp_buf_def, len_def); // copy chars into crc buffer
-    len_def = htonl(len_def);
-    fwrite(&len_def, 4,1,bp); // write length of idat chunk
-    len_def = ntohl(len_def);
-    fwrite(idat_crc_buf, len_def+4,1,bp);
-
-    crc_val = htonl( crc(idat_crc_buf, len_def+4) ); // CRC USES TYPE AND DATA FIELD
-    fwrite(&crc_val, 4,1,bp); // write compressed binary data 
-    
-    // ADD IEND DATA AND FIX HEIGHT VALUE IN CORRECT ENDIANESS -> try pnginfo function and opening file 
-    // iend = 4 bytes of 0 + "IEND" + crc
-    unsigned char iend[8] = {0, 0, 0, 0, 'I', 'E', 'N', 'D'};
-    fwrite(iend, 8,1,bp);
-    crc_val = htonl(crc(&iend[4], 4));
-    fwrite(&crc_val, 4,1,bp); // write proper crc
-    
     /* Clean up */
-    free(idat_crc_buf);
-    fclose(bp);
-    return 0;
+out:
+    free(strips);
+    free(gp_buf_inf);
+    free(gp_buf_def);
+    return ret;
 }
\ No newline at end of file
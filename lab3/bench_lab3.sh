@@ -0,0 +1,188 @@
+#!/bin/bash
+############################################################################
+# File Name  : bench_lab3.sh
+# Usage      : ./bench_lab3.sh [-n runs] [-o csv] [-u url] [-b baseline.csv] <N>
+#              B, P, C and X may be set in the environment to other lists,
+#              e.g. B="5" P="1 2 4" C="1 2 4" X="0" ./bench_lab3.sh 1
+#              STUB="python3 stub.py 2520" starts stub.py, a local image
+#              server, for the sweep and stops it after; -u then points at
+#              it, e.g. -u http://127.0.0.1:2520/image. See stub.py for
+#              its sleep and strip count.
+# Description: runs paster2 runs times for every (B,P,C,X,N) of the sweep
+#              that run_lab3.sh runs and writes one line each to the csv,
+#              lab3_eceubuntu1.csv by default:
+#  -------------------------------------------
+#  B,P,C,X,N,Time,Stddev,P95,Fetch,Wait,Inflate,Deflate,Write
+#  -------------------------------------------
+#              Time, Stddev and P95 are of the wall time paster2 prints on
+#              its last line; the phases are the means of the seconds it
+#              prints on the line before, summed over its processes.
+#              A speedup table against P=1, C=1 at the same B and X goes
+#              to stdout. With -b, every configuration more than THRESH
+#              percent (10) slower than in the baseline csv is reported
+#              and the exit status is 1.
+#############################################################################
+PROG="./paster2"
+B=${B:-"5 10"}
+P=${P:-"1 5 10"}
+C=${C:-"1 5 10"}
+X=${X:-"0 200 400"}
+NN=5
+THRESH=${THRESH:-10}
+CSV="lab3_eceubuntu1.csv"
+URL=""
+BASE=""
+
+usage ()
+{
+    echo "Usage: $0 [-n runs] [-o csv] [-u url] [-b baseline.csv] <N>"
+    echo "  N: image number, 1, 2 or 3"
+    exit 1
+}
+
+while getopts "n:o:u:b:" opt
+do
+    case $opt in
+        n) NN=$OPTARG ;;
+        o) CSV=$OPTARG ;;
+        u) URL=$OPTARG ;;
+        b) BASE=$OPTARG ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ] || [ ! -x "$PROG" ]; then
+    usage
+fi
+IMG=$1
+
+if [ -n "$STUB" ]; then
+    $STUB &
+    STUB_PID=$!
+    # up once it answers; it cuts its strips first
+    for xx in `seq 50`
+    do
+        if [ -z "$URL" ] || curl -s -o /dev/null "$URL"; then
+            break
+        fi
+        sleep 0.2
+    done
+fi
+
+TMP=`mktemp -d`
+trap 'rm -rf $TMP; [ -n "$STUB_PID" ] && kill $STUB_PID 2> /dev/null' EXIT
+
+# one line per run: the wall time, then the five phases
+run_pair ()
+{
+    O_FILE="$TMP/B$1_P$2_C$3_X$4_N$5.dat"
+    for xx in `seq $NN`
+    do
+        # every run fetches, a STRIP_CACHE exported by the caller would hide
+        # the network
+        env -u STRIP_CACHE $PROG $1 $2 $3 $4 $5 $URL > "$TMP/out" 2> /dev/null
+        if [ $? -ne 0 ] || [ ! -s all.png ]; then
+            echo "B=$1 P=$2 C=$3 X=$4 N=$5: paster2 failed" >&2
+            continue
+        fi
+        awk '/^paster2 phases:/ {ph = $4 " " $6 " " $8 " " $10 " " $12}
+             /^paster2 execution time:/ {t = $4}
+             END {print t, ph}' "$TMP/out" >> $O_FILE
+        rm -f all.png
+    done
+}
+
+# mean, sample stddev and nearest rank p95 of the times, means of the phases
+gen_stat_per_pair ()
+{
+    sort -n "$1" | awk '
+    {
+        t[NR] = $1; sum += $1; sumsq += $1 * $1
+        for (i = 2; i <= 6; i++) ph[i] += $i
+    }
+    END {
+        if (NR == 0) { print "nan,nan,nan,nan,nan,nan,nan,nan"; exit }
+        mean = sum / NR
+        var = NR > 1 ? (sumsq - NR * mean * mean) / (NR - 1) : 0
+        k = int(0.95 * NR); if (k < 0.95 * NR) k++
+        printf("%.6f,%.6f,%.6f", mean, var > 0 ? sqrt(var) : 0, t[k])
+        for (i = 2; i <= 6; i++) printf(",%.6f", ph[i] / NR)
+        printf("\n")
+    }'
+}
+
+printf 'B,P,C,X,N,Time,Stddev,P95,Fetch,Wait,Inflate,Deflate,Write\n' > $CSV
+for x in $X
+do
+    for b in $B
+    do
+        for p in $P
+        do
+            if [ $p -gt $(($b+1)) ]; then
+                break
+            fi
+            for c in $C
+            do
+                if [ $c -gt $(($b+1)) ]; then
+                    break
+                fi
+                run_pair $b $p $c $x $IMG
+                printf '%d,%d,%d,%d,%d,' $b $p $c $x $IMG >> $CSV
+                gen_stat_per_pair "$TMP/B${b}_P${p}_C${c}_X${x}_N${IMG}.dat" >> $CSV
+                tail -1 $CSV
+            done
+        done
+    done
+done
+
+# speedup of each P,C over P=1,C=1 at the same B and X
+echo
+awk -F, -v plist="$P" -v clist="$C" '
+BEGIN {
+    np = split(plist, ps, " ")
+    nc = split(clist, cs, " ")
+}
+NR > 1 {
+    key = $1 "," $4
+    t[key, $2, $3] = $6
+    if (!(key in seen)) { seen[key] = 1; keys[++n] = key }
+}
+END {
+    for (k = 1; k <= n; k++) {
+        split(keys[k], bx, ",")
+        printf("speedup over P=1,C=1 at B=%s X=%s\n", bx[1], bx[2])
+        printf("%6s", "P\\C")
+        for (j = 1; j <= nc; j++) printf("%8s", cs[j])
+        printf("\n")
+        for (i = 1; i <= np; i++) {
+            p = ps[i]
+            printf("%6s", p)
+            for (j = 1; j <= nc; j++) {
+                c = cs[j]
+                one = t[keys[k], 1, 1]
+                if ((keys[k], p, c) in t && one > 0 && t[keys[k], p, c] > 0)
+                    printf("%8.2f", one / t[keys[k], p, c])
+                else
+                    printf("%8s", "-")
+            }
+            printf("\n")
+        }
+        printf("\n")
+    }
+}' $CSV
+
+# configurations slower than in the baseline
+if [ -n "$BASE" ]; then
+    awk -F, -v thresh=$THRESH '
+    FNR == 1 { next }
+    NR == FNR { base[$1, $2, $3, $4, $5] = $6; next }
+    ($1, $2, $3, $4, $5) in base && base[$1, $2, $3, $4, $5] > 0 {
+        slower = 100 * ($6 / base[$1, $2, $3, $4, $5] - 1)
+        if (slower > thresh) {
+            printf("regression B=%s P=%s C=%s X=%s N=%s: %.6f s, was %.6f s (+%.0f%%)\n",
+                   $1, $2, $3, $4, $5, $6, base[$1, $2, $3, $4, $5], slower)
+            bad = 1
+        }
+    }
+    END { exit bad }' "$BASE" $CSV || exit 1
+fi
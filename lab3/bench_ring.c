@@ -0,0 +1,227 @@
+/**
+ * @brief benchmark of the shm_ring.h queue against the semaphore guarded
+ *        shm_stack.h stack it replaced: P producer processes push small
+ *        items that C consumer processes pop, through each in turn, and the
+ *        operations per second of each are printed for every P and C
+ * To execute: ./bench_ring [max processes] [items] [capacity]
+ * P and C go through the powers of 2 up to max processes, 16 by default.
+ * The stack is used the way paster2 used it: a counting semaphore for the
+ * room left, one for the items in and one as a mutex, shared by fork().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "lab_png.h"
+#include "shm_ring.h"
+#include "shm_stack.h"
+
+#define PAYLOAD 64        /* bytes per item, besides its number */
+
+struct item {
+    int seq;
+    U32 size;
+    char data[PAYLOAD];
+};
+
+struct shared {                 /* what the processes of one run share */
+    sem_t empty;                /* for the stack: room left */
+    sem_t full;                 /* items in */
+    sem_t mutex;
+    long taken;                 /* items the consumers have claimed */
+    long sum;                   /* of the numbers they popped, to check */
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief memory shared with the children, removed once all detach
+ */
+static void *shm_alloc(size_t len)
+{
+    int id = shmget(IPC_PRIVATE, len, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    void *p;
+
+    if (id == -1) {
+        perror("shmget");
+        exit(1);
+    }
+    p = shmat(id, NULL, 0);
+    shmctl(id, IPC_RMID, NULL);
+    if (p == (void *)-1) {
+        perror("shmat");
+        exit(1);
+    }
+    return p;
+}
+
+static void stack_producer(ISTACK *stack, struct shared *sh, int from, int to)
+{
+    struct item it;
+    RECV_BUF rb = { .buf = (char *)&it, .size = sizeof(it) };
+
+    memset(&it, 0, sizeof(it));
+    for (int i = from; i < to; i++) {
+        it.seq = i;
+        rb.seq = i;
+        sem_wait(&sh->empty);
+        sem_wait(&sh->mutex);
+        push(stack, rb);
+        sem_post(&sh->mutex);
+        sem_post(&sh->full);
+    }
+}
+
+static void stack_consumer(ISTACK *stack, struct shared *sh, long n)
+{
+    struct item it;
+    RECV_BUF rb;
+    long sum = 0;
+
+    while (__atomic_fetch_add(&sh->taken, 1, __ATOMIC_RELAXED) < n) {
+        sem_wait(&sh->full);
+        sem_wait(&sh->mutex);
+        if (pop(stack, &rb) == 0) {
+            memcpy(&it, rb.buf, sizeof(it));
+            sum += it.seq;
+        }
+        sem_post(&sh->mutex);
+        sem_post(&sh->empty);
+    }
+    __atomic_fetch_add(&sh->sum, sum, __ATOMIC_RELAXED);
+}
+
+static void ring_producer(struct shm_ring *ring, int from, int to)
+{
+    struct item it;
+
+    memset(&it, 0, sizeof(it));
+    for (int i = from; i < to; i++) {
+        it.seq = i;
+        ring_push(ring, &it);
+    }
+    ring_done(ring);
+}
+
+static void ring_consumer(struct shm_ring *ring, struct shared *sh)
+{
+    struct item it;
+    long sum = 0;
+
+    while (ring_pop(ring, &it) == 0) {
+        sum += it.seq;
+    }
+    __atomic_fetch_add(&sh->sum, sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief pass n items from n_prod producers to n_cons consumers
+ * @param int use_ring 1 for the ring, 0 for the stack
+ * @return items per second; 0 if an item got lost or came twice
+ */
+static double run(int use_ring, int n_prod, int n_cons, int n, int cap)
+{
+    struct shared *sh = shm_alloc(sizeof(struct shared));
+    void *q = shm_alloc(use_ring ? ring_bytes(cap, sizeof(struct item)) : sizeof_shm_stack(cap));
+    int go[2];
+    char c;
+    double t;
+
+    memset(sh, 0, sizeof(*sh));
+    sem_init(&sh->empty, 1, cap);
+    sem_init(&sh->full, 1, 0);
+    sem_init(&sh->mutex, 1, 1);
+    if (use_ring) {
+        ring_init(q, cap, sizeof(struct item), n_prod);
+    } else {
+        init_shm_stack(q, cap);
+    }
+    if (pipe(go) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    for (int i = 0; i < n_prod + n_cons; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        } else if (pid == 0) {
+            close(go[1]);
+            if (read(go[0], &c, 1) != 0) {  /* everyone starts together */
+                _exit(1);
+            }
+            if (i < n_prod) {
+                int from = (long)n * i / n_prod;
+                int to = (long)n * (i + 1) / n_prod;
+
+                if (use_ring) {
+                    ring_producer(q, from, to);
+                } else {
+                    stack_producer(q, sh, from, to);
+                }
+            } else if (use_ring) {
+                ring_consumer(q, sh);
+            } else {
+                stack_consumer(q, sh, n);
+            }
+            _exit(0);   /* no atexit, no stdio buffers flushed twice */
+        }
+    }
+    close(go[0]);
+    t = now();
+    close(go[1]);
+    while (wait(NULL) > 0) {
+    }
+    t = now() - t;
+
+    if (!use_ring) {
+        shmdt(((ISTACK *)q)->buf);
+    }
+    sem_destroy(&sh->empty);
+    sem_destroy(&sh->full);
+    sem_destroy(&sh->mutex);
+    c = sh->sum == (long)n * (n - 1) / 2;
+    shmdt(q);
+    shmdt(sh);
+    return c ? n / t : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int max_procs = argc > 1 ? atoi(argv[1]) : 16;
+    int n = argc > 2 ? atoi(argv[2]) : 100000;
+    int cap = argc > 3 ? atoi(argv[3]) : 4;
+
+    if (max_procs <= 0 || n <= 0 || cap <= 0) {
+        fprintf(stderr, "Usage: %s [max processes] [items] [capacity]\n", argv[0]);
+        return 1;
+    }
+    printf("%d items of %zu bytes, capacity %d, %ld CPUs\n\n", n, sizeof(struct item),
+           cap, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%3s %3s %14s %14s %8s\n", "P", "C", "sem stack/s", "ring/s", "ring x");
+    for (int p = 1; p <= max_procs; p *= 2) {
+        for (int c = 1; c <= max_procs; c *= 2) {
+            double s = run(0, p, c, n, cap);
+            double r = run(1, p, c, n, cap);
+
+            printf("%3d %3d %14.0f %14.0f %8.2f%s\n", p, c, s, r, s > 0 ? r / s : 0,
+                   s > 0 && r > 0 ? "" : "  items lost");
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
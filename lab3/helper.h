@@ -22,17 +22,15 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include "zlib.h"
+#include "lab_png.h"
+#include "crc.h"
+#include "zcodec.h"  /* for mem_def() and mem_inf() */
+#include "png_write.h" /* for png_write() */
 
 /******************************************************************************
  * DEFINED MACROS 
  *****************************************************************************/
 
-#define PNG_SIG_SIZE    8 /* number of bytes of png image signature data */
-#define CHUNK_LEN_SIZE  4 /* chunk length field size in bytes */          
-#define CHUNK_TYPE_SIZE 4 /* chunk type field size in bytes */
-#define CHUNK_CRC_SIZE  4 /* chunk CRC field size in bytes */
-#define DATA_IHDR_SIZE 13 /* IHDR chunk data field size */
-
 #if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
 #  include <fcntl.h>
 #  include <io.h>
@@ -43,43 +41,6 @@
 
 #define CHUNK 16384  /* =256*64 on the order of 128K or 256K should be used */
 
-/*************************************************************************
- * STRUCTURES and TYPEDEFS 
-*****************************************************************************/
-typedef unsigned char U8;
-typedef unsigned int  U32;
-typedef unsigned long int U64;
-
-typedef struct chunk {
-    U32 length;  /* length of data in the chunk, host byte order */
-    U8  type[4]; /* chunk type */
-    U8  *p_data; /* pointer to location where the actual data are */
-    U32 crc;     /* CRC field  */
-} *chunk_p;
-
-/* note that there are 13 Bytes valid data, compiler will padd 3 bytes to make
-   the structure 16 Bytes due to alignment. So do not use the size of this
-   structure as the actual data size, use 13 Bytes (i.e DATA_IHDR_SIZE macro).
- */
-typedef struct data_IHDR {// IHDR chunk data 
-    U32 width;        /* width in pixels, big endian   */
-    U32 height;       /* height in pixels, big endian  */
-    U8  bit_depth;    /* num of bits per sample or per palette index.
-                         valid values are: 1, 2, 4, 8, 16 */
-    U8  color_type;   /* =0: Grayscale; =2: Truecolor; =3 Indexed-color
-                         =4: Greyscale with alpha; =6: Truecolor with alpha */
-    U8  compression;  /* only method 0 is defined for now */
-    U8  filter;       /* only method 0 is defined for now */
-    U8  interlace;    /* =0: no interlace; =1: Adam7 interlace */
-} *data_IHDR_p;
-
-/* A simple PNG file format, three chunks only*/
-typedef struct simple_PNG {
-    struct chunk *p_IHDR;
-    struct chunk *p_IDAT;  /* only handles one IDAT chunk */  
-    struct chunk *p_IEND;
-} *simple_PNG_p;
-
 /******************************************************************************
  * FUNCTION PROTOTYPES 
  *****************************************************************************/
@@ -87,8 +48,6 @@ int is_png(U8 *buf);
 int get_png_height(struct data_IHDR *buf);
 int get_png_width(struct data_IHDR *buf);
 int get_png_data_IHDR(struct data_IHDR *out, FILE *fp);
-int get_png_data_IDAT(struct chunk *out, char* bp);
-int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level);
 void zerr(int ret);
 int filetype(char *filepath);
 
@@ -185,28 +144,6 @@ int get_png_data_IHDR(struct data_IHDR *out, FILE *fp) {
     return 0;
 }
 
-int get_png_data_IDAT(struct chunk *out, char* bp){
-
-//    fseek(fp, 33 , SEEK_SET);
-    // read idat data length and make sure chunk type is idat
-    // 4 Bytes idat length
-//    fread( &(out->length) , sizeof(U32), 1, fp); // read chunk data length
-    memcpy(&(out->length), bp+33, sizeof(U32));
-    out->length = htonl(out->length);
-//    fread( &(out->type) , sizeof(U32), 1, fp);
-    memcpy(&(out->type), bp+37, sizeof(U32));
-    out->p_data = malloc( out->length ); // malloc(256*16)
-    
- //   fread( out->p_data , out->length, 1, fp);
-    memcpy(out->p_data, bp+41, out->length);
-    // 4B crc
-//    fread( &(out->crc) , sizeof(U32), 1, fp);
-    memcpy(&(out->crc), bp+(41+out->length), sizeof(U32));
-
-    
-    return 0;
-}
-
 void resize(U8** buffer, long int *size){
 
     U8* tmp = (U8*) malloc( (*size)*2 );
@@ -230,104 +167,6 @@ int get_height(char* bp){
 }
 
 
-int mem_def(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len, int level)
-{
-    z_stream strm;    /* pass info. to and from zlib routines   */
-    U8 out[CHUNK];    /* output buffer for deflate()            */
-    int ret = 0;      /* zlib return code                       */
-    int have = 0;     /* amount of data returned from deflate() */
-    int def_len = 0;  /* accumulated deflated data length       */
-    U8 *p_dest = dest;/* first empty slot in dest buffer        */
-    
-    strm.zalloc = Z_NULL;
-    strm.zfree  = Z_NULL;
-    strm.opaque = Z_NULL;
-
-    ret = deflateInit(&strm, level);
-    if (ret != Z_OK) {
-        return ret;
-    }
-
-    /* set input data stream */
-    strm.avail_in = source_len;
-    strm.next_in = source;
-
-    /* call deflate repetitively since the out buffer size is fixed
-       and the deflated output data length is not known ahead of time */
-
-    do {
-        strm.avail_out = CHUNK;
-        strm.next_out = out;
-        ret = deflate(&strm, Z_FINISH); /* source contains the whole data */
-        assert(ret != Z_STREAM_ERROR);
-        have = CHUNK - strm.avail_out; 
-        memcpy(p_dest, out, have);
-        p_dest += have;  /* advance to the next free byte to write */
-        def_len += have; /* increment deflated data length         */
-    } while (strm.avail_out == 0);
-
-    assert(strm.avail_in == 0);   /* all input will be used  */
-    assert(ret == Z_STREAM_END);  /* stream will be complete */
-
-    /* clean up and return */
-    (void) deflateEnd(&strm);
-    *dest_len = def_len;
-    return Z_OK;
-}
-
-int mem_inf(U8 *dest, U64 *dest_len, U8 *source,  U64 source_len)
-{
-    z_stream strm;    /* pass info. to and from zlib routines   */
-    U8 out[CHUNK];    /* output buffer for inflate()            */
-    int ret = 0;      /* zlib return code                       */
-    int have = 0;     /* amount of data returned from inflate() */
-    int inf_len = 0;  /* accumulated inflated data length       */
-    U8 *p_dest = dest;/* first empty slot in dest buffer        */
-
-    /* allocate inflate state 8 */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;        /* no input data being provided   */
-    strm.next_in = Z_NULL;    /* no input data being provided   */
-    ret = inflateInit(&strm);
-    if (ret != Z_OK) {
-        return ret;
-    }
-
-    /* set input data stream */
-    strm.avail_in = source_len;
-    strm.next_in = source;
-
-    /* run inflate() on input until output buffer not full */
-    do {
-        strm.avail_out = CHUNK;
-        strm.next_out = out;
-
-        /* zlib format is self-terminating, no need to flush */
-        ret = inflate(&strm, Z_NO_FLUSH);
-        assert(ret != Z_STREAM_ERROR);    /* state no t clobbered */
-        switch(ret) {
-        case Z_NEED_DICT:
-            ret = Z_DATA_ERROR;  /* and fall through */
-        case Z_DATA_ERROR:
-        case Z_MEM_ERROR:
-            (void) inflateEnd(&strm);
-			return ret;
-        }
-        have = CHUNK - strm.avail_out;
-        memcpy(p_dest, out, have);
-        p_dest += have;  /* advance to the next free byte to write */
-        inf_len += have; /* increment inflated data length         */
-    } while (strm.avail_out == 0 );
-
-    /* clean up and return */
-    (void) inflateEnd(&strm);
-    *dest_len = inf_len;
-    
-    return (ret == Z_STREAM_END) ? Z_OK : Z_DATA_ERROR;
-}
-
 /* report a zlib or i/o error */
 void zerr(int ret)
 {
@@ -348,52 +187,3 @@ void zerr(int ret)
 	fprintf(stderr, "zlib returns err %d!\n", ret);
     }
 }
-
-/* CRC STUFF */
-
-
-/* Table of CRCs of all 8-bit messages. */
-unsigned long crc_table[256];
-
-/* Flag: has the table been computed? Initially false. */
-int crc_table_computed = 0;
-
-/* Make the table for a fast CRC. */
-void make_crc_table(void)
-{
-    unsigned long c;
-    int n, k;
-
-    for (n = 0; n < 256; n++) {
-        c = (unsigned long) n;
-        for (k = 0; k < 8; k++) {
-            if (c & 1)
-                c = 0xedb88320L ^ (c >> 1);
-            else
-                c = c >> 1;
-        }
-        crc_table[n] = c;
-    }
-    crc_table_computed = 1;
-}
- 
-
-unsigned long update_crc(unsigned long crc, unsigned char *buf, int len)
-{
-    unsigned long c = crc;
-    int n;
-
-    if (!crc_table_computed)
-        make_crc_table();
-    for (n = 0; n < len; n++) {
-        c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
-    }
-    return c;
-}
-
-/* Return the CRC of the bytes buf[0..len-1]. */
-unsigned long crc(unsigned char *buf, int len)
-{
-    return update_crc(0xffffffffL, buf, len) ^ 0xffffffffL;
-}
-
@@ -27,16 +27,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <curl/curl.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <sys/shm.h>
-#include <semaphore.h>
-#include <fcntl.h>
+#include <sys/wait.h>
+#include <time.h>
 #include "helper.h"
-#include "shm_stack.h"
+#include "par_zlib.h"
+#include "shm_slots.h"
+#include "strip_cache.h"
 
 /******************************************************************************
  * DEFINED MACROS 
@@ -47,23 +50,48 @@
 /******************************************************************************
  * GLOBALS 
  *****************************************************************************/
-U8 gp_buf_def[BUF_LEN2]; /* output buffer for mem_def() */
 
 #define IMG_URL "http://ece252-1.uwaterloo.ca:2520/image?img=1"
+#define IMG_BASE "http://ece252-1.uwaterloo.ca:2520/image"
 #define DUM_URL "https://example.com/"
 #define ECE252_HEADER "X-Ece252-Fragment: "
-#define BUF_SIZE 1048576  /* 1024*1024 = 1M */
-#define BUF_INC  524288   /* 1024*512  = 0.5M */
-#define SNAME_EMPTY "/empty1111222" // empty count
-#define SNAME_FULL "/full111122" // full count
-#define SNAME_MUTEX "/uglymotherfuckinduckling1" // mutex sem name
-#define max(a, b) \
-   ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-     _a > _b ? _a : _b; })
-
-
-
+#define CLEN_HEADER "Content-Length:"
+#define SLOT_SIZE 65536   /* bytes of png a shared slot holds */
+#define PART_CHUNK 1      /* parts a producer claims at a time, or $PART_CHUNK */
+#define PART_TRIES 3      /* fetches of a part before it is left out */
+#define IHDR_DATA (PNG_SIG_SIZE + CHUNK_LEN_SIZE + CHUNK_TYPE_SIZE) /* where a */
+#define IHDR_END (IHDR_DATA + DATA_IHDR_SIZE)  /* strip's IHDR data starts, ends */
+#define FRAME_EXTRA 49    /* rows the last strip may have over the others, */
+                          /* when the height does not divide by 50 */
+
+
+
+
+typedef struct recv_buf2 {
+    char *buf;       /* where the body goes, a shared slot; */
+                     /* NULL if it is not kept */
+    size_t size;     /* size of valid data in buf in bytes*/
+    size_t max_size; /* max capacity of buf in bytes*/
+    int seq;         /* >=0 sequence number extracted from http header */
+                     /* <0 indicates an invalid seq number */
+    long clen;       /* body length the header announced, <0 if none */
+    struct parts *parts;        /* strips claimed so far */
+    struct shm_slots *slots;    /* where claimed strips go */
+    int slot;        /* reserved for this strip, -1 if none */
+    int too_big;     /* 1 if the body did not fit its slot */
+    double wait;     /* seconds spent waiting for the slot */
+} RECV_BUF;
+
+struct parts {                  /* shared by the producers */
+    uint64_t mask;              /* strips in, or on their way; */
+                                /* see header_cb_curl() */
+    U32 next;                   /* first part nobody has claimed, */
+                                /* see part_claim() */
+    U32 chunk;                  /* parts per claim */
+    U64 dups;                   /* strips that came more than once */
+    U32 lost;                   /* strips claimed but never placed, */
+                                /* plus those nobody received */
+};
 
 struct thread_args              /* thread input parameters struct */
 {
@@ -79,20 +107,55 @@ struct thread_ret               /* thread return values struct   */
     int product;
 };
 
+enum phase {                    /* where the time goes, see phase_add() */
+    PH_FETCH,                   /* producers in cURL, less PH_WAIT */
+    PH_WAIT,                    /* producers waiting for a free slot, */
+                                /* consumers for a full one */
+    PH_INFLATE,
+    PH_DEFLATE,
+    PH_WRITE,
+    PH_MAX
+};
+
+struct phase_times {            /* shared, summed over the processes */
+    U64 ns[PH_MAX];
+};
+
+struct phase_times *phases;     /* set up before the fork */
+
+struct frame {                  /* the image, inflated, in shared memory */
+    struct data_IHDR ihdr;      /* of a strip, see frame_init() */
+    U32 stride;                 /* bytes per row, its filter byte too */
+    U32 rows;                   /* of each strip but the last */
+    U64 cap;                    /* bytes of data */
+    U32 height[50];             /* rows of each strip in, 0 if not */
+    U8 data[] __attribute__((aligned(64)));   /* strip i from row i * rows */
+};
+
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata);
 size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata);
-int recv_buf_init(RECV_BUF *ptr, size_t max_size);
+int recv_buf_init(RECV_BUF *ptr, struct parts *parts, struct shm_slots *slots);
 int recv_buf_cleanup(RECV_BUF *ptr);
 int write_file(const char *path, const void *in, size_t len);
 
 void clean_output_dir(char* folder);
-int concat_50(void** buffer); // array of pointers
+int concat_50(struct frame* frame); // the strips, in place
 int recv_buf_reset( RECV_BUF *ptr );
 
-void worker(int idx, int producers, uint64_t* bitmask, char* url, struct int_stack* stack, void** buf50);
-void producer(uint64_t* curr_mask, char* url, struct int_stack* stack);
-void consumer(uint64_t* curr_mask, struct int_stack* stack, void** buf50);
-void push_buf(void** buf50, RECV_BUF* recv_buf);
+void worker(int idx, int producers, struct parts* parts, char* url,
+            struct shm_slots* slots, struct frame* frame, int sleep_ms);
+U32 part_claim(struct parts *parts);
+CURL *part_curl(RECV_BUF *recv_buf);
+int fetch_part(CURL *curl_handle, RECV_BUF *recv_buf, char *url, U32 m);
+void producer(struct parts* parts, char* url, struct shm_slots* slots);
+void consumer(struct parts* parts, char* url, struct shm_slots* slots,
+              struct frame* frame, int sleep_ms);
+int push_buf(struct frame* frame, RECV_BUF* recv_buf, struct strip_cache* cache, char* url);
+size_t frame_bytes(const struct data_IHDR *ihdr);
+int frame_init(struct frame *f, const struct data_IHDR *ihdr);
+int frame_place(struct frame *f, int seq, const U8 *png, U64 *off, U64 *cap);
+double now(void);
+double phase_add(enum phase ph, double since);
 
 /**
  * @brief  cURL header call back function to extract image sequence number from 
@@ -107,6 +170,10 @@ void push_buf(void** buf50, RECV_BUF* recv_buf);
  * header data are received.  we are only interested in the ECE252_HEADER line 
  * received so that we can extract the image sequence number from it. This
  * explains the if block in the code.
+ * Once the header is complete the strip is claimed in the shared bitmask.
+ * Whoever sets the bit reserves a shared slot and the body goes straight
+ * there. A strip that was claimed already is counted as a duplicate, and
+ * its body is let through without being kept.
  */
 size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
 {
@@ -119,13 +186,31 @@ size_t header_cb_curl(char *p_recv, size_t size, size_t nmemb, void *userdata)
         /* extract img sequence number */
 	p->seq = atoi(p_recv + strlen(ECE252_HEADER));
 
+    } else if (strncasecmp(p_recv, CLEN_HEADER, strlen(CLEN_HEADER)) == 0) {
+        p->clen = atol(p_recv + strlen(CLEN_HEADER));
+    } else if (realsize <= 2 && p->seq >= 0 && p->seq < 50) {
+        /* the blank line ending the header */
+        uint64_t bit = (uint64_t)1 << p->seq;
+
+        if (p->clen > (long)p->slots->size) {
+            p->too_big = 1;
+        } else if ((__atomic_fetch_or(&p->parts->mask, bit, __ATOMIC_ACQ_REL) & bit) == 0) {
+            double t = now();
+
+            p->slot = slot_reserve(p->slots);  /* waits while all are full */
+            p->wait += phase_add(PH_WAIT, t);
+            p->buf = (char *)slot_data(p->slots, p->slot);
+            p->max_size = p->slots->size;
+        } else {
+            __atomic_fetch_add(&p->parts->dups, 1, __ATOMIC_RELAXED);
+        }
     }
     return realsize;
 }
 
 
 /**
- * @brief write callback function to save a copy of received data in RAM.
+ * @brief write callback function to save a copy of received data in a slot.
  *        The received libcurl data are pointed by p_recv, 
  *        which is provided by libcurl and is not user allocated memory.
  *        The user allocated memory is at p_userdata. One needs to
@@ -139,50 +224,52 @@ size_t write_cb_curl3(char *p_recv, size_t size, size_t nmemb, void *p_userdata)
     size_t realsize = size * nmemb;
     RECV_BUF *p = (RECV_BUF *)p_userdata;
  
-    if (p->size + realsize + 1 > p->max_size) {/* hope this rarely happens */ 
-        /* received data is not 0 terminated, add one byte for terminating 0 */
-        size_t new_size = p->max_size + max(BUF_INC, realsize + 1);   
-        char *q = realloc(p->buf, new_size);
-        if (q == NULL) {
-            perror("realloc"); /* out of memory */
-            return -1;
-        }
-        p->buf = q;
-        p->max_size = new_size;
+    if (p->buf == NULL) {   /* not ours, see header_cb_curl() */
+        p->size += realsize;
+        return realsize;
+    }
+    if (p->size + realsize > p->max_size) {
+        p->too_big = 1;
+        return 0;           /* makes cURL stop the transfer */
     }
 
     memcpy(p->buf + p->size, p_recv, realsize); /*copy data from libcurl*/
     p->size += realsize;
-    p->buf[p->size] = 0;
 
     return realsize;
 }
 
 
-int recv_buf_init(RECV_BUF *ptr, size_t max_size)
+/**
+ * @brief set up a receive buffer; it has no memory of its own, a claimed
+ *        strip goes into a shared slot
+ * @param struct parts *parts the strips claimed, shared by the producers
+ * @param struct shm_slots *slots where claimed strips go
+ */
+int recv_buf_init(RECV_BUF *ptr, struct parts *parts, struct shm_slots *slots)
 {
-    void *p = NULL;
-    
     if (ptr == NULL) {
         return 1;
     }
 
-    p = malloc(max_size);
-    if (p == NULL) {
-	return 2;
-    }
-    
-    ptr->buf = p;
-    ptr->size = 0;
-    ptr->max_size = max_size;
-    ptr->seq = -1;              /* valid seq should be non-negative */
-    return 0;
+    ptr->parts = parts;
+    ptr->slots = slots;
+    return recv_buf_reset(ptr);
 }
 
+/**
+ * @brief get ready for the next transfer; the slot of the last one must be
+ *        published or released already
+ */
 int recv_buf_reset( RECV_BUF *ptr ){
-    memset(ptr->buf, 0, ptr->max_size);
+    ptr->buf = NULL;
     ptr->size = 0;
+    ptr->max_size = 0;
     ptr->seq = -1;
+    ptr->clen = -1;
+    ptr->slot = -1;
+    ptr->too_big = 0;
+    ptr->wait = 0;
     return 0;
 }
 
@@ -192,9 +279,66 @@ int recv_buf_cleanup(RECV_BUF *ptr)
 	return 1;
     }
     
-    free(ptr->buf);
-    ptr->size = 0;
-    ptr->max_size = 0;
+    if (ptr->slot >= 0) {
+        slot_release(ptr->slots, ptr->slot);
+    }
+    return recv_buf_reset(ptr);
+}
+
+/**
+ * @brief memory a frame for 50 strips like this one needs, to shmget()
+ *        before frame_init()
+ * @param const struct data_IHDR *ihdr of any strip but the last
+ */
+size_t frame_bytes(const struct data_IHDR *ihdr)
+{
+    U64 stride = 1 + png_row_bytes((struct data_IHDR *)ihdr);
+
+    return sizeof(struct frame) + ((U64)50 * ihdr->height + FRAME_EXTRA) * stride;
+}
+
+/**
+ * @brief set up an empty frame in frame_bytes(ihdr) bytes of memory
+ * @return 0 on success; -1 if the strips are interlaced or of an unknown
+ *         colour type, their rows do not line up then
+ */
+int frame_init(struct frame *f, const struct data_IHDR *ihdr)
+{
+    if (ihdr->interlace != 0 || png_row_bytes((struct data_IHDR *)ihdr) == 0) {
+        return -1;
+    }
+    memset(f, 0, sizeof(*f));
+    f->ihdr = *ihdr;
+    f->stride = 1 + png_row_bytes(&f->ihdr);
+    f->rows = ihdr->height;
+    f->cap = ((U64)50 * f->rows + FRAME_EXTRA) * f->stride;
+    return 0;
+}
+
+/**
+ * @brief where strip seq goes in the frame; only the last may have a
+ *        height of its own, the others must match the strip frame_init()
+ *        was given
+ * @param const U8 *png the strip, IHDR_END bytes of it at least
+ * @param U64 *off output parameter, bytes from f->data
+ * @param U64 *cap output parameter, bytes it has there
+ * @return 0 on success; -1 if it does not fit, it is reported
+ */
+int frame_place(struct frame *f, int seq, const U8 *png, U64 *off, U64 *cap)
+{
+    struct data_IHDR ihdr;
+
+    parse_IHDR(&ihdr, png + IHDR_DATA);
+    *off = (U64)seq * f->rows * f->stride;
+    *cap = seq < 49 ? (U64)f->rows * f->stride : f->cap - *off;
+    if (ihdr.width != f->ihdr.width || ihdr.bit_depth != f->ihdr.bit_depth ||
+        ihdr.color_type != f->ihdr.color_type || ihdr.interlace != 0 ||
+        (seq < 49 && ihdr.height != f->rows) || (U64)ihdr.height * f->stride > *cap) {
+        fprintf(stderr, "strip %d: %ux%u, does not line up with the %ux%u strips\n",
+                seq, ihdr.width, ihdr.height, f->ihdr.width, f->rows);
+        return -1;
+    }
+    *cap = (U64)ihdr.height * f->stride;
     return 0;
 }
 
@@ -233,6 +377,29 @@ int write_file(const char *path, const void *in, size_t len)
     return fclose(fp);
 }
 
+/**
+ * @brief seconds since an arbitrary point, for timing
+ */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief add the time since a now() to a phase, in whichever process
+ * @return the seconds added
+ */
+double phase_add(enum phase ph, double since)
+{
+    double t = now() - since;
+
+    __atomic_fetch_add(&phases->ns[ph], (U64)(t * 1e9), __ATOMIC_RELAXED);
+    return t;
+}
+
 fout(void* buf){
 
 
@@ -240,58 +407,148 @@ fout(void* buf){
 
 int main( int argc, char** argv ) 
 {
-    int NUM_CHILD = 4; // PRODUCERS + CONSUMERS
-    int BUFFER_SIZE = 3;
+    double start = now();
+    int BUFFER_SIZE = 3; // B: strips in flight, each in a shared slot
+    int NUM_PRODUCERS = 2; // P
+    int NUM_CONSUMERS = 2; // C
+    int SLEEP_MS = 0; // X: consumers sleep this long before each strip
     int child_return;
-    uint64_t mask = 0;
     uint64_t full_mask = ((uint64_t)1<<50)-1; 
     char url[256];
-    struct int_stack* stack;
-    int shm_size = sizeof_shm_stack(BUFFER_SIZE);
+
+    // paster2 B P C X N [url], as run_lab3.sh runs it, or paster2 [url]
+    if (argc >= 6) {
+        BUFFER_SIZE = atoi(argv[1]);
+        NUM_PRODUCERS = atoi(argv[2]);
+        NUM_CONSUMERS = atoi(argv[3]);
+        SLEEP_MS = atoi(argv[4]);
+        snprintf(url, sizeof(url), "%s%cimg=%d", argc > 6 ? argv[6] : IMG_BASE,
+                 argc > 6 && strchr(argv[6], '?') ? '&' : '?', atoi(argv[5]));
+    } else if (argc <= 2) {
+        snprintf(url, sizeof(url), "%s", argc == 1 ? IMG_URL : argv[1]);
+    }
+    if ((argc > 2 && argc < 6) || BUFFER_SIZE < 1 || NUM_PRODUCERS < 1 ||
+        NUM_CONSUMERS < 1 || SLEEP_MS < 0) {
+        fprintf(stderr, "Usage: %s [B P C X N [url]] | [url]\n", argv[0]);
+        return 1;
+    }
+
+    int NUM_CHILD = NUM_PRODUCERS + NUM_CONSUMERS;
+    struct shm_slots* slots;
+    size_t shm_size = slots_bytes(BUFFER_SIZE, SLOT_SIZE);
     pid_t pid=0;
     pid_t cpids[NUM_CHILD];
     // printf("shm_size: %d\n", shm_size);
-    int stack_id = shmget( IPC_PRIVATE, shm_size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int buf50_id = shmget( IPC_PRIVATE, 50*sizeof(void*), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    int bitmask_id = shmget( IPC_PRIVATE, sizeof(long unsigned int), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR); // issue here with IPC_EXCL maybe?
-
-    sem_unlink(SNAME_EMPTY);
-    sem_unlink(SNAME_FULL);
-    sem_unlink(SNAME_MUTEX);
-    sem_t *empty = sem_open(SNAME_EMPTY, O_CREAT, 0644, 3);
-    sem_t *full = sem_open(SNAME_FULL, O_CREAT, 0644, 0);
-    sem_t *mutex = sem_open(SNAME_MUTEX, O_CREAT, 0644, 1);
-
-    if(empty == SEM_FAILED || full == SEM_FAILED || mutex == SEM_FAILED){
-        perror("sem_open(3) error");
+    int slots_id = shmget( IPC_PRIVATE, shm_size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    int parts_id = shmget( IPC_PRIVATE, sizeof(struct parts), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+    int phases_id = shmget( IPC_PRIVATE, sizeof(struct phase_times), IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+
+    if(slots_id == -1 || parts_id == -1 || phases_id == -1){
+        perror("shmget");
         exit(EXIT_FAILURE);
     }
 
 
-    int* bitmask = shmat( bitmask_id, NULL, 0); // pointer to bitmask int
-    stack = shmat( stack_id, NULL, 0);
-    void** buf50; // pointer of pointers
-    buf50 = shmat( buf50_id, NULL, 0);
+    struct parts* parts = shmat( parts_id, NULL, 0);
+    slots = shmat( slots_id, NULL, 0);
+    phases = shmat( phases_id, NULL, 0);
+    // each segment goes once the last of us exits, run after run
+    shmctl(parts_id, IPC_RMID, NULL);
+    shmctl(slots_id, IPC_RMID, NULL);
+    shmctl(phases_id, IPC_RMID, NULL);
+    memset(phases, 0, sizeof(struct phase_times));
+    memset(parts, 0, sizeof(struct parts));
+    parts->chunk = getenv("PART_CHUNK") && atoi(getenv("PART_CHUNK")) > 0 ?
+                   atoi(getenv("PART_CHUNK")) : PART_CHUNK;
 
     int i =0;
-    int buf_id;
-    for(i=0; i < 50; i++){ // create 50 shared buffer segments that consumers can dump into
-        buf_id = shmget( IPC_PRIVATE, 300000, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-        buf50[i] = shmat( buf_id, NULL, 0);
-    }
 
-    init_shm_stack(stack, BUFFER_SIZE);
+    // producers fetch strips straight into shared slots and pass the
+    // consumers only their numbers; see shm_slots.h
+    slots_init(slots, BUFFER_SIZE, SLOT_SIZE, NUM_PRODUCERS);
     
 
-    if (argc == 1) {
-        strcpy(url, IMG_URL); 
-    } else {
-        strcpy(url, argv[1]);
+    printf("%s: URL is %s\n", argv[0], url);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    // the frame is sized from a strip's IHDR: one pasted before, or else
+    // one of the first parts, which is inflated here then
+    struct strip_cache* cache = sc_open(NULL);
+    struct data_IHDR ihdr;
+    struct sc_hit hit;
+    RECV_BUF first;
+    int have = 0;
+
+    recv_buf_init(&first, parts, slots);
+    for(i=0; i < 49 && !have; i++){
+        if (sc_get(cache, url, i, &hit) && hit.png_len >= IHDR_END) {
+            parse_IHDR(&ihdr, hit.png + IHDR_DATA);
+            have = 1;
+        }
     }
+    CURL *curl_handle = have ? NULL : part_curl(&first);
+    for(i=0; i < PART_TRIES && curl_handle != NULL && !have; i++){
+        if (fetch_part(curl_handle, &first, url, i) <= 0) {
+            continue;
+        } else if (first.seq == 49 || first.size < IHDR_END) {
+            // no good to lay out by; give it back for its producer to fetch,
+            // with no consumer running yet a published slot could fill them all
+            int seq = first.seq;
+
+            recv_buf_cleanup(&first);
+            __atomic_fetch_and(&parts->mask, ~((uint64_t)1 << seq), __ATOMIC_RELEASE);
+        } else {
+            parse_IHDR(&ihdr, (U8 *)first.buf + IHDR_DATA);
+            have = 1;
+        }
+    }
+    if (curl_handle != NULL) {
+        curl_easy_cleanup(curl_handle);
+    }
+
+    int frame_id = have ? shmget( IPC_PRIVATE, frame_bytes(&ihdr),
+                                  IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR) : -1;
+    struct frame* frame = frame_id == -1 ? (void *)-1 : shmat( frame_id, NULL, 0);
+
+    if (frame_id != -1) {
+        shmctl(frame_id, IPC_RMID, NULL);
+    }
+    if (frame == (void *)-1 || frame_init(frame, &ihdr) != 0) {
+        fprintf(stderr, "%s: no strip to lay the image out by\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (first.slot >= 0) {
+        double t = now();
+
+        if (push_buf(frame, &first, cache, url) != 0) {
+            parts->lost++;
+        }
+        phase_add(PH_INFLATE, t);
+        recv_buf_cleanup(&first);
+    }
+
+    // strips pasted before go straight to their rows, inflated already;
+    // the children open the cache themselves, flock() is per open file
+    for(i=0; i < 50; i++){
+        U64 off;
+        U64 cap;
+
+        if ((parts->mask & ((uint64_t)1 << i)) == 0 && sc_get(cache, url, i, &hit) &&
+            hit.raw != NULL && hit.png_len >= IHDR_END && frame_place(frame, i, hit.png, &off, &cap) == 0 &&
+            hit.raw_len == cap) {
+            memcpy(frame->data + off, hit.raw, cap);
+            png_detach_row(frame->data + off, frame->stride - 1, png_bpp(&frame->ihdr));
+            frame->height[i] = cap / frame->stride;
+            parts->mask |= (uint64_t)1 << i;
+        }
+    }
+    sc_stats(cache, stdout);
+    sc_close(cache);
 
-    printf("%s: URL is %s\n", argv[0], url);
     int t=0;
-    for ( t = 0; t < NUM_CHILD; t++) { // One parent forks a child over and over
+    int n_child = parts->mask == full_mask ? 0 : NUM_CHILD; // all or none
+    fflush(stdout); // or the children print it all again
+    for ( t = 0; t < n_child; t++) { // One parent forks a child over and over
         
         pid = fork();
 
@@ -300,7 +557,7 @@ int main( int argc, char** argv )
             continue;
         } else if ( pid == 0 ) { /* child proc */
          //   printf("hit: %lu\n", pid);
-            worker(t, 2, bitmask, url, stack, buf50);
+            worker(t, NUM_PRODUCERS, parts, url, slots, frame, SLEEP_MS);
             exit(0);
             //break; // avoids fork bomb, child process does not interate thorugh for loop calling fork 
         } else {
@@ -312,368 +569,285 @@ int main( int argc, char** argv )
     
 
 
-    wait( &child_return );
+    for (i = 0; i < t; i++) { // every strip is in once the consumers are done
+        waitpid( cpids[i], &child_return, 0 );
+    }
+    // a part may come in answer to another's request, so what no producer
+    // received is only known now
+    parts->lost += __builtin_popcountll(full_mask & ~parts->mask);
     
     // Trivially parent process out here
 
-    concat_50(buf50); // concats the 50 items in global buffer of pointers
+    if (n_child > 0) {
+        printf("parts: claimed %u at a time, %lu fetched more than once\n",
+               parts->chunk, parts->dups);
+    }
+    concat_50(frame); // deflates the 50 strips where they are
+    curl_global_cleanup();
+    if (parts->lost > 0) {
+        fprintf(stderr, "%s: %u strips left out, their rows are blank\n", argv[0], parts->lost);
+    }
 
-    return 0;
+    // run_lab3.sh reads the time off the last line
+    printf("paster2 phases: fetch %.6f wait %.6f inflate %.6f deflate %.6f write %.6f seconds\n",
+           phases->ns[PH_FETCH] / 1e9, phases->ns[PH_WAIT] / 1e9, phases->ns[PH_INFLATE] / 1e9,
+           phases->ns[PH_DEFLATE] / 1e9, phases->ns[PH_WRITE] / 1e9);
+    printf("paster2 execution time: %.6f seconds\n", now() - start);
+    return parts->lost > 0;
 }
 
-int concat_50(void** buffer){
+int concat_50(struct frame* frame){
     int ret = 0;          /* return value for various routines             */
     U64 len_def = 0;      /* compressed data length                        */
-    U64 len_inf = 0;      /* uncompressed data length                      */
-    U64 len_concat = 0; // length of concatenated data uncompressed
-    int concat_height = 0;
-    U32 crc_val = 0;
-
-    U64 inf_buf_size = BUF_LEN2;
-    char path[100] = {0};
-
-    U8* gp_buf_inf = malloc(inf_buf_size);
-    memset(gp_buf_inf, 0, inf_buf_size);
-    memset(gp_buf_def, 0, BUF_LEN2);
-    
-
-    // LOOP writting uncompressed IDAT to file then recompress and look at length and ntoh length and ad length field to IHDR and make IEND data
-    //for(int i=0; i < 50; i++){
-//
-    //    struct chunk data;
-    //    get_png_data_IDAT( &data, buffer[i]);
-    //    //printf("%d\n", data.length);
-    //    
-    //    concat_height = concat_height + get_height(buffer[i]);
-    //    // resize array if we are nearly full or predicted to go over capacity given an average inflation sizae of ~24 times
-    //    if(len_concat+data.length*23 > inf_buf_size){
-    //        gp_buf_inf = (U8 *) realloc(gp_buf_inf, (len_concat+data.length*24)*2 );
-    //        inf_buf_size = (len_concat+data.length*23)*2;
-    //    }
-//
-    //    ret = mem_inf(gp_buf_inf + len_concat, &len_inf, data.p_data, data.length);
-    //    if (ret == 0) { /* success */
-//  //          printf("original len = %d, len_inf = %lu\n", data.length, len_inf);
-    //    } else { /* failure */
-    //        fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
-    //        return ret;
-    //    }
-//
-    //    len_concat = len_concat + len_inf;
-//  //      fclose(fp);
-//
-    //}
-    int data_len;
-    char *p_data;
-    for(int i=0; i < 50; i++){
-
-        // get concatenated height
-        // get concatenated len
-
-         concat_height = concat_height + get_height(buffer[i]);
-         memcpy(&data_len, buffer[i]+33, sizeof(int));
-         //printf("data_len: %d\n", data_len);
-         p_data = buffer[i] + 33 + sizeof(int);
-
-        // resize array if we are nearly full or predicted to go over capacity given an average inflation sizae of ~24 times
-        if(len_concat+data_len > inf_buf_size){
-            gp_buf_inf = (U8 *) realloc(gp_buf_inf, (len_concat+data_len)*2 );
-            inf_buf_size = (len_concat+data_len)*2;
-        }
-
-        memcpy(gp_buf_inf+len_concat, p_data, data_len);
-
-        //printf("len: %d\n", data_len);
-
-        len_concat += data_len;
-
-
-    }
-
-    ret = mem_def(gp_buf_def, &len_def, gp_buf_inf, len_concat, Z_DEFAULT_COMPRESSION);
+    U32 crc_def = 0;      /* crc() of gp_buf_def, from par_def() */
+    struct data_IHDR ihdr;
+
+    // the strips are in their rows already, one after another; a strip
+    // left out leaves its rows 0
+    U32 concat_height = 49 * frame->rows + frame->height[49];
+    U64 len_concat = (U64)concat_height * frame->stride;
+    U8* gp_buf_inf = frame->data;
+
+    // deflate in independent blocks on all cores and stitch them into one stream
+    double t = now();
+    U8* gp_buf_def = malloc(par_def_bound(len_concat));
+    ret = par_def(gp_buf_def, par_def_bound(len_concat), &len_def, &crc_def, gp_buf_inf,
+                  len_concat, Z_DEFAULT_COMPRESSION, par_threads(0));
+    phase_add(PH_DEFLATE, t);
     if (ret == 0) { /* success */
         printf("len inf all together = %ld, len_def = %lu\n", \
                len_concat, len_def);
     } else { /* failure */
         fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
+        free(gp_buf_def);
+        return ret;
     }
 
+    // a strip's IHDR with the height of the whole stack, then write it all at once
+    ihdr = frame->ihdr;
+    ihdr.height = concat_height;
+    t = now();
+    ret = png_write("all.png", &ihdr, gp_buf_def, len_def, &crc_def);
+    phase_add(PH_WRITE, t);
 
-    FILE* bp = fopen("all.png", "wb+");
-
-    // write png sig to file copying from the first png
-    // make sure at least one arg 
-//    FILE* fp = fopen("./outputs/0.png", "rb");                  // DO NOT DELETE
-
-    // copy ihdr from the first file into the new png that will be created so it has all the same info   
-//    char bytes[33]; // make dynamic to free]
-//    fread(bytes, 33, 1, fp); // read 33 bytes into buffer bytes
-    fwrite(buffer[0], 33, 1, bp);
-    
-    //write height to file
-    fseek(bp, 20, SEEK_SET);
-    concat_height = ntohl(concat_height);
-    fwrite( &concat_height, 4, 1, bp);
-    // calculate crc for ihdr and add
-    fseek(bp, 12, SEEK_SET); // seek to ihdr data field
-    fread(buffer[0], 17, 1, bp); // read the ihdr data field (13 bytes)
- 
-    crc_val = htonl(crc(buffer[0], 17));
-    fseek(bp, 29, SEEK_SET);    // go to crc position
-    fwrite( &crc_val, 4, 1, bp); //write crc data
-
-    // add IDAT data length and chunk type along with data
-    unsigned char idat[4] = { 'I', 'D', 'A', 'T'};
-    /* merge idat chunk type and deflated data */
-    U8* idat_crc_buf = malloc(len_def + 4);
-    
-    memcpy(idat_crc_buf, idat, 4); // copy chars into crc buffer
-    printf("hit\n");
-    memcpy(idat_crc_buf+4, gp_buf_def, len_def); // copy chars into crc buffer
-    printf("hit2\n");
-    
-    len_def = htonl(len_def);
-    fwrite(&len_def, 4,1,bp); // write length of idat chunk
-    len_def = ntohl(len_def);
-    fwrite(idat_crc_buf, len_def+4,1,bp);
-    
-    crc_val = htonl( crc(idat_crc_buf, len_def+4) ); // CRC USES TYPE AND DATA FIELD
-    fwrite(&crc_val, 4,1,bp); // write compressed binary data 
-    
-    // ADD IEND DATA AND FIX HEIGHT VALUE IN CORRECT ENDIANESS -> try pnginfo function and opening file 
-    // iend = 4 bytes of 0 + "IEND" + crc
-    unsigned char iend[8] = {0, 0, 0, 0, 'I', 'E', 'N', 'D'};
-    fwrite(iend, 8,1,bp);
-    crc_val = htonl(crc(&iend[4], 4));
-    fwrite(&crc_val, 4,1,bp); // write proper crc
-    
     /* Clean up */
-    free(idat_crc_buf);
-    fclose(bp);
-    return 0;
+    free(gp_buf_def);
+    return ret;
 }
 
-void worker( int idx, int producers, uint64_t* bitmask, char* url, struct int_stack* stack, void** buf50){ // producer and consumer count
+void worker( int idx, int producers, struct parts* parts, char* url,
+             struct shm_slots* slots, struct frame* frame, int sleep_ms){ // producer and consumer count
 
     if (idx > producers-1){
         // consumer
 //        shmat // sttach mem segment
 //        shmdt // detach
 //        shmctl // delete mem
-        consumer(bitmask, stack, buf50); // sems[0] = remaining
+        consumer(parts, url, slots, frame, sleep_ms);
         return;
     } else {
         // producer
-        producer(bitmask, url, stack); // worker and producers have their own sems
-        printf("WE DID IT \n AAAAAAAAAAAAAAAAAAAAAAA \n");
+        producer(parts, url, slots);
         return;
     }
 }
 
 
-void producer(uint64_t* curr_mask, char* url, struct int_stack* stack){
-    CURL *curl_handle;
-    CURLcode res;
-    RECV_BUF recv_buf;
-    uint64_t full_mask = ((uint64_t)1<<50)-1; 
-    char fname[256];
-    pid_t pid = getpid();
-
-    //sem_t spots_left = sem_open(SNAME_EMPTY, 0);
-    //sem_t* in_q = sem_open(SNAME_FULL, 0);
-    //sem_t* mutex = sem_open(SNAME_MUTEX, 0);
-    sem_t* spots_left = sem_open(SNAME_EMPTY, 0);
-    sem_t* in_q = sem_open(SNAME_FULL, 0);
-    sem_t* mutex = sem_open(SNAME_MUTEX, 0);
-
-    recv_buf_init(&recv_buf, 10000);
-
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+/**
+ * @brief claim the next parts to fetch, parts->chunk of them; every part is
+ *        claimed by exactly one producer
+ * @return the first of them; 50 or more once every part is claimed
+ */
+U32 part_claim(struct parts *parts)
+{
+    return __atomic_fetch_add(&parts->next, parts->chunk, __ATOMIC_RELAXED);
+}
 
-    /* init a curl session */
-    curl_handle = curl_easy_init();
+/**
+ * @brief a cURL session that fetches strips into shared slots
+ * @return the handle; NULL on failure, it is reported
+ */
+CURL *part_curl(RECV_BUF *recv_buf)
+{
+    CURL *curl_handle = curl_easy_init();
 
     if (curl_handle == NULL) {
         fprintf(stderr, "curl_easy_init: returned NULL\n");
+        return NULL;
     }
-    
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
     curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_cb_curl3); 
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&recv_buf);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)recv_buf);
     curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, header_cb_curl); 
-    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)&recv_buf);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void *)recv_buf);
     curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+    return curl_handle;
+}
+
+/**
+ * @brief ask for part m once; the header callback claims the strip that
+ *        comes and reserves it a slot, the body goes straight in; see
+ *        header_cb_curl()
+ * @return 1 if a strip is in recv_buf->slot, to publish or release;
+ *         0 if not, ask again; -1 if it is to be left out
+ */
+int fetch_part(CURL *curl_handle, RECV_BUF *recv_buf, char *url, U32 m)
+{
+    char part_url[300];
+    CURLcode res;
+
+    snprintf(part_url, sizeof(part_url), "%s%cpart=%u", url, strchr(url, '?') ? '&' : '?', m);
+    curl_easy_setopt(curl_handle, CURLOPT_URL, part_url);
 
+    recv_buf_reset( recv_buf ); // clear buffer every time
+    double t = now();
     res = curl_easy_perform(curl_handle);
-        
-    while(*curr_mask != full_mask){  
+    phase_add(PH_FETCH, t + recv_buf->wait); // the wait is counted already
+
+    if (recv_buf->too_big) {
+        // left out rather than fetched again and again: claimed, so nobody
+        // asks for it again, and counted once, by whoever claimed it
+        uint64_t bit = (uint64_t)1 << (recv_buf->seq & 63);
+
+        if (recv_buf->slot >= 0 || (recv_buf->seq >= 0 && recv_buf->seq < 50 &&
+            (__atomic_fetch_or(&recv_buf->parts->mask, bit, __ATOMIC_ACQ_REL) & bit) == 0)) {
+            fprintf(stderr, "strip %d: more than the %u bytes a slot holds\n",
+                    recv_buf->seq, recv_buf->slots->size);
+            __atomic_fetch_add(&recv_buf->parts->lost, 1, __ATOMIC_RELAXED);
+        }
+        recv_buf_cleanup(recv_buf);
+        return -1;
+    } else if( res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        if (recv_buf->slot >= 0) {   // give the strip up for another try
+            recv_buf_cleanup(recv_buf);
+            __atomic_fetch_and(&recv_buf->parts->mask, ~((uint64_t)1 << recv_buf->seq),
+                               __ATOMIC_RELEASE);
+        }
+        return 0;
+    } else if (recv_buf->seq < 0 || recv_buf->seq >= 50) {
+        fprintf(stderr, "no strip number in the header\n");
+        return 0;
+    }
+    // printf("%lu bytes received in memory %p, seq=%d.\n", recv_buf->size, recv_buf->buf, recv_buf->seq);
+    return recv_buf->slot >= 0;
+}
+
+void producer(struct parts* parts, char* url, struct shm_slots* slots){
+    CURL *curl_handle;
+    RECV_BUF recv_buf;
+    U64 pushed = 0;             /* strips this producer passed on */
+    U32 first;
 
-        recv_buf_reset( &recv_buf ); // clear buffer every time
-        res = curl_easy_perform(curl_handle);
+    recv_buf_init(&recv_buf, parts, slots);
 
-        if( res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        } else {
-	        // printf("%lu bytes received in memory %p, seq=%d.\n", recv_buf.size, recv_buf.buf, recv_buf.seq);
-            if( 0 == ( (uint64_t) *curr_mask & ((uint64_t)1<< recv_buf.seq)) ){  
-                *(curr_mask) |= (uint64_t)1 << recv_buf.seq;
-
-                //int s0;
-                //int s1;
-                //sem_getvalue(spots_left, &s0);
-                //sem_getvalue(in_q, &s1);
-                
-                // create shared mem and store recv buf data there
-                //free(recv_buf.buf);
-                //recv_buf.buf = new_buf;
-
-                sem_wait(spots_left); // wait until there are spots left in buffer
-                sem_wait(mutex); // lock threads to buffer 
-                //if( push(stack, recv_buf) != 0){
-                //    printf("ERROR ERROR 1 \n");
-                //}
-                
-                push(stack, recv_buf);
-                
-                
-
-                // int len;
-                // memcpy(&len, recv_buf.buf+33, sizeof(U32));
-                // len = htonl(len);
-                // printf("aa%.*sbb\n", 1000, recv_buf.buf);
-                // printf("UH %d\n", len);
-
-                //int len;
-                //memcpy(&len, stack->items[stack->pos].buf+33, sizeof(U32));
-                //len = htonl(len);
-                //printf("aa%.*sbb\n", 1000, stack->items[stack->pos].buf);
-                //printf("UH %d\n", len);
-
-                //printf("hit\n");
-                //++(stack->pos);
-                //stack->items[stack->pos] = *copy_buf(recv_buf);
-
-                //printf("aa%.*sbb\n", stack->items[stack->pos].size, stack->items[stack->pos].buf);
-                //printf("aa%.*sbb\n", stack->items[stack->pos].size, copy_buf(recv_buf));
-                //printf("aa%.*sbb\n", stack->items[stack->pos].size, stack->items[stack->pos].buf);
-                //printf("aa%.*sbb\n", recv_buf.size, recv_buf.buf);
-                sem_post(mutex); // back to normal operations
-                sem_post(in_q); // Add one to q counter
-            //    printf("curr_mask2: %lu\n", *curr_mask);
-                
-                
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    /* init a curl session */
+    curl_handle = part_curl(&recv_buf);
 
+    if (curl_handle == NULL) {
+        slots_done(slots);      // the consumers must not wait for us
+        return;
+    }
+
+    // ask for the parts by number, each producer its own; see part_claim()
+    while ((first = part_claim(parts)) < 50) {
+        for (U32 m = first; m < first + parts->chunk && m < 50; m++) {
+            uint64_t bit = (uint64_t)1 << m;
+            int got = 0;
+
+            // pasted before, or in; see main() and header_cb_curl()
+            for (int tries = 0; tries < PART_TRIES && got >= 0 &&
+                 (__atomic_load_n(&parts->mask, __ATOMIC_ACQUIRE) & bit) == 0; tries++) {
+                got = fetch_part(curl_handle, &recv_buf, url, m);
+                if (got > 0) {
+                    slot_publish(slots, recv_buf.slot, recv_buf.seq, recv_buf.size);
+                    recv_buf.slot = -1;     // the consumers' now
+                    pushed++;
+                }
+            }
+            if ((__atomic_load_n(&parts->mask, __ATOMIC_ACQUIRE) & bit) == 0) {
+                fprintf(stderr, "part %u: not received in %d tries\n", m, PART_TRIES);
             }
         }
     }
+    slots_done(slots);  // the last producer out lets the consumers stop
+
         /* cleaning up */
     curl_easy_cleanup(curl_handle);
     curl_global_cleanup();
     recv_buf_cleanup(&recv_buf);
+    printf("producer: %lu strips fetched into shared slots\n", pushed);
         
   //  return ((void *)p_out);
     }
 
-    // if bad get another image
-    // if good check stack full
-    // while full wait
-    // push stack
-    // loop
-
-void consumer(uint64_t* curr_mask, struct int_stack* stack, void** buf50){
-    uint64_t full_mask = ((uint64_t)1<<50)-1; 
+void consumer(struct parts* parts, char* url, struct shm_slots* slots,
+              struct frame* frame, int sleep_ms){
     RECV_BUF recv_buf;
-
-    sem_t* spots_left = sem_open(SNAME_EMPTY, 0);
-    sem_t* in_q = sem_open(SNAME_FULL, 0);
-    sem_t* mutex = sem_open(SNAME_MUTEX, 0);
-
-    void* tmp_buf = malloc(10000);
-
-    //int s1 = 0;
-    //while(1){
-    //    sem_getvalue(&in_q, &s1);
-    //    printf("consumer in_q: %d\n", s1);
-    //}
-    while( (*curr_mask != full_mask) || !is_empty(stack)){  
-        //int s0;
-        //int s1;
-        //sem_getvalue(spots_left, &s0);
-        //sem_getvalue(in_q, &s1);
-        //printf("consumer spots_left: %d in_q: %d\n", s0, s1);
-        
-//        recv_buf_reset( &recv_buf );
-        sem_wait(in_q); // wait until something in q
-        sem_wait(mutex); 
-               
-        //f( pop(stack, recv_buf) != 0){
-        //   printf("ERROR ERROR 2\n");
-        //
-        //printf("aa%.*sbb\n", stack->items[stack->pos].size, stack->items[stack->pos].buf);
-        // recv_buf = stack->items[stack->pos];
-        // --(stack->pos);
-        //printf("aa%.*sbb\n", stack->items[stack->pos].size, stack->items[stack->pos].buf);
-        pop(stack, &recv_buf);
-        //printf("aa%.*sbb\n", recv_buf.size, recv_buf.buf);
-
-        memcpy(tmp_buf, recv_buf.buf, recv_buf.size );
-
-        sem_post(mutex);
-        sem_post(spots_left); // let em know we yoinked it
-
-        //printf("aa%.*sbb\n", 10, recv_buf.buf);
-        //printf("SEQ: %d\n", recv_buf.seq);
-
-
-        recv_buf.buf = tmp_buf;
-        push_buf(buf50, &recv_buf);
-        
+    struct strip_cache* cache = sc_open(NULL);
+    int i;
+    int seq;
+    U32 len;
+    double t = now();
+
+    // strips come out oldest first and are inflated from their slot where
+    // they are, straight to their rows of the frame; once the producers are
+    // done and none is left, slot_next() fails and we are done too
+    while ((i = slot_next(slots, &seq, &len)) >= 0) {
+        phase_add(PH_WAIT, t);
+        usleep(sleep_ms * 1000); // X, the slot stays taken meanwhile
+        recv_buf.buf = (char *)slot_data(slots, i);
+        recv_buf.size = len;
+        recv_buf.seq = seq;
+        t = now();
+        if (push_buf(frame, &recv_buf, cache, url) != 0) {
+            __atomic_fetch_add(&parts->lost, 1, __ATOMIC_RELAXED);  // claimed, not refetched
+        }
+        phase_add(PH_INFLATE, t);
+        slot_release(slots, i);
+        t = now();
     }
-    
-    
+    phase_add(PH_WAIT, t);
+    sc_close(cache);
 }
 
-void push_buf(void** buf50, RECV_BUF *recv_buf){
-    
-    //create new shared mem location to hold recv_buf
-    // copy over to shared mem 
-    // put shared mem pointer in buf50
-//    printf("BUF50 SEQ ADDED: %d\n", recv_buf.seq);
-    //int new_id = shmget( IPC_PRIVATE, recv_buf.size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
-    //void* new_mem = shmat( new_id, NULL, 0);
-    //buf50[recv_buf.seq] = new_mem;
-    //memcpy(new_mem, recv_buf.buf, recv_buf.size);
-    //printf("aa%.*sbb\n", recv_buf->size, recv_buf->buf);
-    //printf("aa%.*sbb\n", recv_buf->size, recv_buf->buf);
-
-    struct chunk data;
-    get_png_data_IDAT( &data, recv_buf->buf);
-    //printf("%d\n", data.length);
-    
-    //int height = get_height(recv_buf->buf);
-    int size = 0;
-    void* bp = buf50[recv_buf->seq];
-    int ret = mem_inf(bp+33+sizeof(int), &size, data.p_data, data.length);
-
-    if (ret == 0) { /* success */
-//           printf("original len = %d, len_inf = %lu\n", data.length, len_inf);
-    } else { /* failure */
-        fprintf(stderr,"mem_def failed. ret = %d.\n", ret);
-        return ret;
+/**
+ * @brief inflate a strip straight to its rows of the frame, its first row
+ *        rewritten to decode under the strip above, see png_detach_row()
+ * @return 0 on success; -1 if it does not fit there or does not inflate, it
+ *         is left out then
+ */
+int push_buf(struct frame* frame, RECV_BUF *recv_buf, struct strip_cache* cache, char* url){
+    U64 off;
+    U64 cap;
+    U64 size = 0;
+
+    if (recv_buf->size < IHDR_END) {
+        fprintf(stderr, "strip %d: %lu bytes, too short for a png\n",
+                recv_buf->seq, recv_buf->size);
+        return -1;
+    }
+    if (frame_place(frame, recv_buf->seq, (U8 *)recv_buf->buf, &off, &cap) != 0) {
+        return -1;
     }
 
-    memcpy(bp, recv_buf->buf, 33); // copy IHDR to first 33 Bytes
-    memcpy(bp+33, &size, sizeof(int)); // write data size to second int index in array
-
-        // len_concat = len_concat + len_inf;
-
-    
-    // memcpy(bp, recv_buf->buf, recv_buf->size);
+    int ret = zc_inf_idat(frame->data + off, cap, &size,
+                          (U8 *)recv_buf->buf, recv_buf->size);
 
-    //int len;
-    //memcpy(&len, bp+33, sizeof(U32));
-    //len = htonl(len);
-    //printf("UH %d\n", len);
+    if (ret != 0 || size != cap) { /* failure */
+        fprintf(stderr,"mem_inf failed. ret = %d.\n", ret);
+        return -1;
+    }
+    // its first row was filtered against zeros, not the strip above
+    if (png_detach_row(frame->data + off, frame->stride - 1, png_bpp(&frame->ihdr)) != 0) {
+        fprintf(stderr, "strip %d: invalid filter type\n", recv_buf->seq);
+        return -1;
+    }
+    frame->height[recv_buf->seq] = cap / frame->stride;
 
-    
+    // the next paste of this image finds it already inflated
+    sc_put(cache, url, recv_buf->seq, (U8 *)recv_buf->buf, recv_buf->size,
+           frame->data + off, size);
+    return 0;
 }
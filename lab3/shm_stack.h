@@ -107,6 +107,7 @@ int init_shm_stack(ISTACK *p, int stack_size)
     p->items = (RECV_BUF *) (p + sizeof(ISTACK));
     int buf_id = shmget( IPC_PRIVATE, 10000*stack_size, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
     p->buf = shmat( buf_id, NULL, 0);
+    shmctl(buf_id, IPC_RMID, NULL); // gone once nobody has it attached
     
     return 0;
 }
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+############################################################################
+# File Name  : stub.py
+# Usage      : python3 stub.py <port> [sleep] [strips] [png]
+#              e.g. python3 stub.py 2520 0.02 50
+# Description: a local stand-in for the ece252 image servers. The png,
+#              ../lab1/finished/images/uweng.png by default, is cut into
+#              strips (50) of the same height, the last one taking the
+#              rows left over, and GET /image answers with one of them:
+#              strip M for ?part=M, a random one otherwise; img= is
+#              ignored. The strip number goes out in X-Ece252-Fragment,
+#              as the real servers send it. Each answer is held back
+#              sleep seconds (0) to stand in for the network. The png
+#              must be 8 bits per sample and not palette based. The first
+#              row of strip i is filtered with Sub, Up, Average and Paeth
+#              in turn, as an encoder choosing filters row by row may, so
+#              a paster must not take it for a row of the image above;
+#              the other rows go out unfiltered.
+#############################################################################
+import http.server
+import os
+import random
+import socketserver
+import struct
+import sys
+import time
+import urllib.parse
+import zlib
+
+BPP = {0: 1, 2: 3, 4: 2, 6: 4}  # bytes per pixel at 8 bits, by colour type
+
+
+def chunk(ctype, data):
+    return (struct.pack('>I', len(data)) + ctype + data +
+            struct.pack('>I', zlib.crc32(ctype + data)))
+
+
+def paeth(a, b, c):
+    p = a + b - c
+    pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+    if pa <= pb and pa <= pc:
+        return a
+    return b if pb <= pc else c
+
+
+def filter_first(f, row, bpp):
+    """row filtered with type f against the zero row above a png's top"""
+    out = bytearray(row)
+    for x in range(len(row)):
+        a = row[x - bpp] if x >= bpp else 0
+        out[x] = (row[x] - (0, a, 0, a // 2, paeth(a, 0, 0))[f]) & 0xff
+    return bytes([f]) + bytes(out)
+
+
+def read_rows(path):
+    """the IHDR fields and the unfiltered rows of the png at path"""
+    d = open(path, 'rb').read()
+    pos, idat = 8, b''
+    while pos < len(d):
+        n, ctype = struct.unpack('>I4s', d[pos:pos + 8])
+        if ctype == b'IHDR':
+            ihdr = struct.unpack('>IIBBBBB', d[pos + 8:pos + 21])
+        elif ctype == b'IDAT':
+            idat += d[pos + 8:pos + 8 + n]
+        pos += 12 + n
+    w, h, depth, ctype, _, _, interlace = ihdr
+    if depth != 8 or ctype not in BPP or interlace:
+        sys.exit('%s: not an 8 bit, non-palette, non-interlaced png' % path)
+    bpp, stride = BPP[ctype], w * BPP[ctype]
+    raw, rows, prev = zlib.decompress(idat), [], bytearray(stride)
+    for y in range(h):
+        start = y * (stride + 1)
+        f, row = raw[start], bytearray(raw[start + 1:start + 1 + stride])
+        for x in range(stride):
+            a = row[x - bpp] if x >= bpp else 0
+            b = prev[x]
+            c = prev[x - bpp] if x >= bpp else 0
+            row[x] = (row[x] + (0, a, b, (a + b) // 2, paeth(a, b, c))[f]) & 0xff
+        rows.append(bytes(row))
+        prev = row
+    return ihdr, rows
+
+
+def make_strips(path, n):
+    """the png at path as n pngs of height // n rows, the last one more"""
+    (w, h, depth, ctype, _, _, _), rows = read_rows(path)
+    base, strips = h // n, []
+    for i in range(n):
+        part = rows[i * base:h if i == n - 1 else (i + 1) * base]
+        ihdr = struct.pack('>IIBBBBB', w, len(part), depth, ctype, 0, 0, 0)
+        idat = zlib.compress(filter_first(1 + i % 4, part[0], BPP[ctype]) +
+                             b''.join(b'\0' + r for r in part[1:]))
+        strips.append(b'\x89PNG\r\n\x1a\n' + chunk(b'IHDR', ihdr) +
+                      chunk(b'IDAT', idat) + chunk(b'IEND', b''))
+    return strips
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'   # keep-alive, as libcurl reuses connections
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        q = urllib.parse.parse_qs(urllib.parse.urlparse(self.path).query)
+        n = len(STRIPS)
+        i = int(q['part'][0]) % n if 'part' in q else random.randrange(n)
+        if SLEEP > 0:
+            time.sleep(SLEEP)
+        self.send_response(200)
+        self.send_header('Content-Type', 'image/png')
+        self.send_header('Content-Length', str(len(STRIPS[i])))
+        self.send_header('X-Ece252-Fragment', str(i))
+        self.end_headers()
+        self.wfile.write(STRIPS[i])
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 128        # P producers connect at once
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        sys.exit('Usage: %s <port> [sleep] [strips] [png]' % sys.argv[0])
+    here = os.path.dirname(os.path.abspath(__file__))
+    SLEEP = float(sys.argv[2]) if len(sys.argv) > 2 else 0
+    STRIPS = make_strips(sys.argv[4] if len(sys.argv) > 4 else
+                         os.path.join(here, '../lab1/finished/images/uweng.png'),
+                         int(sys.argv[3]) if len(sys.argv) > 3 else 50)
+    Server(('127.0.0.1', int(sys.argv[1])), Handler).serve_forever()